@@ -137,6 +137,15 @@ HEADERS += src/qt/bitcoingui.h \
     src/util.h \
     src/uint256.h \
     src/kernel.h \
+    src/minerhash.h \
+    src/hashbackend.h \
+    src/checkqueue.h \
+    src/cuckoocache.h \
+    src/kvstore.h \
+    src/arena.h \
+    src/blockindexmap.h \
+    src/blockfile.h \
+    src/lrucache.h \
     src/serialize.h \
     src/strlcpy.h \
     src/main.h \
@@ -266,7 +275,12 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/qtipcserver.cpp \
     src/qt/rpcconsole.cpp \
     src/noui.cpp \
-    src/kernel.cpp
+    src/kernel.cpp \
+    src/minerhash.cpp \
+    src/hashbackend.cpp \
+    src/kvstore.cpp \
+    src/blockindexmap.cpp \
+    src/blockfile.cpp
 
 RESOURCES += \
     src/qt/bitcoin.qrc
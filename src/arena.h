@@ -0,0 +1,90 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ARENA_H
+#define BITCOIN_ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+/** Pool of fixed-size slots for objects of type T.
+ *
+ * Slots are carved out of large chunks, so there is no per-object malloc
+ * header and objects allocated together sit next to each other in memory.
+ * Freed slots are kept on a free list and reused; chunks are only returned
+ * when the arena is destroyed. Objects never move. Not thread safe: the
+ * caller locks.
+ */
+template<typename T, size_t CHUNK_SLOTS = 4096>
+class CArena
+{
+private:
+    union CSlot
+    {
+        CSlot* pnext;
+        // Alignment of the object stored in the slot
+        long long nAlign;
+        void* pAlign;
+        char data[sizeof(T)];
+    };
+
+    std::vector<CSlot*> vChunks;
+    CSlot* pfree;
+    size_t nUsedInChunk;
+    size_t nAllocated;
+
+    CArena(const CArena&);
+    void operator=(const CArena&);
+
+public:
+    CArena() : pfree(NULL), nUsedInChunk(CHUNK_SLOTS), nAllocated(0)
+    {
+    }
+
+    ~CArena()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+    }
+
+    // Uninitialized memory for one T; construct it with placement new
+    void* Allocate()
+    {
+        nAllocated++;
+        if (pfree)
+        {
+            CSlot* p = pfree;
+            pfree = p->pnext;
+            return p;
+        }
+        if (nUsedInChunk == CHUNK_SLOTS)
+        {
+            vChunks.reserve(vChunks.size() + 1);
+            vChunks.push_back(static_cast<CSlot*>(::operator new(sizeof(CSlot) * CHUNK_SLOTS)));
+            nUsedInChunk = 0;
+        }
+        return &vChunks.back()[nUsedInChunk++];
+    }
+
+    // Return a slot; the object in it must already be destroyed
+    void Free(void* p)
+    {
+        if (!p)
+            return;
+        CSlot* pslot = static_cast<CSlot*>(p);
+        pslot->pnext = pfree;
+        pfree = pslot;
+        nAllocated--;
+    }
+
+    size_t GetAllocated() const { return nAllocated; }
+
+    // Bytes held, including free slots and the unused end of the last chunk
+    size_t GetMemoryUsage() const
+    {
+        return vChunks.size() * CHUNK_SLOTS * sizeof(CSlot) + vChunks.capacity() * sizeof(CSlot*);
+    }
+};
+
+#endif
@@ -0,0 +1,345 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "sync.h"
+#include "util.h"
+
+#include <list>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Block files grow to 2GB, so a 32-bit process can only map one at a time
+static const unsigned int MAX_BLOCKFILE_MAPPINGS = sizeof(void*) > 4 ? 16 : 1;
+
+// FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
+static const unsigned int MAX_BLOCKFILE_SIZE = 0x7F000000 - MAX_SIZE;
+
+// Space is reserved in chunks, so a block file is not fragmented by growing
+// a block at a time
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 16 << 20;
+
+// Written blocks are synced together once this many bytes or seconds have
+// gone by without a sync
+static const unsigned int BLOCKFILE_SYNC_BYTES = 16 << 20;
+static const int64 BLOCKFILE_SYNC_INTERVAL = 5;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile)
+{
+    string strBlockFn = strprintf("blk%04u.dat", nFile);
+    return GetDataDir() / strBlockFn;
+}
+
+CBlockFileMapping::CBlockFileMapping() : pbegin(NULL), nSize(0)
+{
+#ifdef WIN32
+    hFile = INVALID_HANDLE_VALUE;
+    hMapping = NULL;
+#else
+    fd = -1;
+#endif
+}
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+    Close();
+}
+
+#ifdef WIN32
+bool CBlockFileMapping::Open(const boost::filesystem::path& path)
+{
+    Close();
+    hFile = CreateFileA(path.string().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    if (!GetFileSize(nSize) || nSize == 0)
+    {
+        Close();
+        return false;
+    }
+    hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL)
+    {
+        Close();
+        return false;
+    }
+    pbegin = (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, nSize);
+    if (pbegin == NULL)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void CBlockFileMapping::Close()
+{
+    if (pbegin)
+        UnmapViewOfFile(pbegin);
+    if (hMapping != NULL)
+        CloseHandle(hMapping);
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+    pbegin = NULL;
+    nSize = 0;
+    hMapping = NULL;
+    hFile = INVALID_HANDLE_VALUE;
+}
+
+bool CBlockFileMapping::GetFileSize(size_t& nSizeRet) const
+{
+    LARGE_INTEGER nFileSize;
+    if (!GetFileSizeEx(hFile, &nFileSize))
+        return false;
+    nSizeRet = (size_t)nFileSize.QuadPart;
+    return true;
+}
+#else
+bool CBlockFileMapping::Open(const boost::filesystem::path& path)
+{
+    Close();
+    fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    if (!GetFileSize(nSize) || nSize == 0)
+    {
+        Close();
+        return false;
+    }
+    void* p = mmap(NULL, nSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    pbegin = (const char*)p;
+    return true;
+}
+
+void CBlockFileMapping::Close()
+{
+    if (pbegin)
+        munmap((void*)pbegin, nSize);
+    if (fd != -1)
+        close(fd);
+    pbegin = NULL;
+    nSize = 0;
+    fd = -1;
+}
+
+bool CBlockFileMapping::GetFileSize(size_t& nSizeRet) const
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+    nSizeRet = (size_t)st.st_size;
+    return true;
+}
+#endif
+
+
+static CCriticalSection cs_mapBlockFile;
+static list<pair<unsigned int, boost::shared_ptr<CBlockFileMapping> > > listBlockFileMappings;  // most recently used first
+
+boost::shared_ptr<CBlockFileMapping> GetBlockFileMapping(unsigned int nFile, size_t nMinSize)
+{
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return boost::shared_ptr<CBlockFileMapping>();
+
+    LOCK(cs_mapBlockFile);
+    list<pair<unsigned int, boost::shared_ptr<CBlockFileMapping> > >::iterator it = listBlockFileMappings.begin();
+    while (it != listBlockFileMappings.end() && it->first != nFile)
+        ++it;
+    if (it != listBlockFileMappings.end())
+    {
+        boost::shared_ptr<CBlockFileMapping> pmap = it->second;
+        listBlockFileMappings.erase(it);
+
+        // The file being appended to may have grown past the mapping.
+        // Readers still using the old mapping keep it alive.
+        size_t nFileSize;
+        if (pmap->size() >= nMinSize || !pmap->GetFileSize(nFileSize) || nFileSize <= pmap->size())
+        {
+            listBlockFileMappings.push_front(make_pair(nFile, pmap));
+            return pmap;
+        }
+    }
+
+    boost::shared_ptr<CBlockFileMapping> pmap(new CBlockFileMapping());
+    if (!pmap->Open(BlockFilePath(nFile)))
+        return boost::shared_ptr<CBlockFileMapping>();
+    listBlockFileMappings.push_front(make_pair(nFile, pmap));
+    while (listBlockFileMappings.size() > MAX_BLOCKFILE_MAPPINGS)
+        listBlockFileMappings.pop_back();
+    return pmap;
+}
+
+void CloseBlockFileMappings()
+{
+    LOCK(cs_mapBlockFile);
+    listBlockFileMappings.clear();
+}
+
+
+static CCriticalSection cs_blockFileWriter;
+static FILE* fileBlockWriter = NULL;
+static unsigned int nBlockWriterFile = 1;
+static unsigned int nBlockWriterPos = 0;        // end of the data written
+static unsigned int nBlockWriterReserved = 0;   // end of the space reserved
+static unsigned int nBlockWriterSynced = 0;     // end of the data on disk
+static int64 nBlockWriterUnsyncedTime = 0;      // first write since the last sync
+
+// Reserve disk space past the end of the file without changing its size,
+// where the file system can, so readers still see where the data ends
+static void ReserveBlockFileSpace(FILE* file, unsigned int nOffset, unsigned int nLength)
+{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, nOffset, nLength);
+#endif
+}
+
+static void CloseBlockFileWriter()
+{
+    if (!fileBlockWriter)
+        return;
+    FileCommit(fileBlockWriter);
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    // Give back the space reserved past the end
+    if (ftruncate(fileno(fileBlockWriter), nBlockWriterPos) != 0)
+        printf("CloseBlockFileWriter() : ftruncate failed\n");
+#endif
+    fclose(fileBlockWriter);
+    fileBlockWriter = NULL;
+}
+
+static bool OpenBlockFileWriter()
+{
+    while (true)
+    {
+        FILE* file = fopen(BlockFilePath(nBlockWriterFile).string().c_str(), "ab");
+        if (!file)
+            return error("OpenBlockFileWriter() : open %s failed", BlockFilePath(nBlockWriterFile).string().c_str());
+        long nEnd = -1;
+        if (fseek(file, 0, SEEK_END) == 0)
+            nEnd = ftell(file);
+        if (nEnd < 0)
+        {
+            fclose(file);
+            return error("OpenBlockFileWriter() : seek failed");
+        }
+        if (nEnd < (long)MAX_BLOCKFILE_SIZE)
+        {
+            fileBlockWriter = file;
+            nBlockWriterPos = nBlockWriterReserved = nBlockWriterSynced = (unsigned int)nEnd;
+            return true;
+        }
+        fclose(file);
+        nBlockWriterFile++;
+    }
+}
+
+bool AppendBlockFile(const char* pch, size_t nSize, unsigned int& nFileRet, unsigned int& nPosRet)
+{
+    LOCK(cs_blockFileWriter);
+    if (fileBlockWriter && nBlockWriterPos >= MAX_BLOCKFILE_SIZE)
+    {
+        CloseBlockFileWriter();
+        nBlockWriterFile++;
+    }
+    if (!fileBlockWriter && !OpenBlockFileWriter())
+        return false;
+
+    if (nBlockWriterPos + nSize > nBlockWriterReserved)
+    {
+        unsigned int nReserve = (nBlockWriterPos + nSize - nBlockWriterReserved + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE * BLOCKFILE_CHUNK_SIZE;
+        ReserveBlockFileSpace(fileBlockWriter, nBlockWriterReserved, nReserve);
+        nBlockWriterReserved += nReserve;
+    }
+
+    // Flushed to the OS, so the block can be read back straight away
+    if (fwrite(pch, 1, nSize, fileBlockWriter) != nSize || fflush(fileBlockWriter) != 0)
+    {
+        // Open the file again at wherever its data really ends
+        CloseBlockFileWriter();
+        return error("AppendBlockFile() : write to %s failed", BlockFilePath(nBlockWriterFile).string().c_str());
+    }
+    if (nBlockWriterSynced == nBlockWriterPos)
+        nBlockWriterUnsyncedTime = GetTime();
+    nFileRet = nBlockWriterFile;
+    nPosRet = nBlockWriterPos;
+    nBlockWriterPos += nSize;
+    return true;
+}
+
+void SyncBlockFile()
+{
+    LOCK(cs_blockFileWriter);
+    if (!fileBlockWriter || nBlockWriterSynced == nBlockWriterPos)
+        return;
+    FileCommit(fileBlockWriter);
+    nBlockWriterSynced = nBlockWriterPos;
+}
+
+void CloseBlockFile()
+{
+    LOCK(cs_blockFileWriter);
+    CloseBlockFileWriter();
+}
+
+void ThreadSyncBlockFile(void* parg)
+{
+    // Make this thread recognisable as the block file syncing thread
+    RenameThread("jackpotcoin-blocksync");
+
+    while (!fShutdown)
+    {
+        MilliSleep(500);
+
+#ifdef WIN32
+        LOCK(cs_blockFileWriter);
+        if (!fileBlockWriter || nBlockWriterSynced == nBlockWriterPos)
+            continue;
+        if (nBlockWriterPos - nBlockWriterSynced < BLOCKFILE_SYNC_BYTES && GetTime() - nBlockWriterUnsyncedTime < BLOCKFILE_SYNC_INTERVAL)
+            continue;
+        FileCommit(fileBlockWriter);
+        nBlockWriterSynced = nBlockWriterPos;
+#else
+        // Sync through a duplicate descriptor, so blocks can still be
+        // appended while the disk catches up
+        int fd;
+        unsigned int nFile, nPos;
+        {
+            LOCK(cs_blockFileWriter);
+            if (!fileBlockWriter || nBlockWriterSynced == nBlockWriterPos)
+                continue;
+            if (nBlockWriterPos - nBlockWriterSynced < BLOCKFILE_SYNC_BYTES && GetTime() - nBlockWriterUnsyncedTime < BLOCKFILE_SYNC_INTERVAL)
+                continue;
+            fd = dup(fileno(fileBlockWriter));
+            nFile = nBlockWriterFile;
+            nPos = nBlockWriterPos;
+        }
+        if (fd == -1)
+            continue;
+        bool fSynced = (fsync(fd) == 0);
+        close(fd);
+        if (fSynced)
+        {
+            LOCK(cs_blockFileWriter);
+            if (nBlockWriterFile == nFile && nBlockWriterSynced < nPos)
+            {
+                nBlockWriterSynced = nPos;
+                if (nBlockWriterSynced != nBlockWriterPos)
+                    nBlockWriterUnsyncedTime = GetTime();
+            }
+        }
+#endif
+    }
+}
@@ -0,0 +1,146 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include <string.h>
+#include <ios>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "serialize.h"
+
+boost::filesystem::path BlockFilePath(unsigned int nFile);
+
+/** Append a record to the block file being written, which stays open.
+ * nPosRet is the offset of the record in file nFileRet. The bytes are
+ * readable as soon as this returns, but only durable once the file has
+ * been synced: ThreadSyncBlockFile syncs in groups, after a few seconds or
+ * megabytes, and SyncBlockFile() is the barrier for records that must be
+ * on disk before something that refers to them, such as the best chain.
+ */
+bool AppendBlockFile(const char* pch, size_t nSize, unsigned int& nFileRet, unsigned int& nPosRet);
+void SyncBlockFile();
+void CloseBlockFile();
+void ThreadSyncBlockFile(void* parg);
+
+/** Read-only memory mapping of a whole block file */
+class CBlockFileMapping
+{
+private:
+    const char* pbegin;
+    size_t nSize;
+#ifdef WIN32
+    void* hFile;
+    void* hMapping;
+#else
+    int fd;
+#endif
+
+    CBlockFileMapping(const CBlockFileMapping&);
+    void operator=(const CBlockFileMapping&);
+
+public:
+    CBlockFileMapping();
+    ~CBlockFileMapping();
+
+    bool Open(const boost::filesystem::path& path);
+    void Close();
+
+    // Size of the file on disk now, which may be more than was mapped
+    bool GetFileSize(size_t& nSizeRet) const;
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+};
+
+/** Mapping of block file nFile that covers at least nMinSize bytes, if the
+ * file is that long. Up to MAX_BLOCKFILE_MAPPINGS files stay mapped, the
+ * most recently used ones; a file is only mapped again when nMinSize runs
+ * past its mapping and the file has grown since. Returns NULL if the file
+ * cannot be mapped.
+ */
+boost::shared_ptr<CBlockFileMapping> GetBlockFileMapping(unsigned int nFile, size_t nMinSize);
+void CloseBlockFileMappings();
+
+/** Stream subset that deserializes straight from a block file mapping,
+ * starting at a given offset. Reads within the mapping cost no system
+ * calls. A reader opened by file number maps the file again only when a
+ * read runs past the end of the mapping, in case the file has grown since
+ * it was mapped. Reading past the end of the data throws, as reading past
+ * the end of a CAutoFile does.
+ */
+class CBlockFileReader
+{
+private:
+    boost::shared_ptr<CBlockFileMapping> pmap;  // keeps the memory mapped
+    unsigned int nFile;  // 0 if opened on a given mapping, which is kept
+    const char* pcur;
+    const char* pend;
+
+    bool Remap(size_t nSize)
+    {
+        if (nFile == 0)
+            return false;
+        size_t nPos = pcur - pmap->begin();
+        boost::shared_ptr<CBlockFileMapping> pmapNew = GetBlockFileMapping(nFile, nPos + nSize);
+        if (!pmapNew || pmapNew->size() < nPos + nSize)
+            return false;
+        pmap = pmapNew;
+        pcur = pmap->begin() + nPos;
+        pend = pmap->end();
+        return true;
+    }
+
+public:
+    int nType;
+    int nVersion;
+
+    CBlockFileReader(int nTypeIn, int nVersionIn) : nFile(0), pcur(NULL), pend(NULL), nType(nTypeIn), nVersion(nVersionIn)
+    {
+    }
+
+    bool Open(const boost::shared_ptr<CBlockFileMapping>& pmapIn, size_t nPos)
+    {
+        pmap.reset();
+        nFile = 0;
+        if (!pmapIn || nPos > pmapIn->size())
+            return false;
+        pmap = pmapIn;
+        pcur = pmap->begin() + nPos;
+        pend = pmap->end();
+        return true;
+    }
+
+    bool Open(unsigned int nFileIn, unsigned int nPos)
+    {
+        if (!Open(GetBlockFileMapping(nFileIn, nPos), nPos))
+            return false;
+        nFile = nFileIn;
+        return true;
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    CBlockFileReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur) && !Remap(nSize))
+            throw std::ios_base::failure("CBlockFileReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockindexmap.h"
+#include "util.h"
+
+using namespace std;
+
+CBlockIndexMap::CBlockIndexMap() : nShift(64), nSize(0), nSalt0(0), nSalt1(0)
+{
+}
+
+size_t CBlockIndexMap::Lookup(const uint256& key) const
+{
+    if (vTags.empty())
+        return (size_t)-1;
+    uint64 nHash = Hash(key);
+    unsigned int nTag = GetTag(nHash);
+    size_t nMask = vTags.size() - 1;
+    for (size_t i = GetHome(nHash); ; i = (i + 1) & nMask)
+    {
+        if (vTags[i] == 0)
+            return (size_t)-1;
+        if (vTags[i] == nTag && vNodes[i]->first == key)
+            return i;
+    }
+}
+
+size_t CBlockIndexMap::FindFree(uint64 nHash) const
+{
+    size_t nMask = vTags.size() - 1;
+    size_t i = GetHome(nHash);
+    while (vTags[i] != 0)
+        i = (i + 1) & nMask;
+    return i;
+}
+
+void CBlockIndexMap::Resize(size_t nNewSize)
+{
+    vector<unsigned int> vOldTags(nNewSize);
+    vector<value_type*> vOldNodes(nNewSize);
+    vOldTags.swap(vTags);
+    vOldNodes.swap(vNodes);
+    nShift = 64;
+    for (size_t n = nNewSize; n > 1; n >>= 1)
+        nShift--;
+
+    for (size_t j = 0; j < vOldNodes.size(); j++)
+    {
+        if (!vOldNodes[j])
+            continue;
+        size_t i = FindFree(Hash(vOldNodes[j]->first));
+        vTags[i] = vOldTags[j];
+        vNodes[i] = vOldNodes[j];
+    }
+}
+
+pair<CBlockIndexMap::iterator, bool> CBlockIndexMap::insert(const value_type& value)
+{
+    if (vTags.empty())
+    {
+        // Salted when first used rather than at construction, as the map
+        // is a global and the random number generator may not be ready
+        uint256 salt = GetRandHash();
+        nSalt0 = salt.Get64(0);
+        nSalt1 = salt.Get64(1);
+        Resize(1024);
+    }
+
+    size_t i = Lookup(value.first);
+    if (i != (size_t)-1)
+        return make_pair(iterator(TableBegin() + i, TableEnd()), false);
+
+    // Keep the load factor at most 3/4, so probe sequences stay short
+    if ((nSize + 1) * 4 > vTags.size() * 3)
+        Resize(vTags.size() * 2);
+
+    uint64 nHash = Hash(value.first);
+    i = FindFree(nHash);
+    vTags[i] = GetTag(nHash);
+    vNodes[i] = new (arena.Allocate()) value_type(value);
+    nSize++;
+    return make_pair(iterator(TableBegin() + i, TableEnd()), true);
+}
+
+CBlockIndexMap::size_type CBlockIndexMap::erase(const uint256& key)
+{
+    size_t i = Lookup(key);
+    if (i == (size_t)-1)
+        return 0;
+
+    vNodes[i]->~value_type();
+    arena.Free(vNodes[i]);
+    nSize--;
+
+    // Move later entries of the probe sequence back into the hole, unless
+    // that would put them before their home slot; no tombstones are needed
+    size_t nMask = vTags.size() - 1;
+    size_t j = i;
+    while (true)
+    {
+        j = (j + 1) & nMask;
+        if (vTags[j] == 0)
+            break;
+        size_t nHome = GetHome(Hash(vNodes[j]->first));
+        // Can the entry at j move to i: is i cyclically in [nHome, j)?
+        if (((j - nHome) & nMask) >= ((j - i) & nMask))
+        {
+            vTags[i] = vTags[j];
+            vNodes[i] = vNodes[j];
+            i = j;
+        }
+    }
+    vTags[i] = 0;
+    vNodes[i] = NULL;
+    return 1;
+}
+
+void CBlockIndexMap::clear()
+{
+    for (size_t i = 0; i < vNodes.size(); i++)
+    {
+        if (vNodes[i])
+        {
+            vNodes[i]->~value_type();
+            arena.Free(vNodes[i]);
+        }
+    }
+    vector<unsigned int>().swap(vTags);
+    vector<value_type*>().swap(vNodes);
+    nShift = 64;
+    nSize = 0;
+}
@@ -0,0 +1,186 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKINDEXMAP_H
+#define BITCOIN_BLOCKINDEXMAP_H
+
+#include <stddef.h>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "uint256.h"
+
+class CBlockIndex;
+
+/** Hash table from block hash to block index entry.
+ *
+ * Has the parts of the std::map interface that are used on mapBlockIndex,
+ * but a lookup costs one hash and usually one or two adjacent table slots
+ * instead of a walk down a tree of uint256 comparisons. The table is open
+ * addressed with linear probing. It is kept as two arrays: 32 bits of the
+ * hash of the key of each slot, and pointers to the (key, value) pairs. A
+ * probe scans the dense tag array and only touches a pair once its tag
+ * matches.
+ *
+ * The pairs live in an arena and never move, so &mi->first stays valid
+ * for as long as the entry is in the map, as it would in a std::map. Other
+ * than that, iterators are invalidated by insertion, and iteration is in
+ * no particular order.
+ */
+class CBlockIndexMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+    typedef size_t size_type;
+
+private:
+    // Size is zero or a power of two; both arrays have the same size
+    std::vector<unsigned int> vTags;  // zero if the slot is empty
+    std::vector<value_type*> vNodes;
+    unsigned int nShift;              // 64 - log2 of the table size
+    size_t nSize;
+    uint64 nSalt0;
+    uint64 nSalt1;
+    CArena<value_type> arena;
+
+    CBlockIndexMap(const CBlockIndexMap&);
+    void operator=(const CBlockIndexMap&);
+
+    uint64 Hash(const uint256& key) const
+    {
+        // Block hashes are random in their low bits, but an attacker can
+        // grind them, so mix in a secret salt. The slot is picked by the
+        // high bits of the product, which depend on every input bit.
+        uint64 n = ((key.Get64(0) ^ nSalt0) * 0x9e3779b97f4a7c15ULL) ^ (key.Get64(1) ^ nSalt1);
+        return n * 0xc2b2ae3d27d4eb4fULL;
+    }
+
+    // The slot where the probe sequence starts is given by the high bits of
+    // the hash, the tag by the low bits
+    size_t GetHome(uint64 nHash) const { return (size_t)(nHash >> nShift); }
+    static unsigned int GetTag(uint64 nHash) { return (unsigned int)nHash | 1; }
+
+    size_t Lookup(const uint256& key) const;
+    size_t FindFree(uint64 nHash) const;
+    void Resize(size_t nNewSize);
+
+    value_type* const* TableBegin() const { return vNodes.empty() ? NULL : &vNodes[0]; }
+    value_type* const* TableEnd() const { return TableBegin() + vNodes.size(); }
+
+public:
+    template<typename V>
+    class iterator_base
+    {
+    private:
+        friend class CBlockIndexMap;
+        template<typename V2> friend class iterator_base;
+        CBlockIndexMap::value_type* const* p;
+        CBlockIndexMap::value_type* const* pend;
+
+        iterator_base(CBlockIndexMap::value_type* const* pIn, CBlockIndexMap::value_type* const* pendIn) : p(pIn), pend(pendIn)
+        {
+            while (p != pend && !*p)
+                ++p;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        iterator_base() : p(NULL), pend(NULL) {}
+        iterator_base(const iterator_base& it) : p(it.p), pend(it.pend) {}
+
+        // iterator converts to const_iterator, but not the other way round
+        template<typename V2>
+        iterator_base(const iterator_base<V2>& it) : p(it.p), pend(it.pend)
+        {
+            V* pCheck = (V2*)NULL;
+            (void)pCheck;
+        }
+
+        iterator_base& operator=(const iterator_base& it)
+        {
+            p = it.p;
+            pend = it.pend;
+            return *this;
+        }
+
+        V& operator*() const { return **p; }
+        V* operator->() const { return *p; }
+
+        iterator_base& operator++()
+        {
+            do
+                ++p;
+            while (p != pend && !*p);
+            return *this;
+        }
+
+        iterator_base operator++(int)
+        {
+            iterator_base ret = *this;
+            ++*this;
+            return ret;
+        }
+
+        template<typename V2>
+        bool operator==(const iterator_base<V2>& it) const { return p == it.p; }
+        template<typename V2>
+        bool operator!=(const iterator_base<V2>& it) const { return p != it.p; }
+    };
+
+    typedef iterator_base<value_type> iterator;
+    typedef iterator_base<const value_type> const_iterator;
+
+    CBlockIndexMap();
+
+    iterator begin() { return iterator(TableBegin(), TableEnd()); }
+    iterator end() { return iterator(TableEnd(), TableEnd()); }
+    const_iterator begin() const { return const_iterator(TableBegin(), TableEnd()); }
+    const_iterator end() const { return const_iterator(TableEnd(), TableEnd()); }
+
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& key)
+    {
+        size_t i = Lookup(key);
+        return i == (size_t)-1 ? end() : iterator(TableBegin() + i, TableEnd());
+    }
+
+    const_iterator find(const uint256& key) const
+    {
+        size_t i = Lookup(key);
+        return i == (size_t)-1 ? end() : const_iterator(TableBegin() + i, TableEnd());
+    }
+
+    size_type count(const uint256& key) const
+    {
+        return Lookup(key) == (size_t)-1 ? 0 : 1;
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value);
+    size_type erase(const uint256& key);
+    void erase(iterator it) { erase(it->first); }
+    void clear();
+
+    CBlockIndex*& operator[](const uint256& key)
+    {
+        return insert(value_type(key, NULL)).first->second;
+    }
+
+    // Bytes used by the table and the pairs, not counting the entries
+    size_t GetMemoryUsage() const
+    {
+        return vTags.capacity() * sizeof(unsigned int) + vNodes.capacity() * sizeof(value_type*) + arena.GetMemoryUsage();
+    }
+};
+
+#endif
@@ -18,6 +18,7 @@
 
 class uint256;
 class CBlockIndex;
+class CBlockIndexMap;
 class CSyncCheckpoint;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
@@ -43,7 +44,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const CBlockIndexMap& mapBlockIndex);
 
     extern uint256 hashSyncCheckpoint;
     extern CSyncCheckpoint checkpointMessage;
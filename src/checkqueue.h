@@ -0,0 +1,224 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_CHECKQUEUE_H
+#define BITCOIN_CHECKQUEUE_H
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+template<typename T> class CCheckQueueControl;
+
+/** Queue of independent verifications processed by a pool of threads.
+ *
+ * T must provide bool operator()() and swap(T&). Worker threads sit in
+ * Thread(). One thread at a time is the master (see CCheckQueueControl):
+ * it adds checks and then works through the queue alongside the workers in
+ * Wait(), which returns once every check added since the previous Wait()
+ * has run. The result is false if any of them failed; once a check has
+ * failed the remaining ones are skipped. The first check that failed is
+ * handed back to the master, for the caller to tell why.
+ */
+template<typename T>
+class CCheckQueue
+{
+private:
+    boost::mutex mutex;
+
+    // Workers wait here for checks to be added
+    boost::condition_variable condWorker;
+
+    // The master waits here for the last check to finish
+    boost::condition_variable condMaster;
+
+    // Checks not yet taken by a thread
+    std::vector<T> queue;
+
+    // Threads waiting for work, and all threads inside Loop()
+    int nIdle;
+    int nTotal;
+
+    // No check has failed since the last Wait()
+    bool fAllOk;
+
+    // The first check that failed since the last Wait(), once fFailedKept
+    T checkFailed;
+    bool fFailedKept;
+
+    // Checks added but not finished, including those being run
+    unsigned int nTodo;
+
+    bool fQuit;
+
+    // Upper bound on the checks a thread takes at once
+    unsigned int nBatchSize;
+
+    // Serializes masters
+    boost::mutex mutexControl;
+
+    bool Loop(bool fMaster, T* pcheckFailed)
+    {
+        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        unsigned int nNow = 0;
+        unsigned int nFailed = 0;  // index in vChecks, or its size for none
+        bool fOk = true;
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+
+                // Account for the batch finished in the previous pass
+                if (nNow)
+                {
+                    fAllOk &= fOk;
+                    if (nFailed < vChecks.size() && !fFailedKept)
+                    {
+                        checkFailed.swap(vChecks[nFailed]);
+                        fFailedKept = true;
+                    }
+                    vChecks.clear();
+                    nTodo -= nNow;
+                    if (nTodo == 0 && !fMaster)
+                        condMaster.notify_one();
+                }
+                else
+                    nTotal++;
+
+                while (queue.empty())
+                {
+                    if ((fMaster || fQuit) && nTodo == 0)
+                    {
+                        nTotal--;
+                        bool fRet = fAllOk;
+                        if (fMaster)
+                        {
+                            if (pcheckFailed && fFailedKept)
+                                pcheckFailed->swap(checkFailed);
+                            T().swap(checkFailed);
+                            fFailedKept = false;
+                            fAllOk = true;
+                        }
+                        return fRet;
+                    }
+                    nIdle++;
+                    cond.wait(lock);
+                    nIdle--;
+                }
+
+                // Take a share of what is left so the threads finish
+                // together, at least one check and at most nBatchSize
+                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
+                vChecks.resize(nNow);
+                for (unsigned int i = 0; i < nNow; i++)
+                {
+                    vChecks[i].swap(queue.back());
+                    queue.pop_back();
+                }
+                fOk = fAllOk;
+            }
+
+            nFailed = vChecks.size();
+            for (unsigned int i = 0; i < vChecks.size() && fOk; i++)
+            {
+                fOk = vChecks[i]();
+                if (!fOk)
+                    nFailed = i;
+            }
+        }
+    }
+
+public:
+    CCheckQueue(unsigned int nBatchSizeIn) :
+        nIdle(0), nTotal(0), fAllOk(true), fFailedKept(false), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn)
+    {
+    }
+
+    // Body of a worker thread; returns after Quit()
+    void Thread()
+    {
+        Loop(false, NULL);
+    }
+
+    // Run checks until all added ones have finished. If one failed, the
+    // first to fail is swapped into *pcheckFailed.
+    bool Wait(T* pcheckFailed = NULL)
+    {
+        return Loop(true, pcheckFailed);
+    }
+
+    void Add(std::vector<T>& vChecks)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(T& check, vChecks)
+        {
+            queue.push_back(T());
+            check.swap(queue.back());
+        }
+        nTodo += vChecks.size();
+        if (vChecks.size() == 1)
+            condWorker.notify_one();
+        else if (vChecks.size() > 1)
+            condWorker.notify_all();
+    }
+
+    // Let the worker threads exit once the queue is empty
+    void Quit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
+    }
+
+    friend class CCheckQueueControl<T>;
+};
+
+/** Master side of a CCheckQueue for one batch of checks. With a NULL
+ * queue nothing is queued and the caller runs its checks itself.
+ * Waits for the checks on destruction if Wait() was not called.
+ */
+template<typename T>
+class CCheckQueueControl
+{
+private:
+    CCheckQueue<T>* pqueue;
+    bool fDone;
+
+public:
+    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
+    {
+        if (pqueue)
+            pqueue->mutexControl.lock();
+    }
+
+    bool Wait(T* pcheckFailed = NULL)
+    {
+        if (pqueue == NULL)
+            return true;
+        bool fRet = pqueue->Wait(pcheckFailed);
+        fDone = true;
+        return fRet;
+    }
+
+    void Add(std::vector<T>& vChecks)
+    {
+        if (pqueue)
+            pqueue->Add(vChecks);
+    }
+
+    ~CCheckQueueControl()
+    {
+        if (!fDone)
+            Wait();
+        if (pqueue)
+            pqueue->mutexControl.unlock();
+    }
+};
+
+#endif
@@ -0,0 +1,122 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include "uint256.h"
+
+/** Fixed-size set of 256-bit keys with cuckoo hashing.
+ *
+ * The keys must be uniformly distributed, e.g. salted hashes: the eight
+ * 32-bit words of a key pick the eight buckets it may occupy, so no
+ * further hashing is done. The all-zero key marks an empty bucket and
+ * cannot be stored.
+ *
+ * Memory is allocated once by Setup(). When all eight buckets of a new
+ * key are taken, one occupant is moved to another of its buckets, and so
+ * on for a bounded number of steps; a key still homeless after that is
+ * dropped. Lookups only take a shared lock, so any number of threads can
+ * look keys up at the same time.
+ */
+class CCuckooCache
+{
+private:
+    std::vector<uint256> vTable;
+    unsigned int nMaxDepth;
+    mutable boost::shared_mutex mutex;
+
+    void GetBuckets(const uint256& key, unsigned int pnBucket[8]) const
+    {
+        const unsigned char* p = key.begin();
+        for (int i = 0; i < 8; i++)
+        {
+            unsigned int n;
+            memcpy(&n, p + 4 * i, 4);
+            // Map n onto [0, size) without a division
+            pnBucket[i] = (unsigned int)(((unsigned long long)n * vTable.size()) >> 32);
+        }
+    }
+
+public:
+    CCuckooCache() : nMaxDepth(0)
+    {
+    }
+
+    // Discard the contents and use at most nBytes of memory.
+    // Returns the number of keys that fit.
+    size_t Setup(size_t nBytes)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex);
+        size_t nSize = std::min(nBytes / sizeof(uint256), (size_t)0xffffffff);
+        std::vector<uint256>(nSize).swap(vTable);
+        nMaxDepth = 0;
+        while (nSize >>= 1)
+            nMaxDepth++;
+        return vTable.size();
+    }
+
+    bool Contains(const uint256& key) const
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex);
+        if (vTable.empty())
+            return false;
+        unsigned int pnBucket[8];
+        GetBuckets(key, pnBucket);
+        for (int i = 0; i < 8; i++)
+            if (vTable[pnBucket[i]] == key)
+                return true;
+        return false;
+    }
+
+    void Insert(const uint256& keyIn)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(mutex);
+        if (vTable.empty() || keyIn == 0)
+            return;
+
+        uint256 key = keyIn;
+        unsigned int pnBucket[8];
+        GetBuckets(key, pnBucket);
+        for (int i = 0; i < 8; i++)
+            if (vTable[pnBucket[i]] == key)
+                return;
+
+        // Take the next bucket after the one the key was evicted from, so
+        // two keys sharing a bucket do not swap back and forth
+        unsigned int nLast = pnBucket[7];
+        for (unsigned int nDepth = 0; nDepth <= nMaxDepth; nDepth++)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                if (vTable[pnBucket[i]] == 0)
+                {
+                    vTable[pnBucket[i]] = key;
+                    return;
+                }
+            }
+            int j = 0;
+            while (j < 7 && pnBucket[j] != nLast)
+                j++;
+            nLast = pnBucket[(j + 1) & 7];
+            std::swap(vTable[nLast], key);
+            GetBuckets(key, pnBucket);
+        }
+        // key, now an older entry, is dropped
+    }
+
+    size_t GetSize() const
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex);
+        return vTable.size();
+    }
+};
+
+#endif
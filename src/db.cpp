@@ -10,6 +10,7 @@
 #include "util.h"
 #include "main.h"
 #include "kernel.h"
+#include "checkqueue.h"
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -82,6 +83,7 @@ bool CDBEnv::Open(boost::filesystem::path pathEnv_)
         nEnvFlags |= DB_PRIVATE;
 
     int nDbCache = GetArg("-dbcache", 25);
+    SetTxIndexCacheSize((size_t)std::max(nDbCache, 0) << 20);
     dbenv.set_lg_dir(pathLogDir.string().c_str());
     dbenv.set_cachesize(nDbCache / 1024, (nDbCache % 1024)*1048576, 1);
     dbenv.set_lg_bsize(1048576);
@@ -513,6 +515,373 @@ void CDBEnv::Flush(bool fShutdown)
 
 
 
+//
+// CBDBKVStore
+//
+
+class CBDBKVIterator : public CKVIterator
+{
+private:
+    Dbc* pcursor;
+    bool fValid;
+    string strKey;
+    string strValue;
+
+    void Get(unsigned int fFlags)
+    {
+        Dbt datKey, datValue;
+        if (fFlags == DB_SET_RANGE)
+        {
+            datKey.set_data((void*)strKey.data());
+            datKey.set_size(strKey.size());
+        }
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        fValid = false;
+        if (!pcursor || pcursor->get(&datKey, &datValue, fFlags) != 0)
+            return;
+        // Only a successful get replaces the key data passed in with a
+        // buffer of its own
+        fValid = datKey.get_data() != NULL && datValue.get_data() != NULL;
+        if (fValid)
+        {
+            strKey.assign((char*)datKey.get_data(), datKey.get_size());
+            strValue.assign((char*)datValue.get_data(), datValue.get_size());
+        }
+        free(datKey.get_data());
+        free(datValue.get_data());
+    }
+
+public:
+    CBDBKVIterator(Dbc* pcursorIn) : pcursor(pcursorIn), fValid(false)
+    {
+    }
+
+    ~CBDBKVIterator()
+    {
+        if (pcursor)
+            pcursor->close();
+    }
+
+    void Seek(const string& strKeyIn)
+    {
+        strKey = strKeyIn;
+        if (strKey.empty())
+            Get(DB_FIRST);
+        else
+            Get(DB_SET_RANGE);
+    }
+
+    void Next()
+    {
+        Get(DB_NEXT);
+    }
+
+    bool Valid() const { return fValid; }
+    const string& GetKey() const { return strKey; }
+    const string& GetValue() const { return strValue; }
+};
+
+/** Reads the live data of a CBDBKVStore, see there */
+class CBDBKVSnapshot : public CKVReader
+{
+private:
+    CKVStore* pstore;
+
+public:
+    CBDBKVSnapshot(CKVStore* pstoreIn) : pstore(pstoreIn)
+    {
+    }
+
+    bool ReadRaw(const string& strKey, string& strValue)
+    {
+        return pstore->ReadRaw(strKey, strValue);
+    }
+
+    CKVIterator* NewIterator()
+    {
+        return pstore->NewIterator();
+    }
+};
+
+bool CBDBKVStore::ReadRaw(const string& strKey, string& strValue)
+{
+    if (!pdb)
+        return false;
+    Dbt datKey((void*)strKey.data(), strKey.size());
+    Dbt datValue;
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pdb->get(NULL, &datKey, &datValue, 0);
+    if (datValue.get_data() == NULL)
+        return false;
+    strValue.assign((char*)datValue.get_data(), datValue.get_size());
+    free(datValue.get_data());
+    return (ret == 0);
+}
+
+CKVIterator* CBDBKVStore::NewIterator()
+{
+    return new CBDBKVIterator(GetCursor());
+}
+
+CKVReader* CBDBKVStore::NewSnapshot()
+{
+    return new CBDBKVSnapshot(this);
+}
+
+bool CBDBKVStore::WriteBatch(const CKVBatch& batch, bool fSync)
+{
+    if (!pdb)
+        return false;
+    if (fReadOnly)
+        assert(!"WriteBatch called on database in read-only mode");
+    if (batch.IsEmpty())
+        return true;
+
+    DbTxn* ptxn = bitdb.TxnBegin();
+    if (!ptxn)
+        return error("CBDBKVStore::WriteBatch() : TxnBegin failed");
+    for (CKVBatch::MapType::const_iterator mi = batch.begin(); mi != batch.end(); ++mi)
+    {
+        Dbt datKey((void*)mi->first.data(), mi->first.size());
+        int ret;
+        if (mi->second.first)
+        {
+            ret = pdb->del(ptxn, &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            Dbt datValue((void*)mi->second.second.data(), mi->second.second.size());
+            ret = pdb->put(ptxn, &datKey, &datValue, 0);
+        }
+        if (ret != 0)
+        {
+            ptxn->abort();
+            return error("CBDBKVStore::WriteBatch() : error %s (%d)", DbEnv::strerror(ret), ret);
+        }
+    }
+    int ret = ptxn->commit(fSync ? DB_TXN_SYNC : 0);
+    if (ret != 0)
+        return error("CBDBKVStore::WriteBatch() : commit failed, error %d", ret);
+
+    // Flush database activity from memory pool to disk log, as CDB::Close()
+    // does for short-lived handles
+    bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100)*1024, IsInitialBlockDownload() ? 5 : 2, 0);
+    return true;
+}
+
+
+//
+// Block index store
+//
+
+static CCriticalSection cs_txdbstore;
+static CKVStore* ptxdbstore = NULL;
+
+static CKVStore* OpenTxDBStore(const string& strBackend, bool fCreate)
+{
+    try {
+        if (strBackend == "bdb")
+            return new CBDBKVStore("blkindex.dat", fCreate ? "cr+" : "r");
+
+        CLogKVStore* pstore = new CLogKVStore();
+        if (pstore->Open(GetDataDir() / "txdb"))
+            return pstore;
+        delete pstore;
+    }
+    catch (std::exception &e) {
+        printf("OpenTxDBStore() : %s\n", e.what());
+    }
+    return NULL;
+}
+
+// Copy the whole index from the store of another backend into pstore,
+// which must be new
+static bool ConvertTxDB(CKVStore* pstore, const string& strFrom)
+{
+    string strVersionKey = KVSerialize(string("version"));
+    CKVIterator* pcursor = pstore->NewIterator();
+    for (pcursor->SeekToFirst(); pcursor->Valid() && pcursor->GetKey() == strVersionKey; pcursor->Next())
+        ;
+    bool fEmpty = !pcursor->Valid();
+    delete pcursor;
+    if (!fEmpty)
+        return error("ConvertTxDB() : the %s block index is not empty", pstore->GetName().c_str());
+
+    bool fExists = (strFrom == "bdb" ? filesystem::exists(GetDataDir() / "blkindex.dat")
+                                     : filesystem::exists(GetDataDir() / "txdb" / "MANIFEST"));
+    if (!fExists)
+        return error("ConvertTxDB() : no %s block index to convert", strFrom.c_str());
+    CKVStore* pstoreFrom = OpenTxDBStore(strFrom, false);
+    if (!pstoreFrom)
+        return error("ConvertTxDB() : cannot open the %s block index", strFrom.c_str());
+
+    printf("Converting the block index from %s to %s...\n", strFrom.c_str(), pstore->GetName().c_str());
+    int64 nStart = GetTimeMillis();
+    unsigned int nRecords = 0;
+    bool fOk = true;
+    CKVBatch batch;
+    pcursor = pstoreFrom->NewIterator();
+    for (pcursor->SeekToFirst(); pcursor->Valid() && fOk; pcursor->Next())
+    {
+        batch.WriteRaw(pcursor->GetKey(), pcursor->GetValue());
+        if (++nRecords % 10000 == 0)
+        {
+            fOk = pstore->WriteBatch(batch, false);
+            batch.Clear();
+            printf("ConvertTxDB() : %u records\n", nRecords);
+        }
+    }
+    delete pcursor;
+    delete pstoreFrom;
+    if (fOk)
+        fOk = pstore->WriteBatch(batch, true) && pstore->Flush();
+    if (!fOk)
+        return error("ConvertTxDB() : writing the %s block index failed", pstore->GetName().c_str());
+
+    printf("Converted %u records in %"PRI64d"ms; the %s block index is no longer used\n",
+           nRecords, GetTimeMillis() - nStart, strFrom.c_str());
+    return true;
+}
+
+bool OpenTxDB()
+{
+    LOCK(cs_txdbstore);
+    if (ptxdbstore)
+        return true;
+
+    // The mock environment of the unit tests only holds Berkeley DB files
+    string strBackend = bitdb.IsMock() ? "bdb" : GetArg("-dbbackend", "bdb");
+    if (strBackend != "bdb" && strBackend != "log")
+        return error("OpenTxDB() : unknown -dbbackend=%s", strBackend.c_str());
+
+    CKVStore* pstore = OpenTxDBStore(strBackend, true);
+    if (!pstore)
+        return error("OpenTxDB() : cannot open the %s block index", strBackend.c_str());
+    if (GetBoolArg("-convertdb") && !bitdb.IsMock() && !ConvertTxDB(pstore, strBackend == "bdb" ? "log" : "bdb"))
+    {
+        delete pstore;
+        return false;
+    }
+    if (!pstore->Exists(string("version")))
+    {
+        CKVBatch batch;
+        batch.Write(string("version"), CLIENT_VERSION);
+        pstore->WriteBatch(batch, false);
+    }
+
+    ptxdbstore = pstore;
+    printf("Block index database backend: %s\n", strBackend.c_str());
+    return true;
+}
+
+// Called at shutdown, once no CTxDB is left
+void CloseTxDB()
+{
+    LOCK(cs_txdbstore);
+    if (!ptxdbstore)
+        return;
+    ptxdbstore->Flush();
+    delete ptxdbstore;
+    ptxdbstore = NULL;
+}
+
+
+
+
+//
+// CTxIndexCache
+//
+
+// Dirty records are written in one Berkeley DB transaction, which needs a
+// lock object per page it touches; stay well below set_lk_max_objects
+static const unsigned int MAX_TXINDEX_CACHE_DIRTY = 4096;
+
+/** Write-back cache of the "tx" records of blkindex.dat, and of
+ * hashBestChain, shared by all CTxDB instances. Records read from disk are
+ * kept until the cache exceeds its memory budget (-dbcache). Committed
+ * writes stay dirty until CTxDB::FlushTxIndexCache() writes them, together
+ * with hashBestChain, in one transaction.
+ */
+class CTxIndexCache
+{
+public:
+    CCriticalSection cs;
+    std::map<uint256, CTxIndexCacheEntry> mapEntries;
+    size_t nUsage;
+    size_t nMaxUsage;
+    unsigned int nDirty;
+
+    // Counts flushes; a record read from disk is only added if no flush
+    // happened meanwhile, as it may be older than what was flushed
+    unsigned int nFlushes;
+
+    bool fBestChainDirty;
+    uint256 hashBestChain;
+
+    CTxIndexCache() : nUsage(0), nMaxUsage(25 << 20), nDirty(0), nFlushes(0), fBestChainDirty(false)
+    {
+    }
+
+    static size_t GetUsage(const CTxIndexCacheEntry& entry)
+    {
+        // map node, key and entry, plus the vSpent array
+        return 64 + sizeof(uint256) + sizeof(CTxIndexCacheEntry) + entry.txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+    }
+
+    void Put(const uint256& hash, const CTxIndexCacheEntry& entry)
+    {
+        std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            mi = mapEntries.insert(make_pair(hash, CTxIndexCacheEntry())).first;
+        else
+        {
+            nUsage -= GetUsage(mi->second);
+            nDirty -= mi->second.fDirty;
+        }
+        mi->second = entry;
+        nUsage += GetUsage(mi->second);
+        nDirty += mi->second.fDirty;
+    }
+
+    // Drop clean records, starting at a random one, until the cache fits
+    void Trim()
+    {
+        if (nUsage <= nMaxUsage || mapEntries.size() <= nDirty)
+            return;
+        std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapEntries.lower_bound(GetRandHash());
+        for (size_t nVisited = mapEntries.size(); nVisited > 0 && nUsage > nMaxUsage * 9 / 10; nVisited--)
+        {
+            if (mi == mapEntries.end())
+                mi = mapEntries.begin();
+            if (mi->second.fDirty)
+            {
+                mi++;
+                continue;
+            }
+            nUsage -= GetUsage(mi->second);
+            mapEntries.erase(mi++);
+        }
+    }
+
+    bool NeedFlush() const
+    {
+        return nDirty >= MAX_TXINDEX_CACHE_DIRTY || nUsage > nMaxUsage;
+    }
+};
+
+static CTxIndexCache txindexcache;
+
+void SetTxIndexCacheSize(size_t nBytes)
+{
+    LOCK(txindexcache.cs);
+    txindexcache.nMaxUsage = nBytes;
+    txindexcache.Trim();
+}
+
+
 //
 // CTxDB
 //
@@ -521,13 +890,49 @@ bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxnWrites.find(hash);
+    if (mi != mapTxnWrites.end())
+    {
+        if (mi->second.fErased)
+            return false;
+        txindex = mi->second.txindex;
+        return true;
+    }
+
+    unsigned int nFlushes;
+    {
+        LOCK(txindexcache.cs);
+        mi = txindexcache.mapEntries.find(hash);
+        if (mi != txindexcache.mapEntries.end())
+        {
+            if (mi->second.fErased)
+                return false;
+            txindex = mi->second.txindex;
+            return true;
+        }
+        nFlushes = txindexcache.nFlushes;
+    }
+
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        return false;
+
+    {
+        LOCK(txindexcache.cs);
+        if (txindexcache.nFlushes == nFlushes && !txindexcache.mapEntries.count(hash))
+        {
+            txindexcache.Put(hash, CTxIndexCacheEntry(txindex, false, false));
+            txindexcache.Trim();
+        }
+    }
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    mapTxnWrites[hash] = CTxIndexCacheEntry(txindex, false, true);
+    return fTxn || CommitTxnWrites(true);
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -537,7 +942,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -545,15 +950,152 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    mapTxnWrites[hash] = CTxIndexCacheEntry(CTxIndex(), true, true);
+    return fTxn || CommitTxnWrites(true);
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+
+    std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxnWrites.find(hash);
+    if (mi != mapTxnWrites.end())
+        return !mi->second.fErased;
+    {
+        LOCK(txindexcache.cs);
+        mi = txindexcache.mapEntries.find(hash);
+        if (mi != txindexcache.mapEntries.end())
+            return !mi->second.fErased;
+    }
     return Exists(make_pair(string("tx"), hash));
 }
 
+CTxDB::CTxDB(const char* pszMode) : pstore(NULL), fTxn(false), fTxnBestChain(false)
+{
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+    if (!OpenTxDB())
+        throw runtime_error("CTxDB() : cannot open the block index database");
+    pstore = ptxdbstore;
+}
+
+void CTxDB::Close()
+{
+    if (fTxn)
+        TxnAbort();
+    pstore = NULL;
+}
+
+bool CTxDB::TxnBegin()
+{
+    if (!pstore || fTxn)
+        return false;
+    fTxn = true;
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (!pstore || !fTxn)
+        return false;
+    bool fOk = pstore->WriteBatch(batch, false);
+    batch.Clear();
+    fTxn = false;
+    if (!fOk)
+    {
+        mapTxnWrites.clear();
+        fTxnBestChain = false;
+        return false;
+    }
+    return CommitTxnWrites(false);
+}
+
+bool CTxDB::TxnAbort()
+{
+    mapTxnWrites.clear();
+    fTxnBestChain = false;
+    if (!pstore || !fTxn)
+        return false;
+    batch.Clear();
+    fTxn = false;
+    return true;
+}
+
+// Publish the writes of this instance to the cache, and write the cache out
+// if it is full, if fForceFlush, or on every block once the chain is synced
+bool CTxDB::CommitTxnWrites(bool fForceFlush)
+{
+    bool fFlush;
+    {
+        LOCK(txindexcache.cs);
+        for (std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxnWrites.begin(); mi != mapTxnWrites.end(); ++mi)
+            txindexcache.Put(mi->first, mi->second);
+        if (fTxnBestChain)
+        {
+            txindexcache.hashBestChain = hashTxnBestChain;
+            txindexcache.fBestChainDirty = true;
+        }
+        fFlush = fForceFlush || txindexcache.NeedFlush() || !IsInitialBlockDownload();
+    }
+    mapTxnWrites.clear();
+    fTxnBestChain = false;
+
+    if (fFlush)
+        return FlushTxIndexCache();
+    return true;
+}
+
+bool CTxDB::FlushTxIndexCache()
+{
+    LOCK(txindexcache.cs);
+    if (txindexcache.nDirty == 0 && !txindexcache.fBestChainDirty)
+        return true;
+    if (!pstore || fReadOnly || fTxn)
+        return error("CTxDB::FlushTxIndexCache() : database not writable");
+
+    // The records refer to blocks in the block files, which have to be on
+    // disk first
+    SyncBlockFile();
+
+    int64 nStart = GetTimeMillis();
+    unsigned int nWritten = txindexcache.nDirty;
+    CKVBatch batchFlush;
+    for (std::map<uint256, CTxIndexCacheEntry>::iterator mi = txindexcache.mapEntries.begin(); mi != txindexcache.mapEntries.end(); ++mi)
+    {
+        CTxIndexCacheEntry& entry = mi->second;
+        if (!entry.fDirty)
+            continue;
+        if (entry.fErased)
+            batchFlush.Erase(make_pair(string("tx"), mi->first));
+        else
+            batchFlush.Write(make_pair(string("tx"), mi->first), entry.txindex);
+    }
+    if (txindexcache.fBestChainDirty)
+        batchFlush.Write(string("hashBestChain"), txindexcache.hashBestChain);
+    if (!pstore->WriteBatch(batchFlush, false))
+        return error("CTxDB::FlushTxIndexCache() : writing %u records failed", nWritten);
+
+    for (std::map<uint256, CTxIndexCacheEntry>::iterator mi = txindexcache.mapEntries.begin(); mi != txindexcache.mapEntries.end(); )
+    {
+        if (mi->second.fErased)
+        {
+            txindexcache.nUsage -= CTxIndexCache::GetUsage(mi->second);
+            txindexcache.mapEntries.erase(mi++);
+            continue;
+        }
+        mi->second.fDirty = false;
+        ++mi;
+    }
+    txindexcache.nDirty = 0;
+    txindexcache.fBestChainDirty = false;
+    txindexcache.nFlushes++;
+    txindexcache.Trim();
+
+    if (fDebug)
+        printf("FlushTxIndexCache() : wrote %u records in %"PRI64d"ms, %"PRIszu" cached (%"PRIszu" kB)\n",
+               nWritten, GetTimeMillis() - nStart, txindexcache.mapEntries.size(), txindexcache.nUsage / 1024);
+    return true;
+}
+
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -580,19 +1122,42 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadBlockIndex(uint256 hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair(string("blockindex"), hash), blockindex);
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
+    // A proof-of-stake record without its stake fields would be there for good
+    if (blockindex.fStakeMissing)
+        return error("CTxDB::WriteBlockIndex() : stake fields of %s missing", blockindex.GetBlockHash().ToString().c_str());
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
+    if (fTxnBestChain)
+    {
+        hashBestChain = hashTxnBestChain;
+        return true;
+    }
+    {
+        LOCK(txindexcache.cs);
+        if (txindexcache.fBestChainDirty)
+        {
+            hashBestChain = txindexcache.hashBestChain;
+            return true;
+        }
+    }
     return Read(string("hashBestChain"), hashBestChain);
 }
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    hashTxnBestChain = hashBestChain;
+    fTxnBestChain = true;
+    return fTxn || CommitTxnWrites(true);
 }
 
 bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
@@ -631,7 +1196,7 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -647,30 +1212,45 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
 
 bool CTxDB::LoadBlockIndex()
 {
+    int64 nStart = GetTimeMillis();
     if (!LoadBlockIndexGuts())
         return false;
+    printf("LoadBlockIndex(): read %"PRIszu" block index entries in %"PRI64d"ms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
 
     if (fRequestShutdown)
         return true;
 
-    // Calculate bnChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Order the entries by height, in chunks of one height each
+    nStart = GetTimeMillis();
+    int nMaxHeight = 0;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = max(nMaxHeight, item.second->nHeight);
+    vector<unsigned int> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 0; nHeight <= nMaxHeight; nHeight++)
+        vHeightStart[nHeight + 1] += vHeightStart[nHeight];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        vector<unsigned int> vNext(vHeightStart.begin(), vHeightStart.end() - 1);
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+            vSortedByHeight[vNext[item.second->nHeight]++] = item.second;
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+
+    // Calculate nChainTrust, and the stake modifier checksums, which chain
+    // from each block to the next and so go one height after the other
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->bnChainTrust = (pindex->pprev ? pindex->pprev->bnChainTrust : 0) + pindex->GetBlockTrust();
+        if (pindex->pprev)
+            pindex->nChainTrust += pindex->pprev->nChainTrust;
+        SetPowCounters(pindex);
         // ppcoin: calculate stake modifier checksum
-        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+        if (!GetStakeModifierChecksum(pindex, pindex->nStakeModifierChecksum))
+            return error("CTxDB::LoadBlockIndex() : GetStakeModifierChecksum() failed at height=%d", pindex->nHeight);
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindex->nHeight, pindex->nStakeModifier);
     }
+    printf("LoadBlockIndex(): chain trust and stake modifier checksums in %"PRI64d"ms\n", GetTimeMillis() - nStart);
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -682,19 +1262,37 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+
+    // The block index records, with their links to the next block, are
+    // written as blocks are connected, the tx index and hashBestChain only
+    // when the tx index cache is flushed. After a crash, even in the middle
+    // of a reorganization, the links on disk may describe another chain
+    // than the one the tx index does, so they are made again from the best
+    // block back.
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
+        pindex->pnext = NULL;
+    for (CBlockIndex* pindex = pindexBest; pindex->pprev; pindex = pindex->pprev)
+        pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexBest->bnChainTrust;
+    nBestChainTrust = pindexBest->nChainTrust;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
+    PruneBlockIndexStake();
+    printf("LoadBlockIndex(): block index uses %"PRIszu" kB, %"PRIszu" bytes per entry, %"PRIszu" stake fields cached\n",
+           GetBlockIndexMemoryUsage() / 1024, GetBlockIndexMemoryUsage() / mapBlockIndex.size(), GetBlockIndexStakeCacheSize());
+
     // ppcoin: load hashSyncCheckpoint
     if (!ReadSyncCheckpoint(Checkpoints::hashSyncCheckpoint))
         return error("CTxDB::LoadBlockIndex() : hashSyncCheckpoint not loaded");
     printf("LoadBlockIndex(): synchronized checkpoint %s\n", Checkpoints::hashSyncCheckpoint.ToString().c_str());
 
     // Load bnBestInvalidTrust, OK if it doesn't exist
-    ReadBestInvalidTrust(bnBestInvalidTrust);
+    CBigNum bnBestInvalidTrust;
+    if (ReadBestInvalidTrust(bnBestInvalidTrust))
+        nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
     // Verify blocks in the best chain
     int nCheckLevel = GetArg("-checklevel", 1);
@@ -704,6 +1302,7 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    nStart = GetTimeMillis();
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
@@ -810,6 +1409,7 @@ bool CTxDB::LoadBlockIndex()
             }
         }
     }
+    printf("LoadBlockIndex(): verified blocks in %"PRI64d"ms\n", GetTimeMillis() - nStart);
     if (pindexFork && !fRequestShutdown)
     {
         // Reorg back to the fork
@@ -826,41 +1426,50 @@ bool CTxDB::LoadBlockIndex()
 
 
 
-bool CTxDB::LoadBlockIndexGuts()
-{
-    // Get database cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
-        return false;
+// Records decoded by one CBlockIndexLoader
+static const unsigned int BLOCKINDEX_LOAD_CHUNK = 1024;
 
-    // Load mapBlockIndex
-    unsigned int fFlags = DB_SET_RANGE;
-    while (true)
-    {
-        // Read next record
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-            return false;
+// Guards mapBlockIndex and the other globals while loading
+static CCriticalSection cs_LoadBlockIndex;
 
-        // Unserialize
+/** Decodes a run of blockindex records and adds them to mapBlockIndex.
+ * The records are decoded without a lock, so several loaders can run on
+ * the CCheckQueue threads while the cursor reads on. The block hash is
+ * taken from the key rather than by hashing the header again; see
+ * ThreadVerifyBlockIndex() for checking it.
+ */
+class CBlockIndexLoader
+{
+public:
+    std::vector<std::pair<std::string, std::string> > vRecords;
 
+    bool operator()()
+    {
+        vector<CDiskBlockIndex> vDiskIndex(vRecords.size());
+        vector<uint256> vHash(vRecords.size());
+        vector<uint256> vTrust(vRecords.size());
         try {
-        string strType;
-        ssKey >> strType;
-        if (strType == "blockindex" && !fRequestShutdown)
+            for (unsigned int i = 0; i < vRecords.size(); i++)
+            {
+                CDataStream ssKey(vRecords[i].first.data(), vRecords[i].first.data() + vRecords[i].first.size(), SER_DISK, CLIENT_VERSION);
+                CDataStream ssValue(vRecords[i].second.data(), vRecords[i].second.data() + vRecords[i].second.size(), SER_DISK, CLIENT_VERSION);
+                string strType;
+                ssKey >> strType >> vHash[i];
+                ssValue >> vDiskIndex[i];
+                vTrust[i] = vDiskIndex[i].GetBlockTrust();
+            }
+        }
+        catch (std::exception &e) {
+            return error("LoadBlockIndex() : deserialize error");
+        }
+
+        LOCK(cs_LoadBlockIndex);
+        for (unsigned int i = 0; i < vDiskIndex.size(); i++)
         {
-            CDiskBlockIndex diskindex;
-            ssValue >> diskindex;
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
 
             // Construct block index object
-            CBlockIndex* pindexNew    = InsertBlockIndex(diskindex.GetBlockHash());
+            CBlockIndex* pindexNew    = InsertBlockIndex(vHash[i]);
             pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
             pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
             pindexNew->nFile          = diskindex.nFile;
@@ -870,9 +1479,6 @@ bool CTxDB::LoadBlockIndexGuts()
             pindexNew->nMoneySupply   = diskindex.nMoneySupply;
             pindexNew->nFlags         = diskindex.nFlags;
             pindexNew->nStakeModifier = diskindex.nStakeModifier;
-            pindexNew->prevoutStake   = diskindex.prevoutStake;
-            pindexNew->nStakeTime     = diskindex.nStakeTime;
-            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
             pindexNew->nVersion       = diskindex.nVersion;
             pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
             pindexNew->nTime          = diskindex.nTime;
@@ -881,29 +1487,120 @@ bool CTxDB::LoadBlockIndexGuts()
             pindexNew->nSuperBlock    = diskindex.nSuperBlock;
             pindexNew->nRoundMask     = diskindex.nRoundMask;
 
+            // The trust of the block alone; LoadBlockIndex adds that of
+            // its ancestors
+            pindexNew->nChainTrust    = vTrust[i];
+
             // Watch for genesis block
-            if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+            if (pindexGenesisBlock == NULL && vHash[i] == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
                 pindexGenesisBlock = pindexNew;
 
             if (!pindexNew->CheckIndex())
                 return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
 
-            // ppcoin: build setStakeSeen
+            // ppcoin: build setStakeSeen. The stake fields of all blocks
+            // are needed for the stake modifier checksums; those of old
+            // blocks are dropped again once these are done.
             if (pindexNew->IsProofOfStake())
-                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            {
+                setStakeSeen.insert(make_pair(diskindex.stake.prevoutStake, diskindex.stake.nStakeTime));
+                SetBlockIndexStake(pindexNew, diskindex.stake);
+            }
         }
-        else
+        return true;
+    }
+
+    void swap(CBlockIndexLoader& loader)
+    {
+        vRecords.swap(loader.vRecords);
+    }
+};
+
+void ThreadVerifyBlockIndex(void* parg)
+{
+    RenameThread("jackpotcoin-verifyidx");
+    int64 nStart = GetTimeMillis();
+    vector<CBlockIndex*> vIndex;
+    {
+        LOCK(cs_main);
+        vIndex.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+            vIndex.push_back(item.second);
+    }
+
+    // Entries are not changed once loaded; those with nFile 0 were only
+    // referred to by another entry, and have no header
+    unsigned int nChecked = 0, nBad = 0;
+    BOOST_FOREACH(const CBlockIndex* pindex, vIndex)
+    {
+        if (fShutdown)
+            return;
+        if (pindex->nFile == 0)
+            continue;
+        nChecked++;
+        if (pindex->GetBlockHeader().GetHash() != pindex->GetBlockHash())
         {
-            break; // if shutdown requested or finished loading block index
+            printf("ThreadVerifyBlockIndex() : *** entry %s at height %d does not match its header\n",
+                   pindex->GetBlockHash().ToString().c_str(), pindex->nHeight);
+            nBad++;
         }
-        }    // try
-        catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+    }
+    if (nBad)
+        strMiscWarning = "Warning: the block index is corrupt, back up your wallet and download the block chain again";
+    printf("ThreadVerifyBlockIndex() : checked %u headers in %"PRI64d"ms, %u bad\n", nChecked, GetTimeMillis() - nStart, nBad);
+}
+
+bool CTxDB::LoadBlockIndexGuts()
+{
+    // Get database cursor
+    if (!pstore)
+        return false;
+    CKVIterator* pcursor = pstore->NewIterator();
+
+    // Decode on -par threads while the cursor is read here
+    CCheckQueue<CBlockIndexLoader> queue(1);
+    boost::thread_group threads;
+    for (int i = 0; i < nCheckThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CBlockIndexLoader>::Thread, &queue));
+
+    // Load mapBlockIndex
+    bool fOk = true;
+    unsigned int nRecords = 0;
+    {
+        CCheckQueueControl<CBlockIndexLoader> control(nCheckThreads ? &queue : NULL);
+        string strPrefix = KVSerialize(string("blockindex"));
+        vector<CBlockIndexLoader> vLoader(1);
+        pcursor->Seek(KVSerialize(make_pair(string("blockindex"), uint256(0))));
+        while (fOk)
+        {
+            // Stop at the end of the blockindex records, or if shutdown is requested
+            bool fEnd = !pcursor->Valid() || pcursor->GetKey().compare(0, strPrefix.size(), strPrefix) != 0 || fRequestShutdown;
+            if (!fEnd)
+            {
+                vLoader[0].vRecords.push_back(make_pair(pcursor->GetKey(), pcursor->GetValue()));
+                nRecords++;
+            }
+            if (vLoader[0].vRecords.size() == BLOCKINDEX_LOAD_CHUNK || (fEnd && !vLoader[0].vRecords.empty()))
+            {
+                if (nCheckThreads)
+                    control.Add(vLoader);
+                else
+                    fOk = vLoader[0]();
+                vLoader[0].vRecords.clear();
+            }
+            if (fEnd)
+                break;
+            pcursor->Next();
         }
+        if (!control.Wait())
+            fOk = false;
     }
-    pcursor->close();
+    delete pcursor;
+    queue.Quit();
+    threads.join_all();
 
-    return true;
+    printf("LoadBlockIndex(): %u records decoded on %d threads\n", nRecords, max(nCheckThreads, 1));
+    return fOk;
 }
 
 
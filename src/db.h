@@ -7,6 +7,7 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "kvstore.h"
 
 #include <map>
 #include <string>
@@ -92,6 +93,18 @@ public:
 
 extern CDBEnv bitdb;
 
+// Memory budget of the tx index cache of CTxDB
+void SetTxIndexCacheSize(size_t nBytes);
+
+// Open the store of the block and transaction index with the backend
+// chosen by -dbbackend; with -convertdb the index is first copied over
+// from the other backend. CTxDB opens it on first use.
+bool OpenTxDB();
+void CloseTxDB();
+
+// Hash the headers of the loaded block index again (-verifyblockindex)
+void ThreadVerifyBlockIndex(void* parg);
+
 
 /** RAII class that provides access to a Berkeley database */
 class CDB
@@ -317,15 +330,119 @@ public:
 
 
 
-/** Access to the transaction database (blkindex.dat) */
-class CTxDB : public CDB
+/** A "tx" record held in the tx index cache */
+struct CTxIndexCacheEntry
+{
+    CTxIndex txindex;
+    bool fErased;   // record deleted, but maybe still on disk
+    bool fDirty;    // differs from what is on disk
+
+    CTxIndexCacheEntry() : fErased(false), fDirty(false) {}
+    CTxIndexCacheEntry(const CTxIndex& txindexIn, bool fErasedIn, bool fDirtyIn) :
+        txindex(txindexIn), fErased(fErasedIn), fDirty(fDirtyIn) {}
+};
+
+/** Berkeley DB backend of the block and transaction index (blkindex.dat).
+ * It is opened without multiversion support, so a snapshot reads the
+ * current data; each batch is a transaction, so it is never seen in part.
+ */
+class CBDBKVStore : public CKVStore, private CDB
+{
+public:
+    CBDBKVStore(const char* pszFile, const char* pszMode="cr+") : CDB(pszFile, pszMode) { }
+
+    bool ReadRaw(const std::string& strKey, std::string& strValue);
+    CKVIterator* NewIterator();
+    bool WriteBatch(const CKVBatch& batch, bool fSync);
+    CKVReader* NewSnapshot();
+    std::string GetName() const { return "bdb"; }
+};
+
+
+/** Access to the transaction database: the block and transaction index,
+ * held in the CKVStore opened by OpenTxDB()
+ *
+ * The "tx" records and hashBestChain go through a write-back cache shared
+ * by all instances (see CTxIndexCache in db.cpp), which is written to disk
+ * in a single batch, so the records on disk always match the best chain
+ * pointer stored with them. Writes made between TxnBegin() and
+ * TxnCommit() are only seen by this instance until the commit, and are
+ * dropped by TxnAbort().
+ */
+class CTxDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+");
+    ~CTxDB() { Close(); }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    CKVStore* pstore;
+    bool fReadOnly;
+
+    // Writes of the open transaction
+    bool fTxn;
+    CKVBatch batch;
+    std::map<uint256, CTxIndexCacheEntry> mapTxnWrites;
+    bool fTxnBestChain;
+    uint256 hashTxnBestChain;
+
+    bool CommitTxnWrites(bool fForceFlush);
+
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        if (!pstore)
+            return false;
+        if (fTxn)
+        {
+            bool fErased;
+            std::string strValue;
+            if (batch.Lookup(KVSerialize(key), fErased, strValue))
+                return !fErased && KVUnserialize(strValue, value);
+        }
+        return pstore->Read(key, value);
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        if (!pstore)
+            return false;
+        if (fReadOnly)
+            assert(!"Write called on database in read-only mode");
+        if (fTxn)
+        {
+            batch.Write(key, value);
+            return true;
+        }
+        CKVBatch batchOne;
+        batchOne.Write(key, value);
+        return pstore->WriteBatch(batchOne, false);
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        if (!pstore)
+            return false;
+        if (fTxn)
+        {
+            bool fErased;
+            std::string strValue;
+            if (batch.Lookup(KVSerialize(key), fErased, strValue))
+                return !fErased;
+        }
+        return pstore->Exists(key);
+    }
+
 public:
+    void Close();
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+    bool FlushTxIndexCache();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -335,6 +452,7 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadBlockIndex(uint256 hash, CDiskBlockIndex& blockindex);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
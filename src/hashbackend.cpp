@@ -0,0 +1,611 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hashbackend.h"
+#include "util.h"
+#include "sph_blake.h"
+#include "sph_groestl.h"
+#include "sph_jh.h"
+#include "sph_skein.h"
+
+using namespace std;
+
+//
+// Reference implementations
+//
+
+static void Blake512Sph(const void* pIn, void* pOut)
+{
+    sph_blake512_context ctx;
+    sph_blake512_init(&ctx);
+    sph_blake512(&ctx, pIn, 64);
+    sph_blake512_close(&ctx, pOut);
+}
+
+static void Groestl512Sph(const void* pIn, void* pOut)
+{
+    sph_groestl512_context ctx;
+    sph_groestl512_init(&ctx);
+    sph_groestl512(&ctx, pIn, 64);
+    sph_groestl512_close(&ctx, pOut);
+}
+
+static void JH512Sph(const void* pIn, void* pOut)
+{
+    sph_jh512_context ctx;
+    sph_jh512_init(&ctx);
+    sph_jh512(&ctx, pIn, 64);
+    sph_jh512_close(&ctx, pOut);
+}
+
+static void Skein512Sph(const void* pIn, void* pOut)
+{
+    sph_skein512_context ctx;
+    sph_skein512_init(&ctx);
+    sph_skein512(&ctx, pIn, 64);
+    sph_skein512_close(&ctx, pOut);
+}
+
+static const Hash512Function pfnHash512Sph[HASH_ALGO_COUNT] =
+{
+    Blake512Sph, Groestl512Sph, JH512Sph, Skein512Sph
+};
+
+Hash512Function pfnHash512[HASH_ALGO_COUNT] =
+{
+    Blake512Sph, Groestl512Sph, JH512Sph, Skein512Sph
+};
+
+static const char* pszHash512Backend[HASH_ALGO_COUNT] =
+{
+    "sph", "sph", "sph", "sph"
+};
+
+static bool AlwaysSupported()
+{
+    return true;
+}
+
+
+//
+// x86 kernels. Each is compiled for its instruction set with a target
+// attribute and only called after the CPU has been checked, so the rest of
+// the program keeps the baseline instruction set.
+//
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+#define HASHBACKEND_USE_X86 1
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define HASHBACKEND_INLINE inline __attribute__((always_inline))
+
+static bool HaveSSE2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool HaveAESNI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    __builtin_cpu_init();
+    return (ecx & bit_AES) && __builtin_cpu_supports("ssse3");
+}
+
+
+//
+// Groestl-512 with AES-NI. The 8x16 byte state is kept as one register per
+// row. SubBytes is AESENCLAST with a zero key; its built-in ShiftRows is
+// undone by the same byte shuffle that performs ShiftBytes. MixBytes is
+// evaluated on whole rows with doubling in GF(2^8).
+//
+
+#define GROESTL_TARGET __attribute__((target("aes,ssse3")))
+
+// pshufb masks: ShiftBytes of each row followed by inverse AES ShiftRows
+static const unsigned char pchGroestlShuffle[2][8][16] __attribute__((aligned(16))) =
+{
+    {
+        {  0, 13, 10,  7,  4,  1, 14, 11,  8,  5,  2, 15, 12,  9,  6,  3 },
+        {  1, 14, 11,  8,  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4 },
+        {  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4,  1, 14, 11,  8,  5 },
+        {  3,  0, 13, 10,  7,  4,  1, 14, 11,  8,  5,  2, 15, 12,  9,  6 },
+        {  4,  1, 14, 11,  8,  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7 },
+        {  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4,  1, 14, 11,  8 },
+        {  6,  3,  0, 13, 10,  7,  4,  1, 14, 11,  8,  5,  2, 15, 12,  9 },
+        { 11,  8,  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4,  1, 14 },
+    },
+    {
+        {  1, 14, 11,  8,  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4 },
+        {  3,  0, 13, 10,  7,  4,  1, 14, 11,  8,  5,  2, 15, 12,  9,  6 },
+        {  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4,  1, 14, 11,  8 },
+        { 11,  8,  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4,  1, 14 },
+        {  0, 13, 10,  7,  4,  1, 14, 11,  8,  5,  2, 15, 12,  9,  6,  3 },
+        {  2, 15, 12,  9,  6,  3,  0, 13, 10,  7,  4,  1, 14, 11,  8,  5 },
+        {  4,  1, 14, 11,  8,  5,  2, 15, 12,  9,  6,  3,  0, 13, 10,  7 },
+        {  6,  3,  0, 13, 10,  7,  4,  1, 14, 11,  8,  5,  2, 15, 12,  9 },
+    },
+};
+
+GROESTL_TARGET static HASHBACKEND_INLINE __m128i GroestlDouble(__m128i x)
+{
+    __m128i carry = _mm_and_si128(_mm_cmplt_epi8(x, _mm_setzero_si128()), _mm_set1_epi8(0x1b));
+    return _mm_xor_si128(_mm_add_epi8(x, x), carry);
+}
+
+// One row of MixBytes. Row i becomes the sum of b[d] * row (i + d) with
+// b = (2, 2, 3, 4, 5, 3, 5, 7); split by the bits of b[d] and written with
+// the sums s(j) = row j ^ row (j + 1), the arguments are rows i+2, i+5, i+7
+// and sums i, i+3, i+4, i+6
+GROESTL_TARGET static HASHBACKEND_INLINE __m128i GroestlMixRow(__m128i x2, __m128i x5, __m128i x7,
+                                                               __m128i s0, __m128i s3, __m128i s4, __m128i s6)
+{
+    __m128i t1 = _mm_xor_si128(x2, _mm_xor_si128(s4, s6));
+    __m128i t2 = _mm_xor_si128(_mm_xor_si128(s0, x2), _mm_xor_si128(x5, x7));
+    __m128i t4 = _mm_xor_si128(s3, s6);
+    return _mm_xor_si128(t1, GroestlDouble(_mm_xor_si128(t2, GroestlDouble(t4))));
+}
+
+#define GROESTL_SUBSHIFT(i) \
+    x##i = _mm_aesenclast_si128(_mm_shuffle_epi8(x##i, _mm_load_si128((const __m128i*)pchGroestlShuffle[fQ][i])), zero)
+
+template<bool fQ>
+GROESTL_TARGET static HASHBACKEND_INLINE void GroestlPermutation(__m128i* x)
+{
+    const __m128i columns = _mm_set_epi8((char)0xf0, (char)0xe0, (char)0xd0, (char)0xc0, (char)0xb0, (char)0xa0, (char)0x90, (char)0x80,
+                                         0x70, 0x60, 0x50, 0x40, 0x30, 0x20, 0x10, 0x00);
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3], x4 = x[4], x5 = x[5], x6 = x[6], x7 = x[7];
+
+    for (int r = 0; r < 14; r++)
+    {
+        // AddRoundConstant
+        __m128i round = _mm_xor_si128(columns, _mm_set1_epi8(r));
+        if (fQ)
+        {
+            x0 = _mm_xor_si128(x0, ones);
+            x1 = _mm_xor_si128(x1, ones);
+            x2 = _mm_xor_si128(x2, ones);
+            x3 = _mm_xor_si128(x3, ones);
+            x4 = _mm_xor_si128(x4, ones);
+            x5 = _mm_xor_si128(x5, ones);
+            x6 = _mm_xor_si128(x6, ones);
+            x7 = _mm_xor_si128(x7, _mm_xor_si128(round, ones));
+        }
+        else
+            x0 = _mm_xor_si128(x0, round);
+
+        // SubBytes and ShiftBytes
+        GROESTL_SUBSHIFT(0);
+        GROESTL_SUBSHIFT(1);
+        GROESTL_SUBSHIFT(2);
+        GROESTL_SUBSHIFT(3);
+        GROESTL_SUBSHIFT(4);
+        GROESTL_SUBSHIFT(5);
+        GROESTL_SUBSHIFT(6);
+        GROESTL_SUBSHIFT(7);
+
+        // MixBytes
+        __m128i s0 = _mm_xor_si128(x0, x1), s1 = _mm_xor_si128(x1, x2), s2 = _mm_xor_si128(x2, x3), s3 = _mm_xor_si128(x3, x4);
+        __m128i s4 = _mm_xor_si128(x4, x5), s5 = _mm_xor_si128(x5, x6), s6 = _mm_xor_si128(x6, x7), s7 = _mm_xor_si128(x7, x0);
+        __m128i y0 = GroestlMixRow(x2, x5, x7, s0, s3, s4, s6);
+        __m128i y1 = GroestlMixRow(x3, x6, x0, s1, s4, s5, s7);
+        __m128i y2 = GroestlMixRow(x4, x7, x1, s2, s5, s6, s0);
+        __m128i y3 = GroestlMixRow(x5, x0, x2, s3, s6, s7, s1);
+        __m128i y4 = GroestlMixRow(x6, x1, x3, s4, s7, s0, s2);
+        __m128i y5 = GroestlMixRow(x7, x2, x4, s5, s0, s1, s3);
+        __m128i y6 = GroestlMixRow(x0, x3, x5, s6, s1, s2, s4);
+        __m128i y7 = GroestlMixRow(x1, x4, x6, s7, s2, s3, s5);
+        x0 = y0; x1 = y1; x2 = y2; x3 = y3; x4 = y4; x5 = y5; x6 = y6; x7 = y7;
+    }
+
+    x[0] = x0; x[1] = x1; x[2] = x2; x[3] = x3; x[4] = x4; x[5] = x5; x[6] = x6; x[7] = x7;
+}
+
+#undef GROESTL_SUBSHIFT
+
+// Byte k of the state is row k % 8, column k / 8
+GROESTL_TARGET static void GroestlLoadRows(const unsigned char* p, __m128i* x)
+{
+    unsigned char rows[8][16] __attribute__((aligned(16)));
+    for (int col = 0; col < 16; col++)
+        for (int row = 0; row < 8; row++)
+            rows[row][col] = p[8 * col + row];
+    for (int row = 0; row < 8; row++)
+        x[row] = _mm_load_si128((const __m128i*)rows[row]);
+}
+
+GROESTL_TARGET static void Groestl512AESNI(const void* pIn, void* pOut)
+{
+    // The 64-byte input plus padding is exactly one 128-byte block
+    unsigned char block[128];
+    memcpy(block, pIn, 64);
+    memset(block + 64, 0, 64);
+    block[64] = 0x80;
+    block[127] = 0x01;
+
+    __m128i m[8], p[8], q[8];
+    GroestlLoadRows(block, m);
+
+    // Initial value: the output size in bits, in the last column
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = m[i];
+        q[i] = m[i];
+    }
+    p[6] = _mm_xor_si128(p[6], _mm_set_epi8(0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+
+    // h = P(h ^ m) ^ Q(m) ^ h
+    __m128i h[8];
+    GroestlPermutation<false>(p);
+    GroestlPermutation<true>(q);
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm_xor_si128(p[i], q[i]);
+    h[6] = _mm_xor_si128(h[6], _mm_set_epi8(0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+
+    // Output transformation: last 8 columns of P(h) ^ h
+    for (int i = 0; i < 8; i++)
+        p[i] = h[i];
+    GroestlPermutation<false>(p);
+
+    unsigned char rows[8][16] __attribute__((aligned(16)));
+    for (int row = 0; row < 8; row++)
+        _mm_store_si128((__m128i*)rows[row], _mm_xor_si128(p[row], h[row]));
+    unsigned char* pchOut = (unsigned char*)pOut;
+    for (int col = 8; col < 16; col++)
+        for (int row = 0; row < 8; row++)
+            pchOut[8 * (col - 8) + row] = rows[row][col];
+}
+
+
+//
+// JH-512 with SSE2. This is the bitsliced E8 of the sph 64-bit code with
+// each (high, low) pair of 64-bit words held in one register, so the
+// S-boxes and the linear layer run on both halves at once and the W6 word
+// swap becomes a single shuffle.
+//
+
+#define JH_TARGET __attribute__((target("sse2")))
+
+#define C64e(x) ((SPH_C64(x) >> 56) \
+                | ((SPH_C64(x) >> 40) & SPH_C64(0x000000000000FF00)) \
+                | ((SPH_C64(x) >> 24) & SPH_C64(0x0000000000FF0000)) \
+                | ((SPH_C64(x) >>  8) & SPH_C64(0x00000000FF000000)) \
+                | ((SPH_C64(x) <<  8) & SPH_C64(0x000000FF00000000)) \
+                | ((SPH_C64(x) << 24) & SPH_C64(0x0000FF0000000000)) \
+                | ((SPH_C64(x) << 40) & SPH_C64(0x00FF000000000000)) \
+                | ((SPH_C64(x) << 56) & SPH_C64(0xFF00000000000000)))
+
+// Round constants, even/odd high/low for each of the 42 rounds
+static const sph_u64 pnJHRoundConstants[168] __attribute__((aligned(16))) =
+{
+    C64e(0x72d5dea2df15f867), C64e(0x7b84150ab7231557),
+    C64e(0x81abd6904d5a87f6), C64e(0x4e9f4fc5c3d12b40),
+    C64e(0xea983ae05c45fa9c), C64e(0x03c5d29966b2999a),
+    C64e(0x660296b4f2bb538a), C64e(0xb556141a88dba231),
+    C64e(0x03a35a5c9a190edb), C64e(0x403fb20a87c14410),
+    C64e(0x1c051980849e951d), C64e(0x6f33ebad5ee7cddc),
+    C64e(0x10ba139202bf6b41), C64e(0xdc786515f7bb27d0),
+    C64e(0x0a2c813937aa7850), C64e(0x3f1abfd2410091d3),
+    C64e(0x422d5a0df6cc7e90), C64e(0xdd629f9c92c097ce),
+    C64e(0x185ca70bc72b44ac), C64e(0xd1df65d663c6fc23),
+    C64e(0x976e6c039ee0b81a), C64e(0x2105457e446ceca8),
+    C64e(0xeef103bb5d8e61fa), C64e(0xfd9697b294838197),
+    C64e(0x4a8e8537db03302f), C64e(0x2a678d2dfb9f6a95),
+    C64e(0x8afe7381f8b8696c), C64e(0x8ac77246c07f4214),
+    C64e(0xc5f4158fbdc75ec4), C64e(0x75446fa78f11bb80),
+    C64e(0x52de75b7aee488bc), C64e(0x82b8001e98a6a3f4),
+    C64e(0x8ef48f33a9a36315), C64e(0xaa5f5624d5b7f989),
+    C64e(0xb6f1ed207c5ae0fd), C64e(0x36cae95a06422c36),
+    C64e(0xce2935434efe983d), C64e(0x533af974739a4ba7),
+    C64e(0xd0f51f596f4e8186), C64e(0x0e9dad81afd85a9f),
+    C64e(0xa7050667ee34626a), C64e(0x8b0b28be6eb91727),
+    C64e(0x47740726c680103f), C64e(0xe0a07e6fc67e487b),
+    C64e(0x0d550aa54af8a4c0), C64e(0x91e3e79f978ef19e),
+    C64e(0x8676728150608dd4), C64e(0x7e9e5a41f3e5b062),
+    C64e(0xfc9f1fec4054207a), C64e(0xe3e41a00cef4c984),
+    C64e(0x4fd794f59dfa95d8), C64e(0x552e7e1124c354a5),
+    C64e(0x5bdf7228bdfe6e28), C64e(0x78f57fe20fa5c4b2),
+    C64e(0x05897cefee49d32e), C64e(0x447e9385eb28597f),
+    C64e(0x705f6937b324314a), C64e(0x5e8628f11dd6e465),
+    C64e(0xc71b770451b920e7), C64e(0x74fe43e823d4878a),
+    C64e(0x7d29e8a3927694f2), C64e(0xddcb7a099b30d9c1),
+    C64e(0x1d1b30fb5bdc1be0), C64e(0xda24494ff29c82bf),
+    C64e(0xa4e7ba31b470bfff), C64e(0x0d324405def8bc48),
+    C64e(0x3baefc3253bbd339), C64e(0x459fc3c1e0298ba0),
+    C64e(0xe5c905fdf7ae090f), C64e(0x947034124290f134),
+    C64e(0xa271b701e344ed95), C64e(0xe93b8e364f2f984a),
+    C64e(0x88401d63a06cf615), C64e(0x47c1444b8752afff),
+    C64e(0x7ebb4af1e20ac630), C64e(0x4670b6c5cc6e8ce6),
+    C64e(0xa4d5a456bd4fca00), C64e(0xda9d844bc83e18ae),
+    C64e(0x7357ce453064d1ad), C64e(0xe8a6ce68145c2567),
+    C64e(0xa3da8cf2cb0ee116), C64e(0x33e906589a94999a),
+    C64e(0x1f60b220c26f847b), C64e(0xd1ceac7fa0d18518),
+    C64e(0x32595ba18ddd19d3), C64e(0x509a1cc0aaa5b446),
+    C64e(0x9f3d6367e4046bba), C64e(0xf6ca19ab0b56ee7e),
+    C64e(0x1fb179eaa9282174), C64e(0xe9bdf7353b3651ee),
+    C64e(0x1d57ac5a7550d376), C64e(0x3a46c2fea37d7001),
+    C64e(0xf735c1af98a4d842), C64e(0x78edec209e6b6779),
+    C64e(0x41836315ea3adba8), C64e(0xfac33b4d32832c83),
+    C64e(0xa7403b1f1c2747f3), C64e(0x5940f034b72d769a),
+    C64e(0xe73e4e6cd2214ffd), C64e(0xb8fd8d39dc5759ef),
+    C64e(0x8d9b0c492b49ebda), C64e(0x5ba2d74968f3700d),
+    C64e(0x7d3baed07a8d5584), C64e(0xf5a5e9f0e4f88e65),
+    C64e(0xa0b8a2f436103b53), C64e(0x0ca8079e753eec5a),
+    C64e(0x9168949256e8884f), C64e(0x5bb05c55f8babc4c),
+    C64e(0xe3bb3b99f387947b), C64e(0x75daf4d6726b1c5d),
+    C64e(0x64aeac28dc34b36d), C64e(0x6c34a550b828db71),
+    C64e(0xf861e2f2108d512a), C64e(0xe3db643359dd75fc),
+    C64e(0x1cacbcf143ce3fa2), C64e(0x67bbd13c02e843b0),
+    C64e(0x330a5bca8829a175), C64e(0x7f34194db416535c),
+    C64e(0x923b94c30e794d1e), C64e(0x797475d7b6eeaf3f),
+    C64e(0xeaa8d4f7be1a3921), C64e(0x5cf47e094c232751),
+    C64e(0x26a32453ba323cd2), C64e(0x44a3174a6da6d5ad),
+    C64e(0xb51d3ea6aff2c908), C64e(0x83593d98916b3c56),
+    C64e(0x4cf87ca17286604d), C64e(0x46e23ecc086ec7f6),
+    C64e(0x2f9833b3b1bc765e), C64e(0x2bd666a5efc4e62a),
+    C64e(0x06f4b6e8bec1d436), C64e(0x74ee8215bcef2163),
+    C64e(0xfdc14e0df453c969), C64e(0xa77d5ac406585826),
+    C64e(0x7ec1141606e0fa16), C64e(0x7e90af3d28639d3f),
+    C64e(0xd2c9f2e3009bd20c), C64e(0x5faace30b7d40c30),
+    C64e(0x742a5116f2e03298), C64e(0x0deb30d8e3cef89a),
+    C64e(0x4bc59e7bb5f17992), C64e(0xff51e66e048668d3),
+    C64e(0x9b234d57e6966731), C64e(0xcce6a6f3170a7505),
+    C64e(0xb17681d913326cce), C64e(0x3c175284f805a262),
+    C64e(0xf42bcbb378471547), C64e(0xff46548223936a48),
+    C64e(0x38df58074e5e6565), C64e(0xf2fc7c89fc86508e),
+    C64e(0x31702e44d00bca86), C64e(0xf04009a23078474e),
+    C64e(0x65a0ee39d1f73883), C64e(0xf75ee937e42c3abd),
+    C64e(0x2197b2260113f86f), C64e(0xa344edd1ef9fdee7),
+    C64e(0x8ba0df15762592d9), C64e(0x3c85f7f612dc42be),
+    C64e(0xd8a7ec7cab27b07e), C64e(0x538d7ddaaa3ea8de),
+    C64e(0xaa25ce93bd0269d8), C64e(0x5af643fd1a7308f9),
+    C64e(0xc05fefda174a19a5), C64e(0x974d66334cfd216a),
+    C64e(0x35b49831db411570), C64e(0xea1e0fbbedcd549b),
+    C64e(0x9ad063a151974072), C64e(0xf6759dbf91476fe2)
+};
+
+static const sph_u64 pnJH512IV[16] __attribute__((aligned(16))) =
+{
+    C64e(0x6fd14b963e00aa17), C64e(0x636a2e057a15d543),
+    C64e(0x8a225e8d0c97ef0b), C64e(0xe9341259f2b3c361),
+    C64e(0x891da0c1536f801e), C64e(0x2aa9056bea2b6d80),
+    C64e(0x588eccdb2075baa6), C64e(0xa90f3a76baf83bf7),
+    C64e(0x0169e60541e34a69), C64e(0x46b58a8e2e6fe65a),
+    C64e(0x1047a7d0c1843c24), C64e(0x3b6e71b12d5ac199),
+    C64e(0xcf57f6ec9db1f856), C64e(0xa706887c5716b156),
+    C64e(0xe3c2fcdfe68517fb), C64e(0x545a4678cc8cdd4b)
+};
+
+#undef C64e
+
+JH_TARGET static HASHBACKEND_INLINE void JHSbox(__m128i& x0, __m128i& x1, __m128i& x2, __m128i& x3, __m128i c)
+{
+    x3 = _mm_xor_si128(x3, _mm_set1_epi32(-1));
+    x0 = _mm_xor_si128(x0, _mm_andnot_si128(x2, c));
+    __m128i tmp = _mm_xor_si128(c, _mm_and_si128(x0, x1));
+    x0 = _mm_xor_si128(x0, _mm_and_si128(x2, x3));
+    x3 = _mm_xor_si128(x3, _mm_andnot_si128(x1, x2));
+    x1 = _mm_xor_si128(x1, _mm_and_si128(x0, x2));
+    x2 = _mm_xor_si128(x2, _mm_andnot_si128(x3, x0));
+    x0 = _mm_xor_si128(x0, _mm_or_si128(x1, x3));
+    x3 = _mm_xor_si128(x3, _mm_and_si128(x1, x2));
+    x1 = _mm_xor_si128(x1, _mm_and_si128(tmp, x0));
+    x2 = _mm_xor_si128(x2, tmp);
+}
+
+JH_TARGET static HASHBACKEND_INLINE void JHLinear(__m128i& x0, __m128i& x1, __m128i& x2, __m128i& x3,
+                                                  __m128i& x4, __m128i& x5, __m128i& x6, __m128i& x7)
+{
+    x4 = _mm_xor_si128(x4, x1);
+    x5 = _mm_xor_si128(x5, x2);
+    x6 = _mm_xor_si128(x6, _mm_xor_si128(x3, x0));
+    x7 = _mm_xor_si128(x7, x0);
+    x0 = _mm_xor_si128(x0, x5);
+    x1 = _mm_xor_si128(x1, x6);
+    x2 = _mm_xor_si128(x2, _mm_xor_si128(x7, x4));
+    x3 = _mm_xor_si128(x3, x4);
+}
+
+// Swap adjacent groups of n bits inside each 64-bit word
+JH_TARGET static HASHBACKEND_INLINE __m128i JHSwapBits(__m128i x, sph_u64 mask, int n)
+{
+    __m128i m = _mm_set1_epi64x(mask);
+    return _mm_or_si128(_mm_and_si128(_mm_srli_epi64(x, n), m), _mm_slli_epi64(_mm_and_si128(x, m), n));
+}
+
+template<int nSwap>
+JH_TARGET static HASHBACKEND_INLINE __m128i JHSwap(__m128i x)
+{
+    switch (nSwap)
+    {
+    case 0: return JHSwapBits(x, SPH_C64(0x5555555555555555), 1);
+    case 1: return JHSwapBits(x, SPH_C64(0x3333333333333333), 2);
+    case 2: return JHSwapBits(x, SPH_C64(0x0F0F0F0F0F0F0F0F), 4);
+    case 3: return JHSwapBits(x, SPH_C64(0x00FF00FF00FF00FF), 8);
+    case 4: return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+    case 5: return _mm_shuffle_epi32(x, 0xb1);
+    default: return _mm_shuffle_epi32(x, 0x4e);
+    }
+}
+
+template<int nSwap>
+JH_TARGET static HASHBACKEND_INLINE void JHRound(__m128i* h, int r)
+{
+    const __m128i* c = (const __m128i*)pnJHRoundConstants;
+    JHSbox(h[0], h[2], h[4], h[6], _mm_load_si128(&c[2 * r]));
+    JHSbox(h[1], h[3], h[5], h[7], _mm_load_si128(&c[2 * r + 1]));
+    JHLinear(h[0], h[2], h[4], h[6], h[1], h[3], h[5], h[7]);
+    h[1] = JHSwap<nSwap>(h[1]);
+    h[3] = JHSwap<nSwap>(h[3]);
+    h[5] = JHSwap<nSwap>(h[5]);
+    h[7] = JHSwap<nSwap>(h[7]);
+}
+
+JH_TARGET static void JHCompress(__m128i* h, const unsigned char* pchBlock)
+{
+    __m128i m[4];
+    for (int i = 0; i < 4; i++)
+    {
+        m[i] = _mm_loadu_si128((const __m128i*)(pchBlock + 16 * i));
+        h[i] = _mm_xor_si128(h[i], m[i]);
+    }
+    for (int r = 0; r < 42; r += 7)
+    {
+        JHRound<0>(h, r);
+        JHRound<1>(h, r + 1);
+        JHRound<2>(h, r + 2);
+        JHRound<3>(h, r + 3);
+        JHRound<4>(h, r + 4);
+        JHRound<5>(h, r + 5);
+        JHRound<6>(h, r + 6);
+    }
+    for (int i = 0; i < 4; i++)
+        h[i + 4] = _mm_xor_si128(h[i + 4], m[i]);
+}
+
+JH_TARGET static void JH512SSE2(const void* pIn, void* pOut)
+{
+    __m128i h[8];
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm_load_si128((const __m128i*)&pnJH512IV[2 * i]);
+
+    JHCompress(h, (const unsigned char*)pIn);
+
+    // Padding block: a single 1 bit, then the 128-bit message length (512)
+    unsigned char pad[64];
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    pad[62] = 0x02;
+    JHCompress(h, pad);
+
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i*)((unsigned char*)pOut + 16 * i), h[i + 4]);
+}
+
+#endif
+
+
+//
+// Kernel table, fastest first; the sph entries close each list
+//
+
+static const CHashKernel pHashKernels[] =
+{
+#ifdef HASHBACKEND_USE_X86
+    { HASH_GROESTL512, "aesni", Groestl512AESNI, HaveAESNI },
+    { HASH_JH512,      "sse2",  JH512SSE2,       HaveSSE2 },
+#endif
+    { HASH_BLAKE512,   "sph",   Blake512Sph,     AlwaysSupported },
+    { HASH_GROESTL512, "sph",   Groestl512Sph,   AlwaysSupported },
+    { HASH_JH512,      "sph",   JH512Sph,        AlwaysSupported },
+    { HASH_SKEIN512,   "sph",   Skein512Sph,     AlwaysSupported },
+};
+
+const CHashKernel* GetHashKernels(int& nCount)
+{
+    nCount = sizeof(pHashKernels) / sizeof(pHashKernels[0]);
+    return pHashKernels;
+}
+
+const char* GetHashAlgoName(int nAlgo)
+{
+    static const char* pszNames[HASH_ALGO_COUNT] = { "blake512", "groestl512", "jh512", "skein512" };
+    return (nAlgo >= 0 && nAlgo < HASH_ALGO_COUNT) ? pszNames[nAlgo] : "unknown";
+}
+
+const char* GetHashBackendName(int nAlgo)
+{
+    return (nAlgo >= 0 && nAlgo < HASH_ALGO_COUNT) ? pszHash512Backend[nAlgo] : "unknown";
+}
+
+
+//
+// Self-test: the kernel must agree with sph on fixed patterns and on a chain
+// of its own outputs, both out of place and in place
+//
+
+static bool TestKernel(const CHashKernel& kernel, string& strError)
+{
+    Hash512Function pfnRef = pfnHash512Sph[kernel.nAlgo];
+    unsigned char pchIn[64], pchRef[64], pchOut[64];
+
+    for (int nTest = 0; nTest < 64; nTest++)
+    {
+        if (nTest == 0)
+            memset(pchIn, 0, sizeof(pchIn));
+        else if (nTest == 1)
+            memset(pchIn, 0xff, sizeof(pchIn));
+        else if (nTest == 2)
+            for (int i = 0; i < 64; i++)
+                pchIn[i] = i;
+        else
+            memcpy(pchIn, pchRef, sizeof(pchIn));
+
+        pfnRef(pchIn, pchRef);
+        kernel.pfn(pchIn, pchOut);
+        bool fMatch = (memcmp(pchOut, pchRef, 64) == 0);
+        if (fMatch)
+        {
+            memcpy(pchOut, pchIn, 64);
+            kernel.pfn(pchOut, pchOut);
+            fMatch = (memcmp(pchOut, pchRef, 64) == 0);
+        }
+        if (!fMatch)
+        {
+            strError = strprintf("%s kernel %s differs from sph on test vector %d",
+                                 GetHashAlgoName(kernel.nAlgo), kernel.pszName, nTest);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HashBackendSelfTest(string& strError)
+{
+    int nCount;
+    const CHashKernel* pKernels = GetHashKernels(nCount);
+    for (int i = 0; i < nCount; i++)
+        if (pKernels[i].pfnSupported() && !TestKernel(pKernels[i], strError))
+            return false;
+    return true;
+}
+
+void SelectHashBackends(bool fAllowSIMD)
+{
+    int nCount;
+    const CHashKernel* pKernels = GetHashKernels(nCount);
+    for (int nAlgo = 0; nAlgo < HASH_ALGO_COUNT; nAlgo++)
+    {
+        pfnHash512[nAlgo] = pfnHash512Sph[nAlgo];
+        pszHash512Backend[nAlgo] = "sph";
+        if (!fAllowSIMD)
+            continue;
+
+        for (int i = 0; i < nCount; i++)
+        {
+            const CHashKernel& kernel = pKernels[i];
+            if (kernel.nAlgo != nAlgo || kernel.pfn == pfnHash512Sph[nAlgo] || !kernel.pfnSupported())
+                continue;
+            string strError;
+            if (!TestKernel(kernel, strError))
+            {
+                printf("SelectHashBackends() : %s, not used\n", strError.c_str());
+                continue;
+            }
+            pfnHash512[nAlgo] = kernel.pfn;
+            pszHash512Backend[nAlgo] = kernel.pszName;
+            break;
+        }
+    }
+
+    printf("Hash backends: blake512=%s groestl512=%s jh512=%s skein512=%s\n",
+           pszHash512Backend[HASH_BLAKE512], pszHash512Backend[HASH_GROESTL512],
+           pszHash512Backend[HASH_JH512], pszHash512Backend[HASH_SKEIN512]);
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_HASHBACKEND_H
+#define BITCOIN_HASHBACKEND_H
+
+#include <string>
+
+/** Backends for the 512-bit hashes of the PoW round chain.
+ *
+ * Every round of HashSHA3V1Rounds/HashSHA3V2Rounds hashes exactly one
+ * 64-byte value, so the chain only needs "64 bytes in, 64 bytes out" for
+ * each function. The sph implementations are the reference; faster kernels
+ * are installed by SelectHashBackends() once the CPU has been checked for
+ * the instructions they need and their output has been compared against
+ * sph. Until then, and whenever a kernel fails that comparison, sph is used.
+ */
+
+// Order matches the method numbers of the version 1 round chain
+enum
+{
+    HASH_BLAKE512 = 0,
+    HASH_GROESTL512 = 1,
+    HASH_JH512 = 2,
+    HASH_SKEIN512 = 3,
+    HASH_ALGO_COUNT = 4,
+};
+
+// pOut may equal pIn; implementations read the whole input before writing
+typedef void (*Hash512Function)(const void* pIn, void* pOut);
+
+extern Hash512Function pfnHash512[HASH_ALGO_COUNT];
+
+// Select the fastest kernel of each function that the CPU supports and that
+// passes the self-test; with fAllowSIMD false the sph code is kept
+void SelectHashBackends(bool fAllowSIMD = true);
+
+// Compare every kernel the CPU supports against sph; returns false and
+// describes the first mismatch in strError
+bool HashBackendSelfTest(std::string& strError);
+
+// Name of the kernel currently in use for nAlgo
+const char* GetHashBackendName(int nAlgo);
+
+// Name of the algorithm, for log messages
+const char* GetHashAlgoName(int nAlgo);
+
+// Kernels built for this platform, including ones the CPU cannot run
+struct CHashKernel
+{
+    int nAlgo;
+    const char* pszName;
+    Hash512Function pfn;
+    bool (*pfnSupported)();
+};
+const CHashKernel* GetHashKernels(int& nCount);
+
+#endif
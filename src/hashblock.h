@@ -3,11 +3,8 @@
 #define HASHBLOCK_H
 
 #include "uint256.h"
-#include "sph_blake.h"
-#include "sph_groestl.h"
-#include "sph_jh.h"
+#include "hashbackend.h"
 #include "sph_keccak.h"
-#include "sph_skein.h"
 
 #ifndef QT_NO_DEBUG
 #include <string>
@@ -23,41 +20,22 @@
 
 
 
-inline uint256 HashSHA3V2(char * input, unsigned int round_mask) {
-
-    sph_blake512_context     ctx_blake;
-    sph_groestl512_context   ctx_groestl;
-    sph_jh512_context        ctx_jh;
-    sph_keccak512_context    ctx_keccak;
-    sph_skein512_context     ctx_skein;
-
-    uint512 hash;
-
-    sph_keccak512_init(&ctx_keccak);
-    sph_keccak512 (&ctx_keccak, input, 80);
-    sph_keccak512_close(&ctx_keccak, (&hash));
+// Round chain of the version 2 hash, applied to the Keccak-512 of the header
+inline uint256 HashSHA3V2Rounds(uint512 hash) {
 
     unsigned int round;
     for (round = 0; round < 3; round++) {
         if (hash.GetUInt32(0) & 0x01) {
-           sph_groestl512_init(&ctx_groestl);
-           sph_groestl512 (&ctx_groestl, (&hash), 64);
-           sph_groestl512_close(&ctx_groestl, (&hash));
+           pfnHash512[HASH_GROESTL512](&hash, &hash);
         }
         else {
-           sph_skein512_init(&ctx_skein);
-           sph_skein512 (&ctx_skein, (&hash), 64);
-           sph_skein512_close(&ctx_skein, (&hash));
+           pfnHash512[HASH_SKEIN512](&hash, &hash);
         }
         if (hash.GetUInt32(0) & 0x01) {
-           sph_blake512_init(&ctx_blake);
-           sph_blake512 (&ctx_blake, (&hash), 64);
-           sph_blake512_close(&ctx_blake, (&hash));
+           pfnHash512[HASH_BLAKE512](&hash, &hash);
         }
         else {
-           sph_jh512_init(&ctx_jh);
-           sph_jh512 (&ctx_jh, (&hash), 64);
-           sph_jh512_close(&ctx_jh, (&hash));
+           pfnHash512[HASH_JH512](&hash, &hash);
         }
     }
 
@@ -67,20 +45,25 @@ inline uint256 HashSHA3V2(char * input, unsigned int round_mask) {
 
 
 
-inline uint256 HashSHA3V1(char * input, unsigned int round_mask) {
+inline uint256 HashSHA3V2(char * input, unsigned int round_mask) {
 
-    sph_blake512_context     ctx_blake;
-    sph_groestl512_context   ctx_groestl;
-    sph_jh512_context        ctx_jh;
     sph_keccak512_context    ctx_keccak;
-    sph_skein512_context     ctx_skein;
 
     uint512 hash;
 
     sph_keccak512_init(&ctx_keccak);
-    sph_keccak512 (&ctx_keccak, input, 88);
+    sph_keccak512 (&ctx_keccak, input, 80);
     sph_keccak512_close(&ctx_keccak, (&hash));
 
+    return HashSHA3V2Rounds(hash);
+
+}
+
+
+
+// Round chain of the version 1 hash, applied to the Keccak-512 of the header
+inline uint256 HashSHA3V1Rounds(uint512 hash, unsigned int round_mask) {
+
     unsigned int round_max  = hash.GetUInt32(0) & round_mask;
 
     if (fDebugHash) {
@@ -93,28 +76,8 @@ inline uint256 HashSHA3V1(char * input, unsigned int round_mask) {
     unsigned int method;
     for (round = 0; round < round_max; round++) {
         method = (hash.GetUInt32(0) & 0x00000003);
-        switch (method) {
-          case 0:
-               sph_blake512_init(&ctx_blake);
-               sph_blake512 (&ctx_blake, (&hash), 64);
-               sph_blake512_close(&ctx_blake, (&hash));
-               break;
-          case 1:
-               sph_groestl512_init(&ctx_groestl);
-               sph_groestl512 (&ctx_groestl, (&hash), 64);
-               sph_groestl512_close(&ctx_groestl, (&hash));
-               break;
-          case 2:
-               sph_jh512_init(&ctx_jh);
-               sph_jh512 (&ctx_jh, (&hash), 64);
-               sph_jh512_close(&ctx_jh, (&hash));
-               break;
-          case 3:
-               sph_skein512_init(&ctx_skein);
-               sph_skein512 (&ctx_skein, (&hash), 64);
-               sph_skein512_close(&ctx_skein, static_cast<void*>(&hash));
-               break;
-        }
+        // methods 0..3 are blake, groestl, jh and skein
+        pfnHash512[method](&hash, &hash);
         if (fDebugHash) {
            printf("Hash R %d M %d : %s\n", round, method, hash.GetHex().c_str());
         }
@@ -126,6 +89,22 @@ inline uint256 HashSHA3V1(char * input, unsigned int round_mask) {
 
 
 
+inline uint256 HashSHA3V1(char * input, unsigned int round_mask) {
+
+    sph_keccak512_context    ctx_keccak;
+
+    uint512 hash;
+
+    sph_keccak512_init(&ctx_keccak);
+    sph_keccak512 (&ctx_keccak, input, 88);
+    sph_keccak512_close(&ctx_keccak, (&hash));
+
+    return HashSHA3V1Rounds(hash, round_mask);
+
+}
+
+
+
 template<typename T1>
 inline uint256 HashSHA3(const T1 pbegin, const T1 pend) {
 
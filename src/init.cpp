@@ -81,6 +81,14 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        {
+            LOCK(cs_main);
+            CTxDB txdb;
+            txdb.FlushTxIndexCache();
+        }
+        CloseTxDB();
+        CloseBlockFile();
+        CloseBlockFileMappings();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -231,8 +239,10 @@ std::string HelpMessage()
         "  -gen=0                 " + _("Don't generate coins") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + "\n" +
-        "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -dbcache=<n>           " + _("Set database cache size in megabytes, for Berkeley DB and again for the transaction index (default: 25)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -dbbackend=<name>      " + _("Store the block index in Berkeley DB (bdb) or in the log-structured store (log) (default: bdb)") + "\n" +
+        "  -convertdb             " + _("Copy the block index from the other -dbbackend on startup") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -256,6 +266,7 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -epoll                 " + _("Wait for network events with epoll rather than select, on Linux (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -276,6 +287,10 @@ std::string HelpMessage()
         "  -debug                 " + _("Output extra debugging information.") + "\n" +
         "  -debughigh             " + _("Output detail extra debugging information.") + "\n" +
         "  -debughash             " + _("Output hashing debugging information.") + "\n" +        
+        "  -simdhash              " + _("Use CPU-specific kernels for the proof-of-work hashes when they pass the self-test (default: 1)") + "\n" +
+        "  -par=<n>               " + _("Set the number of verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Maximum number of entries in the signature cache, 32 bytes each (default: 1048576)") + "\n" +
+        "  -maxblockcachesize=<n> " + _("Memory for recently read blocks and transactions, in megabytes (default: 32)") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n" +
         "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n" +
@@ -296,6 +311,7 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
+        "  -verifyblockindex      " + _("Check the hashes of the block index against the headers in the background after startup") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
@@ -468,6 +484,15 @@ bool AppInit2()
             nConnectTimeout = nNewTimeout;
     }
 
+    // -par=0 means autodetect, but nCheckThreads==0 means no concurrency
+    nCheckThreads = GetArg("-par", 0);
+    if (nCheckThreads <= 0)
+        nCheckThreads += boost::thread::hardware_concurrency();
+    if (nCheckThreads <= 1)
+        nCheckThreads = 0;
+    else if (nCheckThreads > MAX_CHECK_THREADS)
+        nCheckThreads = MAX_CHECK_THREADS;
+
     // Continue to put "/P2SH/" in the coinbase to monitor
     // BIP16 support.
     // This can be removed eventually...
@@ -531,6 +556,20 @@ bool AppInit2()
         printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
     printf("Used data directory %s\n", strDataDir.c_str());
+    SelectHashBackends(GetBoolArg("-simdhash", true));
+    InitSignatureCache();
+    InitBlockReadCache();
+    if (nCheckThreads)
+    {
+        // The thread that waits on a queue works through it too, so the
+        // -par threads besides it are split between the two queues
+        int nWorkers = nCheckThreads - 1;
+        printf("Using %d threads for block and script verification\n", nCheckThreads);
+        for (int i = 0; i < nWorkers / 2; i++)
+            NewThread(ThreadBlockCheck, NULL);
+        for (int i = 0; i < nWorkers - nWorkers / 2; i++)
+            NewThread(ThreadScriptCheck, NULL);
+    }
     std::ostringstream strErrors;
 
     if (fDaemon)
@@ -705,6 +744,9 @@ bool AppInit2()
         return InitError(msg);
     }
 
+    if (!OpenTxDB())
+        return InitError(_("Error opening the block index database"));
+
     if (GetBoolArg("-loadblockindextest"))
     {
         CTxDB txdb("r");
@@ -730,6 +772,12 @@ bool AppInit2()
     }
     printf("block index loading time : %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    NewThread(ThreadSyncBlockFile, NULL);
+
+    // The block hashes were taken from the database keys
+    if (GetBoolArg("-verifyblockindex"))
+        NewThread(ThreadVerifyBlockIndex, NULL);
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -740,7 +788,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -98,7 +98,10 @@ static bool SelectBlockFromCandidates(
             continue;
         // compute the selection hash by hashing its proof-hash and the
         // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
+        CBlockIndexStake stake;
+        if (!GetBlockIndexStake(pindex, stake))
+            return error("SelectBlockFromCandidates: failed to read stake fields of candidate block %s", item.second.ToString().c_str());
+        uint256 hashProof = pindex->IsProofOfStake()? stake.hashProofOfStake : pindex->GetBlockHash();
         CDataStream ss(SER_GETHASH, 0);
         ss << hashProof << nStakeModifierPrev;
         uint256 hashSelection = Hash(ss.begin(), ss.end());
@@ -450,7 +453,7 @@ bool CheckCoinStakeTimestamp(int64 nTimeBlock, int64 nTimeTx)
 }
 
 // Get stake modifier checksum
-unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex)
+bool GetStakeModifierChecksum(const CBlockIndex* pindex, unsigned int& nStakeModifierChecksum)
 {
     assert (pindex->pprev || pindex->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
     // Hash previous checksum with flags, hashProofOfStake and nStakeModifier
@@ -459,10 +462,14 @@ unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex)
     {
         ss << pindex->pprev->nStakeModifierChecksum;
     }
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
+    CBlockIndexStake stake;
+    if (!GetBlockIndexStake(pindex, stake))
+        return error("GetStakeModifierChecksum() : failed to read stake fields of block %s", pindex->GetBlockHash().ToString().c_str());
+    ss << (unsigned int)pindex->nFlags << stake.hashProofOfStake << pindex->nStakeModifier;
     uint256 hashChecksum = Hash(ss.begin(), ss.end());
     hashChecksum >>= (256 - 32);
-    return hashChecksum.Get64();
+    nStakeModifierChecksum = hashChecksum.Get64();
+    return true;
 }
 
 // Check stake modifier hard checkpoints
@@ -30,7 +30,8 @@ bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hash
 bool CheckCoinStakeTimestamp(int64 nTimeBlock, int64 nTimeTx);
 
 // Get stake modifier checksum
-unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex);
+// Fails when the stake fields of the block cannot be read
+bool GetStakeModifierChecksum(const CBlockIndex* pindex, unsigned int& nStakeModifierChecksum);
 
 // Check stake modifier hard checkpoints
 bool CheckStakeModifierCheckpoints(int nHeight, unsigned int nStakeModifierChecksum);
@@ -0,0 +1,1055 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kvstore.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+//
+// Files in the directory of a CLogKVStore:
+//   MANIFEST     live segments, current log, next file number
+//   nnnnnn.log   write-ahead log of the batches not yet in a segment
+//   nnnnnn.seg   sorted segment
+//
+// A segment is a sequence of blocks of up to LOG_SEGMENT_BLOCK records,
+// followed by an index holding the first key and offset of every block and
+// a bloom filter of the keys, and a fixed size footer locating the index.
+//
+
+static const unsigned int LOG_MAGIC = 0x4b564c53;
+static const unsigned int LOG_SEGMENT_BLOCK = 16;
+static const unsigned int LOG_FOOTER_SIZE = 8 + 8 + 4;
+static const unsigned int LOG_BLOOM_BITS_PER_KEY = 10;
+static const unsigned int LOG_BLOOM_HASHES = 6;
+
+// A segment merged into a larger one is dropped once it is more than
+// LOG_MERGE_RATIO times the size of all newer segments together
+static const unsigned int LOG_MERGE_RATIO = 2;
+
+static const uint64 LOG_SEQUENCE_LATEST = ~(uint64)0;
+
+/** Record of a log or segment; fErased marks a deleted key */
+class CLogRecord
+{
+public:
+    std::string strKey;
+    bool fErased;
+    std::string strValue;
+
+    CLogRecord() : fErased(false) {}
+    CLogRecord(const std::string& strKeyIn, bool fErasedIn, const std::string& strValueIn) :
+        strKey(strKeyIn), fErased(fErasedIn), strValue(strValueIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(strKey);
+        READWRITE(fErased);
+        READWRITE(strValue);
+    )
+};
+
+static uint64 HashLogKey(const string& strKey)
+{
+    // FNV-1a
+    uint64 nHash = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < strKey.size(); i++)
+        nHash = (nHash ^ (unsigned char)strKey[i]) * 0x100000001b3ULL;
+    return nHash;
+}
+
+static bool ReadFileData(const boost::filesystem::path& path, vector<char>& vData)
+{
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    vData.clear();
+    char pch[65536];
+    size_t nRead;
+    while ((nRead = fread(pch, 1, sizeof(pch), file)) > 0)
+        vData.insert(vData.end(), pch, pch + nRead);
+    bool fOk = !ferror(file);
+    fclose(file);
+    return fOk;
+}
+
+static boost::filesystem::path GetLogFilePath(const boost::filesystem::path& pathDir, unsigned int nFile, const char* pszExt)
+{
+    return pathDir / strprintf("%06u.%s", nFile, pszExt);
+}
+
+
+/** Records of a memory table or segment, including erased ones */
+class CLogIterator : public CKVIterator
+{
+public:
+    virtual bool IsErased() const = 0;
+};
+
+
+//
+// CLogMemTable
+//
+
+/** Records written since the last segment. Older versions of a record are
+ * kept while a snapshot may read them. */
+class CLogMemTable
+{
+public:
+    // Versions of a record, oldest first: (sequence, (erased, value))
+    typedef vector<pair<uint64, pair<bool, string> > > VersionList;
+
+    CCriticalSection cs;
+    map<string, VersionList> mapRecords;
+    size_t nUsage;
+    int nSnapshots;
+
+    CLogMemTable() : nUsage(0), nSnapshots(0)
+    {
+    }
+
+    void Put(uint64 nSequence, const string& strKey, bool fErased, const string& strValue)
+    {
+        VersionList& versions = mapRecords[strKey];
+        if (versions.empty())
+            nUsage += 64 + strKey.size();
+        if (nSnapshots == 0)
+        {
+            BOOST_FOREACH(const VersionList::value_type& version, versions)
+                nUsage -= 32 + version.second.second.size();
+            versions.clear();
+        }
+        versions.push_back(make_pair(nSequence, make_pair(fErased, strValue)));
+        nUsage += 32 + strValue.size();
+    }
+
+    // The newest version of the record at nSequence, if any
+    static const VersionList::value_type* GetVersion(const VersionList& versions, uint64 nSequence)
+    {
+        for (VersionList::const_reverse_iterator it = versions.rbegin(); it != versions.rend(); ++it)
+            if (it->first <= nSequence)
+                return &*it;
+        return NULL;
+    }
+
+    bool Get(const string& strKey, uint64 nSequence, bool& fErased, string& strValue)
+    {
+        LOCK(cs);
+        map<string, VersionList>::const_iterator mi = mapRecords.find(strKey);
+        if (mi == mapRecords.end())
+            return false;
+        const VersionList::value_type* pversion = GetVersion(mi->second, nSequence);
+        if (!pversion)
+            return false;
+        fErased = pversion->second.first;
+        strValue = pversion->second.second;
+        return true;
+    }
+};
+
+class CLogMemIterator : public CLogIterator
+{
+private:
+    boost::shared_ptr<CLogMemTable> pmem;
+    uint64 nSequence;
+    bool fValid;
+    string strKey;
+    bool fErased;
+    string strValue;
+
+    // Settle on the first record at or after mi visible at nSequence
+    void Find(map<string, CLogMemTable::VersionList>::const_iterator mi)
+    {
+        for (; mi != pmem->mapRecords.end(); ++mi)
+        {
+            const CLogMemTable::VersionList::value_type* pversion = CLogMemTable::GetVersion(mi->second, nSequence);
+            if (pversion)
+            {
+                fValid = true;
+                strKey = mi->first;
+                fErased = pversion->second.first;
+                strValue = pversion->second.second;
+                return;
+            }
+        }
+        fValid = false;
+    }
+
+public:
+    CLogMemIterator(const boost::shared_ptr<CLogMemTable>& pmemIn, uint64 nSequenceIn) :
+        pmem(pmemIn), nSequence(nSequenceIn), fValid(false), fErased(false)
+    {
+    }
+
+    void Seek(const string& strKeyIn)
+    {
+        LOCK(pmem->cs);
+        Find(pmem->mapRecords.lower_bound(strKeyIn));
+    }
+
+    void Next()
+    {
+        LOCK(pmem->cs);
+        Find(pmem->mapRecords.upper_bound(strKey));
+    }
+
+    bool Valid() const { return fValid; }
+    const string& GetKey() const { return strKey; }
+    const string& GetValue() const { return strValue; }
+    bool IsErased() const { return fErased; }
+};
+
+
+//
+// CLogSegment
+//
+
+class CLogSegment
+{
+private:
+    CCriticalSection cs;
+    FILE* file;
+    uint64 nIndexPos;
+    vector<pair<string, uint64> > vIndex;
+    vector<unsigned char> vBloom;
+
+    CLogSegment(const CLogSegment&);
+    void operator=(const CLogSegment&);
+
+    static unsigned int GetBloomBit(uint64 nHash, unsigned int i, unsigned int nBits)
+    {
+        // Double hashing: the two halves of nHash generate all the probes
+        return (unsigned int)(((nHash & 0xffffffff) + i * (nHash >> 32)) % nBits);
+    }
+
+public:
+    unsigned int nFile;
+    boost::filesystem::path path;
+    uint64 nFileSize;
+
+    // Replaced by a merged segment; the file is removed when the last
+    // snapshot reading it is gone
+    bool fObsolete;
+
+    CLogSegment(const boost::filesystem::path& pathIn, unsigned int nFileIn) :
+        file(NULL), nIndexPos(0), nFile(nFileIn), path(pathIn), nFileSize(0), fObsolete(false)
+    {
+    }
+
+    ~CLogSegment()
+    {
+        if (file)
+            fclose(file);
+        if (fObsolete)
+        {
+            try {
+                boost::filesystem::remove(path);
+            } catch (boost::filesystem::filesystem_error &e) {
+                printf("CLogSegment : cannot remove %s\n", path.string().c_str());
+            }
+        }
+    }
+
+    bool Open()
+    {
+        file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return error("CLogSegment::Open() : cannot open %s", path.string().c_str());
+        if (fseek(file, 0, SEEK_END) != 0)
+            return error("CLogSegment::Open() : seek failed");
+        nFileSize = ftell(file);
+        if (nFileSize < LOG_FOOTER_SIZE)
+            return error("CLogSegment::Open() : %s truncated", path.string().c_str());
+
+        try {
+            char pchFooter[LOG_FOOTER_SIZE];
+            if (fseek(file, nFileSize - LOG_FOOTER_SIZE, SEEK_SET) != 0 || fread(pchFooter, 1, LOG_FOOTER_SIZE, file) != LOG_FOOTER_SIZE)
+                return error("CLogSegment::Open() : cannot read %s", path.string().c_str());
+            CDataStream ssFooter(pchFooter, pchFooter + LOG_FOOTER_SIZE, SER_DISK, CLIENT_VERSION);
+            uint64 nChecksum;
+            unsigned int nMagic;
+            ssFooter >> nIndexPos >> nChecksum >> nMagic;
+            if (nMagic != LOG_MAGIC || nIndexPos > nFileSize - LOG_FOOTER_SIZE)
+                return error("CLogSegment::Open() : %s is not a segment", path.string().c_str());
+
+            vector<char> vData(nFileSize - LOG_FOOTER_SIZE - nIndexPos);
+            if (fseek(file, nIndexPos, SEEK_SET) != 0 || fread(&vData[0], 1, vData.size(), file) != vData.size())
+                return error("CLogSegment::Open() : cannot read %s", path.string().c_str());
+            if (Hash(vData.begin(), vData.end()).Get64() != nChecksum)
+                return error("CLogSegment::Open() : %s index checksum mismatch", path.string().c_str());
+            CDataStream ss(vData, SER_DISK, CLIENT_VERSION);
+            ss >> vIndex >> vBloom;
+        }
+        catch (std::exception &e) {
+            return error("CLogSegment::Open() : I/O error or %s corrupted", path.string().c_str());
+        }
+        return true;
+    }
+
+    unsigned int GetBlockCount() const
+    {
+        return vIndex.size();
+    }
+
+    // The block that would hold strKey, or -1 if strKey is before them all
+    int FindBlock(const string& strKey) const
+    {
+        int nLow = 0, nHigh = vIndex.size();
+        while (nLow < nHigh)
+        {
+            int nMid = (nLow + nHigh) / 2;
+            if (vIndex[nMid].first <= strKey)
+                nLow = nMid + 1;
+            else
+                nHigh = nMid;
+        }
+        return nLow - 1;
+    }
+
+    void ReadBlock(unsigned int nBlock, vector<CLogRecord>& vRecords)
+    {
+        uint64 nBegin = vIndex[nBlock].second;
+        uint64 nEnd = nBlock + 1 < vIndex.size() ? vIndex[nBlock + 1].second : nIndexPos;
+        vector<char> vData(nEnd - nBegin);
+        {
+            LOCK(cs);
+            if (fseek(file, nBegin, SEEK_SET) != 0 || fread(&vData[0], 1, vData.size(), file) != vData.size())
+                throw runtime_error(strprintf("CLogSegment::ReadBlock() : cannot read %s", path.string().c_str()));
+        }
+        CDataStream ss(vData, SER_DISK, CLIENT_VERSION);
+        ss >> vRecords;
+    }
+
+    bool MayContain(const string& strKey) const
+    {
+        unsigned int nBits = vBloom.size() * 8;
+        if (nBits == 0)
+            return false;
+        uint64 nHash = HashLogKey(strKey);
+        for (unsigned int i = 0; i < LOG_BLOOM_HASHES; i++)
+        {
+            unsigned int nBit = GetBloomBit(nHash, i, nBits);
+            if (!(vBloom[nBit >> 3] & (1 << (nBit & 7))))
+                return false;
+        }
+        return true;
+    }
+
+    bool Get(const string& strKey, bool& fErased, string& strValue)
+    {
+        if (!MayContain(strKey))
+            return false;
+        int nBlock = FindBlock(strKey);
+        if (nBlock < 0)
+            return false;
+        vector<CLogRecord> vRecords;
+        ReadBlock(nBlock, vRecords);
+        BOOST_FOREACH(const CLogRecord& record, vRecords)
+        {
+            if (record.strKey == strKey)
+            {
+                fErased = record.fErased;
+                strValue = record.strValue;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Write the records of it, from its current position, to a new segment
+    static bool Write(const boost::filesystem::path& pathNew, CLogIterator& it, bool fKeepErased)
+    {
+        FILE* fileout = fopen(pathNew.string().c_str(), "wb");
+        if (!fileout)
+            return error("CLogSegment::Write() : cannot create %s", pathNew.string().c_str());
+
+        vector<pair<string, uint64> > vIndexNew;
+        vector<uint64> vHashes;
+        vector<CLogRecord> vBlock;
+        uint64 nPos = 0;
+        bool fOk = true;
+        while (fOk)
+        {
+            bool fEnd = !it.Valid();
+            if (!fEnd && (fKeepErased || !it.IsErased()))
+            {
+                vBlock.push_back(CLogRecord(it.GetKey(), it.IsErased(), it.GetValue()));
+                vHashes.push_back(HashLogKey(it.GetKey()));
+            }
+            if (vBlock.size() == LOG_SEGMENT_BLOCK || (fEnd && !vBlock.empty()))
+            {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                ss << vBlock;
+                vIndexNew.push_back(make_pair(vBlock[0].strKey, nPos));
+                fOk = fwrite(&ss[0], 1, ss.size(), fileout) == ss.size();
+                nPos += ss.size();
+                vBlock.clear();
+            }
+            if (fEnd)
+                break;
+            it.Next();
+        }
+
+        // Bloom filter of the keys, then the index and the footer
+        unsigned int nBits = max((size_t)64, vHashes.size() * LOG_BLOOM_BITS_PER_KEY);
+        vector<unsigned char> vBloomNew((nBits + 7) / 8);
+        nBits = vBloomNew.size() * 8;
+        BOOST_FOREACH(uint64 nHash, vHashes)
+            for (unsigned int i = 0; i < LOG_BLOOM_HASHES; i++)
+            {
+                unsigned int nBit = GetBloomBit(nHash, i, nBits);
+                vBloomNew[nBit >> 3] |= 1 << (nBit & 7);
+            }
+
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << vIndexNew << vBloomNew;
+        uint64 nChecksum = Hash(ss.begin(), ss.end()).Get64();
+        ss << nPos << nChecksum << LOG_MAGIC;
+        if (fOk)
+            fOk = fwrite(&ss[0], 1, ss.size(), fileout) == ss.size();
+        FileCommit(fileout);
+        fclose(fileout);
+        if (!fOk)
+            return error("CLogSegment::Write() : writing %s failed", pathNew.string().c_str());
+        return true;
+    }
+};
+
+class CLogSegmentIterator : public CLogIterator
+{
+private:
+    boost::shared_ptr<CLogSegment> psegment;
+    unsigned int nBlock;
+    vector<CLogRecord> vRecords;
+    unsigned int nPos;
+
+    // Move on to the next block while past the end of the current one
+    void Settle()
+    {
+        while (nPos >= vRecords.size() && ++nBlock < psegment->GetBlockCount())
+        {
+            psegment->ReadBlock(nBlock, vRecords);
+            nPos = 0;
+        }
+    }
+
+public:
+    CLogSegmentIterator(const boost::shared_ptr<CLogSegment>& psegmentIn) :
+        psegment(psegmentIn), nBlock(0), nPos(0)
+    {
+    }
+
+    void Seek(const string& strKey)
+    {
+        int nFound = psegment->FindBlock(strKey);
+        nBlock = max(nFound, 0);
+        nPos = 0;
+        vRecords.clear();
+        if (nBlock < psegment->GetBlockCount())
+            psegment->ReadBlock(nBlock, vRecords);
+        while (nPos < vRecords.size() && vRecords[nPos].strKey < strKey)
+            nPos++;
+        Settle();
+    }
+
+    void Next()
+    {
+        nPos++;
+        Settle();
+    }
+
+    bool Valid() const { return nBlock < psegment->GetBlockCount() && nPos < vRecords.size(); }
+    const string& GetKey() const { return vRecords[nPos].strKey; }
+    const string& GetValue() const { return vRecords[nPos].strValue; }
+    bool IsErased() const { return vRecords[nPos].fErased; }
+};
+
+
+//
+// CLogMergeIterator
+//
+
+class CLogSnapshot;
+
+/** Merges the memory table and segments; where several hold a key, the
+ * first child, the newest, wins */
+class CLogMergeIterator : public CLogIterator
+{
+private:
+    vector<CLogIterator*> vChildren;
+    bool fSkipErased;
+    int nCurrent;
+
+    void Find()
+    {
+        while (true)
+        {
+            nCurrent = -1;
+            for (unsigned int i = 0; i < vChildren.size(); i++)
+                if (vChildren[i]->Valid() && (nCurrent < 0 || vChildren[i]->GetKey() < vChildren[nCurrent]->GetKey()))
+                    nCurrent = i;
+            if (nCurrent < 0 || !fSkipErased || !vChildren[nCurrent]->IsErased())
+                return;
+            Skip();
+        }
+    }
+
+    // Advance every child positioned at the current key
+    void Skip()
+    {
+        string strKey = vChildren[nCurrent]->GetKey();
+        BOOST_FOREACH(CLogIterator* pchild, vChildren)
+            if (pchild->Valid() && pchild->GetKey() == strKey)
+                pchild->Next();
+    }
+
+public:
+    // Keeps the snapshot the children read from alive
+    boost::shared_ptr<CLogSnapshot> psnapshot;
+
+    CLogMergeIterator(const vector<CLogIterator*>& vChildrenIn, bool fSkipErasedIn) :
+        vChildren(vChildrenIn), fSkipErased(fSkipErasedIn), nCurrent(-1)
+    {
+    }
+
+    ~CLogMergeIterator()
+    {
+        BOOST_FOREACH(CLogIterator* pchild, vChildren)
+            delete pchild;
+    }
+
+    void Seek(const string& strKey)
+    {
+        BOOST_FOREACH(CLogIterator* pchild, vChildren)
+            pchild->Seek(strKey);
+        Find();
+    }
+
+    void Next()
+    {
+        Skip();
+        Find();
+    }
+
+    bool Valid() const { return nCurrent >= 0; }
+    const string& GetKey() const { return vChildren[nCurrent]->GetKey(); }
+    const string& GetValue() const { return vChildren[nCurrent]->GetValue(); }
+    bool IsErased() const { return vChildren[nCurrent]->IsErased(); }
+};
+
+
+//
+// CLogSnapshot
+//
+
+static bool LogLookup(CLogMemTable& mem, const vector<boost::shared_ptr<CLogSegment> >& vSegments, uint64 nSequence,
+                      const string& strKey, string& strValue)
+{
+    bool fErased = false;
+    try {
+        if (!mem.Get(strKey, nSequence, fErased, strValue))
+        {
+            bool fFound = false;
+            for (int i = vSegments.size() - 1; i >= 0 && !fFound; i--)
+                fFound = vSegments[i]->Get(strKey, fErased, strValue);
+            if (!fFound)
+                return false;
+        }
+    }
+    catch (std::exception &e) {
+        return error("CLogKVStore : %s", e.what());
+    }
+    return !fErased;
+}
+
+class CLogSnapshot : public CKVReader
+{
+private:
+    boost::shared_ptr<CLogMemTable> pmem;
+    vector<boost::shared_ptr<CLogSegment> > vSegments;
+    uint64 nSequence;
+
+public:
+    CLogSnapshot(const boost::shared_ptr<CLogMemTable>& pmemIn, const vector<boost::shared_ptr<CLogSegment> >& vSegmentsIn, uint64 nSequenceIn) :
+        pmem(pmemIn), vSegments(vSegmentsIn), nSequence(nSequenceIn)
+    {
+        LOCK(pmem->cs);
+        pmem->nSnapshots++;
+    }
+
+    ~CLogSnapshot()
+    {
+        LOCK(pmem->cs);
+        pmem->nSnapshots--;
+    }
+
+    bool ReadRaw(const string& strKey, string& strValue)
+    {
+        return LogLookup(*pmem, vSegments, nSequence, strKey, strValue);
+    }
+
+    CLogMergeIterator* NewMergeIterator()
+    {
+        vector<CLogIterator*> vChildren;
+        vChildren.push_back(new CLogMemIterator(pmem, nSequence));
+        for (int i = vSegments.size() - 1; i >= 0; i--)
+            vChildren.push_back(new CLogSegmentIterator(vSegments[i]));
+        return new CLogMergeIterator(vChildren, true);
+    }
+
+    CKVIterator* NewIterator()
+    {
+        return NewMergeIterator();
+    }
+};
+
+
+//
+// CLogKVStore
+//
+
+CLogKVStore::CLogKVStore(size_t nMaxMemTableIn) :
+    fileLog(NULL), nLogFile(0), nNextFile(1), nSequence(0), nMaxMemTable(nMaxMemTableIn),
+    pmem(new CLogMemTable()), pthreadMerge(NULL), fMergeWanted(false), fMergeBusy(false), fMergeStop(false)
+{
+}
+
+CLogKVStore::~CLogKVStore()
+{
+    Close();
+}
+
+bool CLogKVStore::Open(const boost::filesystem::path& pathDirIn)
+{
+    LOCK(cs);
+    pathDir = pathDirIn;
+    boost::filesystem::create_directories(pathDir);
+
+    // Read the manifest, if the store exists
+    vector<unsigned int> vFiles;
+    boost::filesystem::path pathManifest = pathDir / "MANIFEST";
+    if (boost::filesystem::exists(pathManifest))
+    {
+        vector<char> vData;
+        if (!ReadFileData(pathManifest, vData) || vData.size() < sizeof(uint256))
+            return error("CLogKVStore::Open() : cannot read %s", pathManifest.string().c_str());
+        CDataStream ss(&vData[0], &vData[0] + vData.size() - sizeof(uint256), SER_DISK, CLIENT_VERSION);
+        uint256 hashIn;
+        memcpy(&hashIn, &vData[vData.size() - sizeof(uint256)], sizeof(uint256));
+        if (Hash(ss.begin(), ss.end()) != hashIn)
+            return error("CLogKVStore::Open() : manifest checksum mismatch; data corrupted");
+        try {
+            unsigned int nMagic;
+            ss >> nMagic >> nNextFile >> nLogFile >> nSequence >> vFiles;
+            if (nMagic != LOG_MAGIC)
+                return error("CLogKVStore::Open() : invalid manifest");
+        }
+        catch (std::exception &e) {
+            return error("CLogKVStore::Open() : manifest corrupted");
+        }
+    }
+
+    vSegments.clear();
+    BOOST_FOREACH(unsigned int nFile, vFiles)
+    {
+        boost::shared_ptr<CLogSegment> psegment(new CLogSegment(GetLogFilePath(pathDir, nFile, "seg"), nFile));
+        if (!psegment->Open())
+            return false;
+        vSegments.push_back(psegment);
+    }
+
+    // Remove what a crash left behind: segments not in the manifest, and
+    // logs other than the current one
+    set<string> setLive;
+    setLive.insert(GetLogFilePath(pathDir, nLogFile, "log").string());
+    BOOST_FOREACH(unsigned int nFile, vFiles)
+        setLive.insert(GetLogFilePath(pathDir, nFile, "seg").string());
+    vector<boost::filesystem::path> vRemove;
+    for (boost::filesystem::directory_iterator it(pathDir); it != boost::filesystem::directory_iterator(); ++it)
+    {
+        string strPath = it->path().string();
+        string strExt = strPath.size() >= 4 ? strPath.substr(strPath.size() - 4) : "";
+        if ((strExt == ".seg" || strExt == ".log" || strExt == ".tmp") && !setLive.count(strPath))
+            vRemove.push_back(it->path());
+    }
+    BOOST_FOREACH(const boost::filesystem::path& path, vRemove)
+        boost::filesystem::remove(path);
+
+    // Recover the batches of the log, then move them to a segment so
+    // writing starts on a new log
+    pmem.reset(new CLogMemTable());
+    if (nLogFile != 0 && !ReplayLog(nLogFile))
+        return false;
+    if (!pthreadMerge)
+    {
+        fMergeStop = false;
+        pthreadMerge = new boost::thread(boost::bind(&CLogKVStore::ThreadMerge, this));
+    }
+    return FlushMemTable();
+}
+
+bool CLogKVStore::ReplayLog(unsigned int nFile)
+{
+    boost::filesystem::path pathLog = GetLogFilePath(pathDir, nFile, "log");
+    vector<char> vData;
+    if (!boost::filesystem::exists(pathLog))
+        return true;
+    if (!ReadFileData(pathLog, vData))
+        return error("CLogKVStore::ReplayLog() : cannot read %s", pathLog.string().c_str());
+
+    // Each batch is its size and checksum, then the sequence number and
+    // the records. A torn batch at the end was never acknowledged.
+    unsigned int nBatches = 0;
+    unsigned int nPos = 0;
+    while (nPos + 8 <= vData.size())
+    {
+        unsigned int nSize, nChecksum;
+        memcpy(&nSize, &vData[nPos], 4);
+        memcpy(&nChecksum, &vData[nPos + 4], 4);
+        if (nSize > vData.size() - nPos - 8)
+            break;
+        const char* pBegin = &vData[0] + nPos + 8;
+        if ((unsigned int)Hash(pBegin, pBegin + nSize).Get64() != nChecksum)
+            break;
+        try {
+            CDataStream ss(pBegin, pBegin + nSize, SER_DISK, CLIENT_VERSION);
+            uint64 nBatchSequence;
+            ss >> nBatchSequence;
+            uint64 nRecords = ReadCompactSize(ss);
+            LOCK(pmem->cs);
+            for (uint64 i = 0; i < nRecords; i++)
+            {
+                CLogRecord record;
+                ss >> record;
+                pmem->Put(nBatchSequence, record.strKey, record.fErased, record.strValue);
+            }
+            nSequence = max(nSequence, nBatchSequence);
+        }
+        catch (std::exception &e) {
+            return error("CLogKVStore::ReplayLog() : %s corrupted", pathLog.string().c_str());
+        }
+        nPos += 8 + nSize;
+        nBatches++;
+    }
+    if (nPos != vData.size())
+        printf("CLogKVStore::ReplayLog() : ignoring %"PRIszu" bytes at the end of %s\n", vData.size() - nPos, pathLog.string().c_str());
+    printf("CLogKVStore::ReplayLog() : %u batches recovered from %s\n", nBatches, pathLog.string().c_str());
+    return true;
+}
+
+void CLogKVStore::Close()
+{
+    // A merge under way is finished first. The merge thread takes cs, so
+    // it is not held while waiting.
+    if (pthreadMerge)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMerge);
+            fMergeStop = true;
+        }
+        condMerge.notify_all();
+        pthreadMerge->join();
+        delete pthreadMerge;
+        pthreadMerge = NULL;
+    }
+
+    LOCK(cs);
+    if (fileLog)
+    {
+        FileCommit(fileLog);
+        fclose(fileLog);
+        fileLog = NULL;
+    }
+}
+
+bool CLogKVStore::WriteManifest(unsigned int nLogFileNew, const vector<boost::shared_ptr<CLogSegment> >& vSegmentsNew)
+{
+    vector<unsigned int> vFiles;
+    BOOST_FOREACH(const boost::shared_ptr<CLogSegment>& psegment, vSegmentsNew)
+        vFiles.push_back(psegment->nFile);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << LOG_MAGIC << nNextFile << nLogFileNew << nSequence << vFiles;
+    uint256 hash = Hash(ss.begin(), ss.end());
+    ss << hash;
+
+    boost::filesystem::path pathTmp = pathDir / "MANIFEST.tmp";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("CLogKVStore::WriteManifest() : cannot create %s", pathTmp.string().c_str());
+    bool fOk = fwrite(&ss[0], 1, ss.size(), file) == ss.size();
+    FileCommit(file);
+    fclose(file);
+    if (!fOk)
+        return error("CLogKVStore::WriteManifest() : write failed");
+    if (!RenameOver(pathTmp, pathDir / "MANIFEST"))
+        return error("CLogKVStore::WriteManifest() : rename failed");
+    return true;
+}
+
+// Write the memory table to a new segment and start a new log
+bool CLogKVStore::FlushMemTable()
+{
+    vector<boost::shared_ptr<CLogSegment> > vSegmentsNew = vSegments;
+    if (!pmem->mapRecords.empty())
+    {
+        unsigned int nFile = nNextFile++;
+        boost::filesystem::path pathSegment = GetLogFilePath(pathDir, nFile, "seg");
+        CLogMemIterator it(pmem, LOG_SEQUENCE_LATEST);
+        it.SeekToFirst();
+        // Erased records only need to hide older segments
+        if (!CLogSegment::Write(pathSegment, it, !vSegments.empty()))
+            return false;
+        boost::shared_ptr<CLogSegment> psegment(new CLogSegment(pathSegment, nFile));
+        if (!psegment->Open())
+            return false;
+        vSegmentsNew.push_back(psegment);
+    }
+
+    unsigned int nLogFileNew = nNextFile++;
+    FILE* fileLogNew = fopen(GetLogFilePath(pathDir, nLogFileNew, "log").string().c_str(), "ab");
+    if (!fileLogNew)
+        return error("CLogKVStore::FlushMemTable() : cannot create log");
+    if (!WriteManifest(nLogFileNew, vSegmentsNew))
+    {
+        fclose(fileLogNew);
+        return false;
+    }
+
+    if (fileLog)
+        fclose(fileLog);
+    if (nLogFile != 0)
+        boost::filesystem::remove(GetLogFilePath(pathDir, nLogFile, "log"));
+    fileLog = fileLogNew;
+    nLogFile = nLogFileNew;
+    vSegments = vSegmentsNew;
+    pmem.reset(new CLogMemTable());
+    WakeMerge();
+    return true;
+}
+
+// Merge the newest segments while the next older one is at most
+// LOG_MERGE_RATIO times as large as them together. Segments never change,
+// so they are merged without holding cs; meanwhile flushes only add newer
+// segments after them.
+bool CLogKVStore::MergeSegments()
+{
+    while (true)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMerge);
+            if (fMergeStop)
+                return true;
+        }
+
+        unsigned int nFirst, nMerge, nFile;
+        vector<boost::shared_ptr<CLogSegment> > vMerge;
+        {
+            LOCK(cs);
+            if (vSegments.size() < 2)
+                return true;
+            nMerge = 1;
+            uint64 nTotal = vSegments.back()->nFileSize;
+            while (nMerge < vSegments.size() && vSegments[vSegments.size() - nMerge - 1]->nFileSize <= LOG_MERGE_RATIO * nTotal)
+            {
+                nMerge++;
+                nTotal += vSegments[vSegments.size() - nMerge]->nFileSize;
+            }
+            if (nMerge < 2)
+                return true;
+            nFirst = vSegments.size() - nMerge;
+            vMerge.assign(vSegments.begin() + nFirst, vSegments.end());
+            nFile = nNextFile++;
+        }
+
+        int64 nStart = GetTimeMillis();
+        boost::filesystem::path pathSegment = GetLogFilePath(pathDir, nFile, "seg");
+        try {
+            vector<CLogIterator*> vChildren;
+            for (int i = vMerge.size() - 1; i >= 0; i--)
+                vChildren.push_back(new CLogSegmentIterator(vMerge[i]));
+
+            // Erased records are dropped once no older segment is left
+            CLogMergeIterator it(vChildren, nFirst == 0);
+            it.SeekToFirst();
+            if (!CLogSegment::Write(pathSegment, it, nFirst > 0))
+                return false;
+        }
+        catch (std::exception &e) {
+            return error("CLogKVStore::MergeSegments() : %s", e.what());
+        }
+        boost::shared_ptr<CLogSegment> psegment(new CLogSegment(pathSegment, nFile));
+        if (!psegment->Open())
+            return false;
+
+        {
+            LOCK(cs);
+            vector<boost::shared_ptr<CLogSegment> > vSegmentsNew(vSegments.begin(), vSegments.begin() + nFirst);
+            vSegmentsNew.push_back(psegment);
+            vSegmentsNew.insert(vSegmentsNew.end(), vSegments.begin() + nFirst + nMerge, vSegments.end());
+            if (!WriteManifest(nLogFile, vSegmentsNew))
+            {
+                psegment->fObsolete = true;
+                return false;
+            }
+            BOOST_FOREACH(const boost::shared_ptr<CLogSegment>& psegmentOld, vMerge)
+                psegmentOld->fObsolete = true;
+            vSegments = vSegmentsNew;
+        }
+
+        if (fDebug)
+            printf("CLogKVStore::MergeSegments() : merged %u segments into %06u.seg (%"PRI64u" kB) in %"PRI64d"ms\n",
+                   nMerge, nFile, psegment->nFileSize / 1024, GetTimeMillis() - nStart);
+    }
+}
+
+void CLogKVStore::WakeMerge()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMerge);
+        fMergeWanted = true;
+    }
+    condMerge.notify_all();
+}
+
+void CLogKVStore::ThreadMerge()
+{
+    RenameThread("jackpotcoin-kvmerge");
+    while (true)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMerge);
+            while (!fMergeWanted && !fMergeStop)
+                condMerge.wait(lock);
+            if (fMergeStop)
+                break;
+            fMergeWanted = false;
+            fMergeBusy = true;
+        }
+
+        // A failed merge leaves the segments as they were, to be merged
+        // after the next flush
+        try {
+            MergeSegments();
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "CLogKVStore::ThreadMerge()");
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMerge);
+            fMergeBusy = false;
+        }
+        condMerge.notify_all();
+    }
+}
+
+void CLogKVStore::WaitForMerges()
+{
+    boost::unique_lock<boost::mutex> lock(mutexMerge);
+    while ((fMergeWanted || fMergeBusy) && !fMergeStop)
+        condMerge.wait(lock);
+}
+
+void CLogKVStore::GetState(boost::shared_ptr<CLogMemTable>& pmemRet, vector<boost::shared_ptr<CLogSegment> >& vSegmentsRet, uint64& nSequenceRet)
+{
+    LOCK(cs);
+    pmemRet = pmem;
+    vSegmentsRet = vSegments;
+    nSequenceRet = nSequence;
+}
+
+bool CLogKVStore::ReadRaw(const string& strKey, string& strValue)
+{
+    boost::shared_ptr<CLogMemTable> pmemRead;
+    vector<boost::shared_ptr<CLogSegment> > vSegmentsRead;
+    uint64 nSequenceRead;
+    GetState(pmemRead, vSegmentsRead, nSequenceRead);
+
+    // Batches are applied to the memory table under its lock, so reading
+    // the latest version sees a batch either entirely or not at all
+    return LogLookup(*pmemRead, vSegmentsRead, LOG_SEQUENCE_LATEST, strKey, strValue);
+}
+
+CKVReader* CLogKVStore::NewSnapshot()
+{
+    // Registered with the memory table before the next write can begin
+    LOCK(cs);
+    return new CLogSnapshot(pmem, vSegments, nSequence);
+}
+
+CKVIterator* CLogKVStore::NewIterator()
+{
+    CLogSnapshot* psnapshot = (CLogSnapshot*)NewSnapshot();
+    CLogMergeIterator* pit = psnapshot->NewMergeIterator();
+    pit->psnapshot.reset(psnapshot);
+    return pit;
+}
+
+bool CLogKVStore::WriteBatch(const CKVBatch& batch, bool fSync)
+{
+    LOCK(cs);
+    if (!fileLog)
+        return error("CLogKVStore::WriteBatch() : store not open");
+    if (batch.IsEmpty())
+        return true;
+
+    uint64 nBatchSequence = nSequence + 1;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << nBatchSequence;
+    WriteCompactSize(ss, batch.size());
+    for (CKVBatch::MapType::const_iterator mi = batch.begin(); mi != batch.end(); ++mi)
+        ss << CLogRecord(mi->first, mi->second.first, mi->second.second);
+
+    unsigned int nSize = ss.size();
+    unsigned int nChecksum = (unsigned int)Hash(ss.begin(), ss.end()).Get64();
+    bool fOk = (fwrite(&nSize, 1, 4, fileLog) == 4 && fwrite(&nChecksum, 1, 4, fileLog) == 4 &&
+                fwrite(&ss[0], 1, nSize, fileLog) == nSize);
+    if (fOk)
+        fOk = fSync ? FileCommit(fileLog) : (fflush(fileLog) == 0);
+    if (!fOk)
+    {
+        // ReplayLog() stops at a torn batch, which would lose every batch
+        // acknowledged after it. Move the acknowledged ones to a segment
+        // and start a new log, or take no more batches if that fails too.
+        unsigned int nLogFileTorn = nLogFile;
+        FlushMemTable();
+        if (nLogFile == nLogFileTorn && fileLog)
+        {
+            fclose(fileLog);
+            fileLog = NULL;
+        }
+        return error("CLogKVStore::WriteBatch() : writing the log failed");
+    }
+
+    {
+        LOCK(pmem->cs);
+        for (CKVBatch::MapType::const_iterator mi = batch.begin(); mi != batch.end(); ++mi)
+            pmem->Put(nBatchSequence, mi->first, mi->second.first, mi->second.second);
+    }
+    nSequence = nBatchSequence;
+
+    if (pmem->nUsage > nMaxMemTable)
+        return FlushMemTable();
+    return true;
+}
+
+bool CLogKVStore::Flush()
+{
+    LOCK(cs);
+    if (!fileLog)
+        return false;
+    if (pmem->mapRecords.empty())
+        return true;
+    return FlushMemTable();
+}
+
+unsigned int CLogKVStore::GetSegmentCount()
+{
+    LOCK(cs);
+    return vSegments.size();
+}
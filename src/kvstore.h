@@ -0,0 +1,225 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_KVSTORE_H
+#define BITCOIN_KVSTORE_H
+
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "serialize.h"
+#include "sync.h"
+#include "version.h"
+
+// Keys and values are stored in their disk serialization; keys are
+// ordered bytewise, as in a Berkeley DB btree
+template<typename T>
+std::string KVSerialize(const T& obj)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss.reserve(1000);
+    ss << obj;
+    return std::string(ss.begin(), ss.end());
+}
+
+template<typename T>
+bool KVUnserialize(const std::string& str, T& obj)
+{
+    try {
+        CDataStream ss(str.data(), str.data() + str.size(), SER_DISK, CLIENT_VERSION);
+        ss >> obj;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+/** Writes and erases applied together by CKVStore::WriteBatch(). A later
+ * write of the same key replaces an earlier one. */
+class CKVBatch
+{
+public:
+    // key -> (erased, value)
+    typedef std::map<std::string, std::pair<bool, std::string> > MapType;
+
+private:
+    MapType mapWrites;
+
+public:
+    void WriteRaw(const std::string& strKey, const std::string& strValue)
+    {
+        mapWrites[strKey] = std::make_pair(false, strValue);
+    }
+
+    void EraseRaw(const std::string& strKey)
+    {
+        mapWrites[strKey] = std::make_pair(true, std::string());
+    }
+
+    template<typename K, typename T>
+    void Write(const K& key, const T& value)
+    {
+        WriteRaw(KVSerialize(key), KVSerialize(value));
+    }
+
+    template<typename K>
+    void Erase(const K& key)
+    {
+        EraseRaw(KVSerialize(key));
+    }
+
+    // Returns true if the batch holds strKey, written or erased
+    bool Lookup(const std::string& strKey, bool& fErased, std::string& strValue) const
+    {
+        MapType::const_iterator mi = mapWrites.find(strKey);
+        if (mi == mapWrites.end())
+            return false;
+        fErased = mi->second.first;
+        strValue = mi->second.second;
+        return true;
+    }
+
+    bool IsEmpty() const { return mapWrites.empty(); }
+    size_t size() const { return mapWrites.size(); }
+    void Clear() { mapWrites.clear(); }
+    MapType::const_iterator begin() const { return mapWrites.begin(); }
+    MapType::const_iterator end() const { return mapWrites.end(); }
+};
+
+/** Ordered traversal of the records of a store. The iterator reads from
+ * the state of the store at the time it was created. */
+class CKVIterator
+{
+public:
+    virtual ~CKVIterator() {}
+
+    // Position at the first record whose key is not less than strKey
+    virtual void Seek(const std::string& strKey) = 0;
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+    virtual const std::string& GetKey() const = 0;
+    virtual const std::string& GetValue() const = 0;
+
+    void SeekToFirst() { Seek(std::string()); }
+};
+
+/** Read access to a key-value store, or to a snapshot of one */
+class CKVReader
+{
+public:
+    virtual ~CKVReader() {}
+
+    virtual bool ReadRaw(const std::string& strKey, std::string& strValue) = 0;
+
+    // The caller deletes the iterator, before the store
+    virtual CKVIterator* NewIterator() = 0;
+
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        std::string strValue;
+        return ReadRaw(KVSerialize(key), strValue) && KVUnserialize(strValue, value);
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        std::string strValue;
+        return ReadRaw(KVSerialize(key), strValue);
+    }
+};
+
+/** Key-value store holding the block and transaction index.
+ *
+ * Batches are applied atomically; with fSync they are on disk when
+ * WriteBatch() returns. Any number of threads may read while one writes.
+ */
+class CKVStore : public CKVReader
+{
+public:
+    virtual bool WriteBatch(const CKVBatch& batch, bool fSync) = 0;
+
+    // Reads from the state at the time of the call; later writes are not
+    // seen. The caller deletes the snapshot, before the store.
+    virtual CKVReader* NewSnapshot() = 0;
+
+    // Write everything held in memory to the data files
+    virtual bool Flush() { return true; }
+
+    virtual std::string GetName() const = 0;
+};
+
+
+class CLogMemTable;
+class CLogSegment;
+
+/** Log-structured key-value store.
+ *
+ * Batches are appended to a write-ahead log and applied to an in-memory
+ * table. When the table outgrows its budget it is written out as an
+ * immutable sorted segment file and a new log is started. Reads look at
+ * the table, then at the segments from newest to oldest. Segments of
+ * similar size are merged so that their number stays logarithmic in the
+ * size of the store. Merges run on a thread of the store, so a write
+ * never waits for one. The MANIFEST file names the live segments and the
+ * log; it is replaced atomically, so a crash at any point leaves either
+ * the old or the new set of files.
+ */
+class CLogKVStore : public CKVStore
+{
+private:
+    CCriticalSection cs;
+    boost::filesystem::path pathDir;
+    FILE* fileLog;
+    unsigned int nLogFile;
+    unsigned int nNextFile;
+    uint64 nSequence;
+    size_t nMaxMemTable;
+    boost::shared_ptr<CLogMemTable> pmem;
+    std::vector<boost::shared_ptr<CLogSegment> > vSegments;  // oldest first
+
+    // The merge thread, woken when a segment is added
+    boost::thread* pthreadMerge;
+    boost::mutex mutexMerge;
+    boost::condition_variable condMerge;
+    bool fMergeWanted;
+    bool fMergeBusy;
+    bool fMergeStop;
+
+    CLogKVStore(const CLogKVStore&);
+    void operator=(const CLogKVStore&);
+
+    bool WriteManifest(unsigned int nLogFileNew, const std::vector<boost::shared_ptr<CLogSegment> >& vSegmentsNew);
+    bool ReplayLog(unsigned int nFile);
+    bool FlushMemTable();
+    bool MergeSegments();
+    void ThreadMerge();
+    void WakeMerge();
+    void GetState(boost::shared_ptr<CLogMemTable>& pmemRet, std::vector<boost::shared_ptr<CLogSegment> >& vSegmentsRet, uint64& nSequenceRet);
+
+public:
+    CLogKVStore(size_t nMaxMemTableIn = 8 << 20);
+    ~CLogKVStore();
+
+    bool Open(const boost::filesystem::path& pathDirIn);
+    void Close();
+
+    bool ReadRaw(const std::string& strKey, std::string& strValue);
+    CKVIterator* NewIterator();
+    bool WriteBatch(const CKVBatch& batch, bool fSync);
+    CKVReader* NewSnapshot();
+    bool Flush();
+    std::string GetName() const { return "log"; }
+
+    unsigned int GetSegmentCount();
+    void WaitForMerges(); // needed for unit testing
+};
+
+#endif
@@ -0,0 +1,124 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LRUCACHE_H
+#define BITCOIN_LRUCACHE_H
+
+#include <list>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "serialize.h"
+#include "sync.h"
+
+/** Least recently used cache of immutable values, within a memory budget.
+ *
+ * The caller gives the size of each value when it is inserted; the least
+ * recently used values are dropped while the total is over the budget.
+ * Values are shared, so one handed out stays valid after it is dropped,
+ * and copying it happens outside the lock. Thread safe.
+ */
+template<typename K, typename V>
+class CLRUCache
+{
+public:
+    typedef boost::shared_ptr<const V> ValuePtr;
+
+private:
+    struct CEntry
+    {
+        K key;
+        ValuePtr pvalue;
+        size_t nSize;
+    };
+    typedef std::list<CEntry> ListType;  // most recently used first
+
+    // List and hash table node, roughly
+    static const size_t ENTRY_OVERHEAD = sizeof(CEntry) + 2 * sizeof(void*) + sizeof(std::pair<K, void*>) + 2 * sizeof(void*);
+
+    mutable CCriticalSection cs;
+    ListType listEntries;
+    boost::unordered_map<K, typename ListType::iterator> mapEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+    uint64 nHits;
+    uint64 nMisses;
+
+    void Trim()
+    {
+        while (nBytes > nMaxBytes && !listEntries.empty())
+        {
+            CEntry& entry = listEntries.back();
+            nBytes -= entry.nSize + ENTRY_OVERHEAD;
+            mapEntries.erase(entry.key);
+            listEntries.pop_back();
+        }
+    }
+
+public:
+    CLRUCache(size_t nMaxBytesIn = 0) : nBytes(0), nMaxBytes(nMaxBytesIn), nHits(0), nMisses(0)
+    {
+    }
+
+    void SetMaxBytes(size_t nMaxBytesIn)
+    {
+        LOCK(cs);
+        nMaxBytes = nMaxBytesIn;
+        Trim();
+    }
+
+    bool Get(const K& key, ValuePtr& pvalueRet)
+    {
+        LOCK(cs);
+        typename boost::unordered_map<K, typename ListType::iterator>::iterator mi = mapEntries.find(key);
+        if (mi == mapEntries.end())
+        {
+            nMisses++;
+            return false;
+        }
+        nHits++;
+        listEntries.splice(listEntries.begin(), listEntries, mi->second);
+        pvalueRet = mi->second->pvalue;
+        return true;
+    }
+
+    void Insert(const K& key, const ValuePtr& pvalue, size_t nSize)
+    {
+        LOCK(cs);
+        if (nSize + ENTRY_OVERHEAD > nMaxBytes)
+            return;
+        typename boost::unordered_map<K, typename ListType::iterator>::iterator mi = mapEntries.find(key);
+        if (mi != mapEntries.end())
+        {
+            nBytes -= mi->second->nSize + ENTRY_OVERHEAD;
+            listEntries.erase(mi->second);
+            mapEntries.erase(mi);
+        }
+        CEntry entry;
+        entry.key = key;
+        entry.pvalue = pvalue;
+        entry.nSize = nSize;
+        listEntries.push_front(entry);
+        mapEntries[key] = listEntries.begin();
+        nBytes += nSize + ENTRY_OVERHEAD;
+        Trim();
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        listEntries.clear();
+        mapEntries.clear();
+        nBytes = 0;
+    }
+
+    size_t GetCount() const { LOCK(cs); return listEntries.size(); }
+    size_t GetBytes() const { LOCK(cs); return nBytes; }
+    size_t GetMaxBytes() const { LOCK(cs); return nMaxBytes; }
+    uint64 GetHits() const { LOCK(cs); return nHits; }
+    uint64 GetMisses() const { LOCK(cs); return nMisses; }
+};
+
+#endif
@@ -11,6 +11,8 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "kernel.h"
+#include "minerhash.h"
+#include "checkqueue.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -32,7 +34,10 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockIndexMap mapBlockIndex;
+CChain chainActive;
+CLRUCache<pair<unsigned int, unsigned int>, CBlock> cacheBlockRead;
+CLRUCache<pair<unsigned int, unsigned int>, CTransaction> cacheTxRead;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
@@ -50,20 +55,33 @@ int64 nChainStartTime = 1398357357;
 int nCoinbaseMaturity = 50;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainTrust = 0;
-CBigNum bnBestInvalidTrust = 0;
+uint256 nBestChainTrust = 0;
+uint256 nBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
 int64 nReserveBalance = 0;
+int nCheckThreads = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
+// Received blocks are prechecked in batches of up to this many
+static const unsigned int MAX_BLOCK_PRECHECK_BATCH = 64;
+
+// Each pass of the message handler spends about this long on a node's
+// messages before moving on to the next node
+static const int64 MESSAGE_QUANTUM_MICROS = 10000;
+static CCheckQueue<CBlockPrecheck> blockcheckqueue(4);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, uint256> mapProofOfStake;
 
+// Headers-first block download, see RequestBlocks()
+static bool IsBlockDownloadActive();
+
 map<uint256, CDataStream*> mapOrphanTransactions;
 map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
 
@@ -78,6 +96,8 @@ int64 nHPSTimerStart;
 // Settings
 int64 nTransactionFee = MIN_TX_FEE;
 
+// Number of proof-of-work blocks at fixed heights. The reward schedule is
+// anchored to these values, see SetPowCounters().
 static const int NUM_OF_POW_CHECKPOINT = 24;
 static const int checkpointPoWHeight[NUM_OF_POW_CHECKPOINT][2] =
 {
@@ -295,6 +315,66 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 // CTransaction and CTxIndex
 //
 
+// Bytes a transaction holds, not counting malloc overhead
+static size_t GetMemoryUsage(const CTransaction& tx)
+{
+    size_t nUsage = sizeof(CTransaction) + tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+bool CTransaction::ReadFromDisk(CDiskTxPos pos, FILE** pfileRet)
+{
+    if (!pfileRet)
+    {
+        pair<unsigned int, unsigned int> key(pos.nFile, pos.nTxPos);
+        CLRUCache<pair<unsigned int, unsigned int>, CTransaction>::ValuePtr ptx;
+        if (cacheTxRead.Get(key, ptx))
+        {
+            *this = *ptx;
+            return true;
+        }
+
+        try {
+            if (!ReadFromBlockFile(pos.nFile, pos.nTxPos, *this))
+                return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+        }
+        catch (std::exception &e) {
+            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        }
+        ptx.reset(new CTransaction(*this));
+        cacheTxRead.Insert(key, ptx, GetMemoryUsage(*this));
+        return true;
+    }
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+
+    // Read transaction
+    if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+        return error("CTransaction::ReadFromDisk() : fseek failed");
+
+    try {
+        filein >> *this;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Return file pointer
+    if (pfileRet)
+    {
+        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+            return error("CTransaction::ReadFromDisk() : second fseek failed");
+        *pfileRet = filein.release();
+    }
+    return true;
+}
+
 bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet)
 {
     SetNull();
@@ -479,7 +559,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -792,7 +872,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -877,7 +957,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -918,25 +998,61 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
 }
 
 
+bool CBlock::ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions)
+{
+    SetNull();
+
+    // A cached block also serves header-only reads
+    pair<unsigned int, unsigned int> key(nFile, nBlockPos);
+    CLRUCache<pair<unsigned int, unsigned int>, CBlock>::ValuePtr pblock;
+    if (cacheBlockRead.Get(key, pblock))
+    {
+        if (fReadTransactions)
+        {
+            *this = *pblock;
+            return true;
+        }
+        nVersion = pblock->nVersion;
+        hashPrevBlock = pblock->hashPrevBlock;
+        hashMerkleRoot = pblock->hashMerkleRoot;
+        nTime = pblock->nTime;
+        nBits = pblock->nBits;
+        nNonce = pblock->nNonce;
+        nSuperBlock = pblock->nSuperBlock;
+        nRoundMask = pblock->nRoundMask;
+        return true;
+    }
+
+    // Read block
+    try {
+        if (!ReadFromBlockFile(nFile, nBlockPos, *this, fReadTransactions ? SER_DISK : SER_DISK | SER_BLOCKHEADERONLY))
+            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Check the header
+    if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
+        return error("CBlock::ReadFromDisk() : errors in block header");
+
+    if (fReadTransactions)
+    {
+        pblock.reset(new CBlock(*this));
+        size_t nUsage = sizeof(CBlock) + vchBlockSig.capacity() + vtx.capacity() * sizeof(CTransaction);
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            nUsage += GetMemoryUsage(tx) - sizeof(CTransaction);
+        cacheBlockRead.Insert(key, pblock, nUsage);
+    }
+    return true;
+}
+
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 {
     if (!fReadTransactions)
@@ -985,7 +1101,10 @@ int generateMTRandom(unsigned int s, int range)
 //
 
 
-int CountPowDelta(CBlockIndex* pindex, int superBlock)
+// Reference implementation: walk back to the super block and count the
+// proof-of-work blocks on the way. Only used when the requested super block
+// is not the one the counters in pindex were built against.
+static int CountPowDeltaSlow(const CBlockIndex* pindex, int superBlock)
 {
 	int count = 0;
 	int height = pindex->nHeight + 1;
@@ -1017,51 +1136,74 @@ int CountPowDelta(CBlockIndex* pindex, int superBlock)
 }
 
 
-int GetPowHeight(const CBlockIndex* pindex)
+int CountPowDelta(const CBlockIndex* pindex, int superBlock)
 {
-	int count = 0;
-	int height = pindex->nHeight;
-	int maxCheck = height;
-	int index = -1;
-	const CBlockIndex* pindex0 = pindex;
+	if (pindex->nHeight + 1 - superBlock <= 0)
+		return 0;
+
+	if (superBlock == (int)pindex->nSuperBlock)
+		return pindex->nPowSinceSuperBlock;
+
+	return CountPowDeltaSlow(pindex, superBlock);
+}
+
 
-	if (NUM_OF_POW_CHECKPOINT != 0)
+// PoW count recorded at a checkpoint height, or -1 if nHeight is not a checkpoint
+static int GetPowCheckpointCount(int nHeight)
+{
+	for (int i = 0; i < NUM_OF_POW_CHECKPOINT; i++)
 	{
-		for (int i = 1; i <= NUM_OF_POW_CHECKPOINT; i++)
-		{
-			if (height > checkpointPoWHeight[NUM_OF_POW_CHECKPOINT - i][0])
-			{
-				index = NUM_OF_POW_CHECKPOINT - i;
-				break;
-			}
-		}
+		if (checkpointPoWHeight[i][0] == nHeight)
+			return checkpointPoWHeight[i][1];
 	}
+	return -1;
+}
 
-	if (index != -1)
-	{
-		maxCheck = height - checkpointPoWHeight[index][0];
-    }
-    
-    for (int j = 0; j < maxCheck; j++)
-	{
-		if (!pindex->IsProofOfStake())
-			++count;
 
-        pindex = pindex->pprev;
-	}
+//
+// Fill in the cumulative proof-of-work counters of pindex from its pprev.
+// pprev must already have its counters set.
+//
+// nPowHeight reproduces the checkpoint-anchored count used for the PoW reward
+// schedule: the count restarts from checkpointPoWHeight after each checkpoint
+// height, so the values (and therefore the rewards) are identical to those
+// of the original walk-back implementation.
+//
+void SetPowCounters(CBlockIndex* pindex)
+{
+	const CBlockIndex* pprev = pindex->pprev;
+	int nPow = pindex->IsProofOfWork() ? 1 : 0;
 
-	if (index != -1)
+	if (!pprev)
 	{
-		count += checkpointPoWHeight[index][1];
+		// genesis
+		pindex->nPowHeight = 1;
 	}
 	else
 	{
-		++count;
+		int nCheckpointCount = GetPowCheckpointCount(pprev->nHeight);
+		pindex->nPowHeight = (nCheckpointCount != -1 ? nCheckpointCount : pprev->nPowHeight) + nPow;
 	}
 
+	int nSuperBlock = (int)pindex->nSuperBlock;
+	if (nSuperBlock > pindex->nHeight)
+		pindex->nPowSinceSuperBlock = 0;
+	else if (pprev && nSuperBlock == (int)pprev->nSuperBlock && nSuperBlock <= pprev->nHeight)
+		pindex->nPowSinceSuperBlock = pprev->nPowSinceSuperBlock + nPow;
+	else if (nSuperBlock == pindex->nHeight)
+		pindex->nPowSinceSuperBlock = nPow;
+	else
+		pindex->nPowSinceSuperBlock = CountPowDeltaSlow(pindex, nSuperBlock);
+}
+
+
+int GetPowHeight(const CBlockIndex* pindex)
+{
+	int count = pindex->nPowHeight;
+
 	if (fPrintCheckPoint) 
 	{
-	   printf("PoW Checkpoint() :: nHeight = %d, PoW Count = %d\n", height, count);
+	   printf("PoW Checkpoint() :: nHeight = %d, PoW Count = %d\n", pindex->nHeight, count);
 	}
 	
     return count;
@@ -1366,19 +1508,19 @@ bool IsInitialBlockDownload()
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainTrust > bnBestInvalidTrust)
+    if (pindexNew->nChainTrust > nBestInvalidTrust)
     {
-        bnBestInvalidTrust = pindexNew->bnChainTrust;
-        CTxDB().WriteBestInvalidTrust(bnBestInvalidTrust);
+        nBestInvalidTrust = pindexNew->nChainTrust;
+        CTxDB().WriteBestInvalidTrust(CBigNum(nBestInvalidTrust));
         uiInterface.NotifyBlocksChanged();
     }
     
     printf("InvalidChainFound: invalid block=%s  height=%d  trust=%s  date=%s\n",
       pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight,
-      pindexNew->bnChainTrust.ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
+      CBigNum(pindexNew->nChainTrust).ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
       pindexNew->GetBlockTime()).c_str());
     printf("InvalidChainFound:  current best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 }
 
@@ -1547,7 +1689,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 vector<CScriptCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1604,8 +1747,14 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                // Verify signature, or leave it to the caller
+                if (pvChecks)
+                {
+                    CScriptCheck check(txPrev, *this, i, fStrictPayToScriptHash, 0);
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                }
+                else if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
@@ -1659,6 +1808,32 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
 }
 
 
+bool CScriptCheck::operator()() const
+{
+    const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, fStrictPayToScriptHash, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString().substr(0,10).c_str(), nIn);
+    return true;
+}
+
+bool CScriptCheck::FailsOnlyPayToScriptHash() const
+{
+    return fStrictPayToScriptHash && VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, false, nHashType);
+}
+
+void ThreadScriptCheck(void* parg)
+{
+    vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+    RenameThread("jackpotcoin-scriptch");
+    scriptcheckqueue.Thread();
+    vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+}
+
+void ThreadScriptCheckQuit()
+{
+    scriptcheckqueue.Quit();
+}
+
 bool CTransaction::ClientConnectInputs()
 {
     if (IsCoinBase())
@@ -1760,6 +1935,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Signature checks are handed to the script check threads while the
+    // inputs of the following transactions are fetched
+    CCheckQueueControl<CScriptCheck> control(nCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64 nFees = 0;
     int64 nValueIn = 0;
@@ -1812,13 +1991,28 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.IsCoinStake())
                 nFees += nTxValueIn - nTxValueOut;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash, nCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    CScriptCheck checkFailed;
+    if (!control.Wait(&checkFailed))
+    {
+        // As ConnectInputs() does for the scripts it verifies itself
+        const CTransaction* ptxFailed = checkFailed.GetTransaction();
+        if (ptxFailed == NULL)
+            return error("ConnectBlock() : script verification failed");
+        if (checkFailed.FailsOnlyPayToScriptHash())
+            return error("ConnectBlock() : %s P2SH VerifySignature failed", ptxFailed->GetHash().ToString().substr(0,10).c_str());
+        ptxFailed->DoS(100, false);
+        return DoS(100, error("ConnectBlock() : %s VerifySignature failed", ptxFailed->GetHash().ToString().substr(0,10).c_str()));
+    }
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1942,6 +2136,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1974,6 +2169,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1996,6 +2192,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -2012,7 +2209,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Reorganize is costly in terms of db load, as it works in a single db transaction.
         // Try to limit how much needs to be done inside
-        while (pindexIntermediate->pprev && pindexIntermediate->pprev->bnChainTrust > pindexBest->bnChainTrust)
+        while (pindexIntermediate->pprev && pindexIntermediate->pprev->nChainTrust > pindexBest->nChainTrust)
         {
             vpindexSecondary.push_back(pindexIntermediate);
             pindexIntermediate = pindexIntermediate->pprev;
@@ -2059,13 +2256,14 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexNew->bnChainTrust;
+    nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
+    PruneBlockIndexStake();
     nTransactionsUpdated++;
     printf("SetBestChain: new best=%s  height=%d  trust=%s  date=%s\n",
-        hashBestChain.ToString().c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+        hashBestChain.ToString().c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
         DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
     if (fPrintCheckPoint) 
     {
@@ -2186,7 +2384,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2194,18 +2392,25 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     }
 
     // ppcoin: compute chain trust score
-    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+    pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
+
+    // compute proof-of-work counters used by the reward and jackpot calculations
+    SetPowCounters(pindexNew);
 
     // ppcoin: compute stake entropy bit for stake modifier
     if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit(pindexNew->nHeight)))
         return error("AddToBlockIndex() : SetStakeEntropyBit() failed");
 
     // ppcoin: record proof-of-stake hash value
+    CBlockIndexStake stake;
     if (pindexNew->IsProofOfStake())
     {
         if (!mapProofOfStake.count(hash))
             return error("AddToBlockIndex() : hashProofOfStake not found in map");
-        pindexNew->hashProofOfStake = mapProofOfStake[hash];
+        stake.prevoutStake = vtx[1].vin[0].prevout;
+        stake.nStakeTime = vtx[1].nTime;
+        stake.hashProofOfStake = mapProofOfStake[hash];
+        SetBlockIndexStake(pindexNew, stake);
     }
 
     // ppcoin: compute stake modifier
@@ -2214,26 +2419,31 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
         return error("AddToBlockIndex() : ComputeNextStakeModifier() failed");
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+    if (!GetStakeModifierChecksum(pindexNew, pindexNew->nStakeModifierChecksum))
+        return error("AddToBlockIndex() : GetStakeModifierChecksum() failed");
     if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndexMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        setStakeSeen.insert(make_pair(stake.prevoutStake, stake.nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
 
     // Write to disk block index
     CTxDB txdb;
     if (!txdb.TxnBegin())
         return false;
-    txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
+    if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+    {
+        txdb.TxnAbort();
+        return error("AddToBlockIndex() : WriteBlockIndex failed");
+    }
     if (!txdb.TxnCommit())
         return false;
 
     // New best
-    if (pindexNew->bnChainTrust > bnBestChainTrust)
+    if (pindexNew->nChainTrust > nBestChainTrust)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -2309,9 +2519,14 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
     set<uint256> uniqueTx;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
+    if (fPrecheckedMerkleRoot && vMerkleTree.size() >= vtx.size())
+        uniqueTx.insert(vMerkleTree.begin(), vMerkleTree.begin() + vtx.size());
+    else
     {
-        uniqueTx.insert(tx.GetHash());
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+        {
+            uniqueTx.insert(tx.GetHash());
+        }
     }
     if (uniqueTx.size() != vtx.size())
         return DoS(100, error("CheckBlock() : duplicate transaction"));
@@ -2325,16 +2540,103 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
         return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    bool fMerkleRootChecked = fPrecheckedMerkleRoot && !vMerkleTree.empty() && vMerkleTree.back() == hashMerkleRoot;
+    if (fCheckMerkleRoot && !fMerkleRootChecked && hashMerkleRoot != BuildMerkleTree())
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     // ppcoin: check block signature
-    if (!CheckBlockSignature())
+    if (!fPrecheckedSignature && !CheckBlockSignature())
         return DoS(100, error("CheckBlock() : bad block signature"));
 
     return true;
 }
 
+// Do the expensive, context-free work of CheckBlock() without cs_main:
+// hash the header, build the merkle tree and verify the block signature.
+// Failures are not reported here; CheckBlock() repeats whatever did not
+// pass and rejects the block.
+void CBlock::Precheck() const
+{
+    GetHash();
+    if (vtx.empty())
+        return;
+    fPrecheckedMerkleRoot = (BuildMerkleTree() == hashMerkleRoot);
+    fPrecheckedSignature = CheckBlockSignature();
+}
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion       = block.nVersion;
+    header.hashPrevBlock  = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime          = block.nTime;
+    header.nBits          = block.nBits;
+    header.nNonce         = block.nNonce;
+    header.nSuperBlock    = block.nSuperBlock;
+    header.nRoundMask     = block.nRoundMask;
+    header.vchBlockSig    = block.vchBlockSig;
+    nNonce = GetRandHash().Get64();
+
+    // The coinbase and coinstake are new to the peer
+    unsigned int nPrefilled = std::min(block.vtx.size(), (size_t)(block.IsProofOfStake() ? 2 : 1));
+    vPrefilled.assign(block.vtx.begin(), block.vtx.begin() + nPrefilled);
+    uint64 k0, k1;
+    GetShortIdKeys(k0, k1);
+    vShortIds.reserve(block.vtx.size() - nPrefilled);
+    for (unsigned int i = nPrefilled; i < block.vtx.size(); i++)
+        vShortIds.push_back(GetShortId(k0, k1, block.vtx[i].GetHash()));
+}
+
+void CCompactBlock::GetShortIdKeys(uint64& k0, uint64& k1) const
+{
+    uint256 hashHeader = header.GetHash();
+    uint256 hashKeys = Hash(hashHeader.begin(), hashHeader.end(), BEGIN(nNonce), END(nNonce));
+    k0 = hashKeys.Get64(0);
+    k1 = hashKeys.Get64(1);
+}
+
+bool CCompactBlock::FillBlock(CBlock& blockRet, const map<uint256, CTransaction>& mapTx, vector<unsigned int>& vMissingRet) const
+{
+    vMissingRet.clear();
+
+    // Every transaction takes more than 10 bytes of the block
+    unsigned int nTx = vPrefilled.size() + vShortIds.size();
+    if (vPrefilled.empty() || nTx > MAX_BLOCK_SIZE / 10)
+        return error("CCompactBlock::FillBlock() : bad transaction count %u", nTx);
+
+    map<uint64, unsigned int> mapPos;
+    for (unsigned int i = 0; i < vShortIds.size(); i++)
+        if (!mapPos.insert(make_pair(vShortIds[i], vPrefilled.size() + i)).second)
+            return error("CCompactBlock::FillBlock() : duplicate short ID");
+
+    blockRet = header;
+    blockRet.ClearPrecheck();
+    blockRet.vtx.resize(nTx);
+    copy(vPrefilled.begin(), vPrefilled.end(), blockRet.vtx.begin());
+
+    uint64 k0, k1;
+    GetShortIdKeys(k0, k1);
+    vector<unsigned char> vFound(nTx, 0);
+    for (map<uint256, CTransaction>::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    {
+        map<uint64, unsigned int>::const_iterator it = mapPos.find(GetShortId(k0, k1, (*mi).first));
+        if (it == mapPos.end() || vFound[(*it).second] > 1)
+            continue;
+        if (vFound[(*it).second]++ == 0)
+            blockRet.vtx[(*it).second] = (*mi).second;
+    }
+
+    for (unsigned int i = vPrefilled.size(); i < nTx; i++)
+    {
+        if (vFound[i] != 1)
+        {
+            blockRet.vtx[i].SetNull();
+            vMissingRet.push_back(i);
+        }
+    }
+    return true;
+}
+
 
 //
 // TODO : Need to correction of pindexPrev & prevBlock uinsg IsProofOfWork()
@@ -2345,7 +2647,7 @@ bool CBlock::AcceptBlock()
 {
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2456,23 +2758,135 @@ bool CBlock::AcceptBlock()
 }
 
 
-CBigNum CBlockIndex::GetBlockTrust() const
+static CCriticalSection cs_arenaBlockIndex;
+static CArena<CBlockIndex> arenaBlockIndex;
+
+void* CBlockIndex::operator new(size_t nSize)
+{
+    // CDiskBlockIndex and other subclasses are not arena allocated
+    if (nSize != sizeof(CBlockIndex))
+        return ::operator new(nSize);
+    LOCK(cs_arenaBlockIndex);
+    return arenaBlockIndex.Allocate();
+}
+
+void CBlockIndex::operator delete(void* p, size_t nSize)
+{
+    if (nSize != sizeof(CBlockIndex))
+    {
+        ::operator delete(p);
+        return;
+    }
+    LOCK(cs_arenaBlockIndex);
+    arenaBlockIndex.Free(p);
+}
+
+static CCriticalSection cs_mapBlockIndexStake;
+static map<const CBlockIndex*, CBlockIndexStake> mapBlockIndexStake;
+
+bool GetBlockIndexStake(const CBlockIndex* pindex, CBlockIndexStake& stake)
+{
+    if (pindex->IsProofOfWork())
+    {
+        stake.SetNull();
+        return true;
+    }
+    {
+        LOCK(cs_mapBlockIndexStake);
+        map<const CBlockIndex*, CBlockIndexStake>::iterator mi = mapBlockIndexStake.find(pindex);
+        if (mi != mapBlockIndexStake.end())
+        {
+            stake = mi->second;
+            return true;
+        }
+    }
+
+    CDiskBlockIndex diskindex;
+    if (!CTxDB("r").ReadBlockIndex(pindex->GetBlockHash(), diskindex))
+    {
+        stake.SetNull();
+        return error("GetBlockIndexStake() : block index %s not found", pindex->GetBlockHash().ToString().c_str());
+    }
+    stake = diskindex.stake;
+    if (pindex->nHeight >= nBestHeight - STAKE_CACHE_DEPTH)
+        SetBlockIndexStake(pindex, stake);
+    return true;
+}
+
+void SetBlockIndexStake(const CBlockIndex* pindex, const CBlockIndexStake& stake)
+{
+    LOCK(cs_mapBlockIndexStake);
+    mapBlockIndexStake[pindex] = stake;
+}
+
+void PruneBlockIndexStake()
+{
+    LOCK(cs_mapBlockIndexStake);
+    // Only walk the cache once it has grown past what the recent blocks
+    // alone would take
+    if (mapBlockIndexStake.size() <= (size_t)STAKE_CACHE_DEPTH)
+        return;
+    map<const CBlockIndex*, CBlockIndexStake>::iterator mi = mapBlockIndexStake.begin();
+    while (mi != mapBlockIndexStake.end())
+    {
+        if (mi->first->nHeight < nBestHeight - STAKE_CACHE_DEPTH)
+            mapBlockIndexStake.erase(mi++);
+        else
+            ++mi;
+    }
+}
+
+size_t GetBlockIndexStakeCacheSize()
+{
+    LOCK(cs_mapBlockIndexStake);
+    return mapBlockIndexStake.size();
+}
+
+size_t GetBlockIndexMemoryUsage()
+{
+    size_t nUsage = 0;
+    {
+        LOCK(cs_arenaBlockIndex);
+        nUsage += mapBlockIndex.GetMemoryUsage() + arenaBlockIndex.GetMemoryUsage();
+    }
+    {
+        // A std::map node also has three pointers and a colour, and a
+        // malloc header
+        LOCK(cs_mapBlockIndexStake);
+        nUsage += mapBlockIndexStake.size() * (sizeof(pair<const CBlockIndex*, CBlockIndexStake>) + 4 * sizeof(void*) + 16);
+    }
+    return nUsage;
+}
+
+void InitBlockReadCache()
+{
+    // -maxblockcachesize is in megabytes; blocks get three quarters of it
+    int64 nMaxCacheSize = std::max((int64)0, std::min(GetArg("-maxblockcachesize", 32), (int64)16384));
+    size_t nBytes = (size_t)std::min(nMaxCacheSize << 20, (int64)(std::numeric_limits<size_t>::max() >> 1));
+    cacheBlockRead.SetMaxBytes(nBytes / 4 * 3);
+    cacheTxRead.SetMaxBytes(nBytes / 4);
+    printf("Using %"PRIszu" MiB for the block read cache\n", nBytes >> 20);
+}
+
+uint256 CBlockIndex::GetBlockTrust() const
 {
     CBigNum bnTarget;
     bnTarget.SetCompact(nBits);
     if (bnTarget <= 0)
         return 0;
 
+    // The quotients are below 2^256 as the divisor is at least 2
     if (IsProofOfStake())
     {
         // Return trust score as usual
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        CBigNum bnTrust = (CBigNum(1)<<256) / (bnTarget+1);
+        return bnTrust.getuint256();
     }
     else
     {
         // Calculate work amount for block
         CBigNum bnPoWTrust = (bnProofOfWorkLimit / (bnTarget+1));
-        return bnPoWTrust > 1 ? bnPoWTrust : 1;
+        return bnPoWTrust > 1 ? bnPoWTrust.getuint256() : 1;
     }
 }
 
@@ -2565,8 +2979,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless blocks are
+        // being fetched along the header chain
+        if (pfrom && !IsBlockDownloadActive())
         {
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
             // ppcoin: getblocks may not obtain the ancestor block rejected
@@ -2613,6 +3028,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 // ppcoin: sign block
 bool CBlock::SignBlock(const CKeyStore& keystore)
 {
+    ClearPrecheck();
+
     vector<valtype> vSolutions;
     txnouttype whichType;
 
@@ -2742,13 +3159,6 @@ bool CheckDiskSpace(uint64 nAdditionalBytes)
 }
 
 
-static filesystem::path BlockFilePath(unsigned int nFile)
-{
-    string strBlockFn = strprintf("blk%04u.dat", nFile);
-    return GetDataDir() / strBlockFn;
-}
-
-
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == (unsigned int) -1))
@@ -2768,30 +3178,6 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 }
 
 
-static unsigned int nCurrentBlockFile = 1;
-
-FILE* AppendBlockFile(unsigned int& nFileRet)
-{
-    nFileRet = 0;
-    while (true)
-    {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
-        {
-            nFileRet = nCurrentBlockFile;
-            return file;
-        }
-        fclose(file);
-        nCurrentBlockFile++;
-    }
-}
-
-
 bool LoadBlockIndex(bool fAllowNew)
 {
     if (fTestNet)
@@ -2897,7 +3283,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3121,47 +3507,662 @@ string GetWarnings(string strFor)
 //
 
 
-bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+//
+// Headers-first block download
+//
+// While the chain is far behind, the headers of the blocks we are missing
+// are fetched first, from one peer at a time, with getheaders. The blocks
+// along that header chain are then asked for from every suitable peer at
+// once, within a window ahead of our best chain. A block that arrives before
+// its parent waits here and is processed in chain order: a proof-of-stake
+// block cannot be checked before the block holding its stake is connected.
+// All of this is guarded by cs_main.
+//
+
+// A headers message holds at most this many headers
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+// Blocks are only asked for this far ahead of the first missing block
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+// Blocks that have arrived ahead of their parents are held up to this size
+static const unsigned int MAX_BLOCKS_DOWNLOADED_SIZE = 64 << 20;
+// A peer that has not sent a block or headers it was asked for in this many
+// seconds is stalling, as is one that holds up a full window this long
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60;
+static const int64 BLOCK_STALLING_TIMEOUT = 5;
+
+// Peers that were asked for a block of the header chain and did not send it
+// are not asked again; once enough of them have failed, or no one else is
+// left to ask, the block is taken not to exist
+static const unsigned int MAX_BLOCK_DOWNLOAD_TRIES = 4;
+
+class CBlockRequest
 {
-    switch (inv.type)
-    {
-      case MSG_TX:
-      {
-           bool txInMap = false;
-           {
-              LOCK(mempool.cs);
-              txInMap = (mempool.exists(inv.hash));
-           }
-           return (txInMap || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash));
-      }
-      case MSG_BLOCK:
-        return (mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash));
-    }
-    // Don't know what it is, just say we already got one
-    return true;
+public:
+    // Only compared, unless the request is young: a disconnected node is
+    // kept for 15 minutes before it is deleted
+    CNode* pnode;
+    int64 nTime;
+};
+
+class CBlockRetry
+{
+public:
+    std::map<CNode*, int64> mapTried;  // when each gave up, as CBlockRequest
+    int64 nTime;                       // when the last one did
+};
+
+deque<uint256> vHeaderChain;                // missing blocks, in chain order
+static CBlockIndex* pindexHeaderBase = NULL;  // the block before vHeaderChain
+static map<uint256, CBlockRequest> mapBlocksInFlight;
+static map<CNode*, int> mapBlocksInFlightByNode;
+static map<uint256, CBlockRetry> mapBlockRetries;
+map<uint256, CBlock*> mapBlocksDownloaded;
+unsigned int nBlocksDownloadedSize = 0;
+static map<int, CService> mapHeaderSources;  // who sent the headers, by first height
+CNode* pnodeHeaderSync = NULL;              // compared only, as CBlockRequest::pnode
+static int64 nHeaderSyncTime = 0;
+
+static bool IsBlockDownloadActive()
+{
+    return !vHeaderChain.empty() || pnodeHeaderSync != NULL;
+}
+
+// Whether a chain this far behind should be caught up headers first. Unlike
+// IsInitialBlockDownload(), this stays true while no blocks are arriving.
+static bool WantHeadersFirst()
+{
+    return pindexBest == NULL || pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60;
 }
 
+static int GetHeaderChainHeight()
+{
+    return vHeaderChain.empty() ? nBestHeight : pindexHeaderBase->nHeight + (int)vHeaderChain.size();
+}
 
+static bool IsBlockDownloadPeer(CNode* pnode)
+{
+    return pnode->fSuccessfullyConnected && !pnode->fDisconnect && !pnode->fClient && !pnode->fOneShot &&
+        (pnode->nVersion < NOBLKS_VERSION_START || pnode->nVersion >= NOBLKS_VERSION_END);
+}
 
+static void CancelBlockRequest(map<uint256, CBlockRequest>::iterator mi)
+{
+    if (--mapBlocksInFlightByNode[(*mi).second.pnode] <= 0)
+        mapBlocksInFlightByNode.erase((*mi).second.pnode);
+    mapBlocksInFlight.erase(mi);
+}
 
-// The message start string is designed to be unlikely to occur in normal data.
-// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
-// a large 4-byte int at any alignment.
-unsigned char pchMessageStart[4] = { 0xc0, 0xdb, 0xfa, 0xfc };
+static void EraseDownloadedBlock(const uint256& hash)
+{
+    map<uint256, CBlock*>::iterator mi = mapBlocksDownloaded.find(hash);
+    if (mi == mapBlocksDownloaded.end())
+        return;
+    nBlocksDownloadedSize -= ::GetSerializeSize(*(*mi).second, SER_NETWORK, PROTOCOL_VERSION);
+    delete (*mi).second;
+    mapBlocksDownloaded.erase(mi);
+}
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+// Drop the header chain from position nKeep on, with whatever was asked for
+// or downloaded along it
+void TruncateHeaderChain(unsigned int nKeep)
 {
-    static map<CService, CPubKey> mapReuseKey;
-    RandAddSeedPerfmon();
-    if (fDebug)
+    for (unsigned int i = nKeep; i < vHeaderChain.size(); i++)
+    {
+        const uint256& hash = vHeaderChain[i];
+        map<uint256, CBlockRequest>::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end())
+            CancelBlockRequest(mi);
+        EraseDownloadedBlock(hash);
+        mapBlockRetries.erase(hash);
+    }
+    if (nKeep == 0)
+    {
+        // Whatever is left belonged to blocks that came by other ways
+        while (!mapBlocksDownloaded.empty())
+            EraseDownloadedBlock(mapBlocksDownloaded.begin()->first);
+        mapBlockRetries.clear();
+        mapHeaderSources.clear();
+    }
+    else if (nKeep < vHeaderChain.size())
+        mapHeaderSources.erase(mapHeaderSources.upper_bound(pindexHeaderBase->nHeight + (int)nKeep), mapHeaderSources.end());
+    vHeaderChain.resize(nKeep);
+}
+
+// The peer that sent the header at nHeight, if it is still connected, did
+// so for a block that does not exist or is not valid
+static void PenalizeHeaderSource(int nHeight, int howmuch)
+{
+    map<int, CService>::iterator mi = mapHeaderSources.upper_bound(nHeight);
+    if (mi == mapHeaderSources.begin())
+        return;
+    --mi;
+    printf("header chain from %s is no good at height %d\n", (*mi).second.ToString().c_str(), nHeight);
+    CNode* pnode = FindNode((*mi).second);
+    if (pnode && howmuch > 0)
+        pnode->Misbehaving(howmuch);
+}
+
+static void PushGetHeaders(CNode* pnode)
+{
+    // Locator of the end of the header chain, then of the blocks before it,
+    // in exponentially larger steps back as CBlockLocator::Set() does
+    vector<uint256> vHave;
+    int nStep = 1;
+    int i = (int)vHeaderChain.size() - 1;
+    while (i >= 0)
+    {
+        vHave.push_back(vHeaderChain[i]);
+        if (vHave.size() > 10)
+            nStep *= 2;
+        i -= nStep;
+    }
+    CBlockIndex* pindex = vHeaderChain.empty() ? pindexBest : pindexHeaderBase;
+    for (; pindex && i < -1; i++)
+        pindex = pindex->pprev;
+    while (pindex)
     {
-        printf("received: %s (%"PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
+        vHave.push_back(pindex->GetBlockHash());
+        if (vHave.size() > 10)
+            nStep *= 2;
+        for (int j = 0; pindex && j < nStep; j++)
+            pindex = pindex->pprev;
     }
-    
-    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
-    {
-        printf("dropmessagestest DROPPING RECV MESSAGE\n");
-        return true;
+    vHave.push_back(!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet);
+
+    pnodeHeaderSync = pnode;
+    nHeaderSyncTime = GetTime();
+    pnode->fHeadersAsked = true;
+    pnode->PushMessage("getheaders", CBlockLocator(vHave), uint256(0));
+}
+
+void ProcessHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    // Only headers that were asked for are taken, so one peer at a time
+    // decides which blocks the others are asked for
+    if (pfrom != pnodeHeaderSync)
+    {
+        if (fDebugNet)
+            printf("ProcessHeaders() : ignoring headers from %s, not asked for\n", pfrom->addr.ToString().c_str());
+        return;
+    }
+    pnodeHeaderSync = NULL;
+    if (vHeaders.empty())
+        return;
+
+    // Where the headers join the header chain or the blocks we have
+    int nHeight;
+    unsigned int nKeep;
+    CBlockIndex* pindexBase = pindexHeaderBase;
+    const uint256& hashFirstPrev = vHeaders[0].hashPrevBlock;
+    int i = (int)vHeaderChain.size() - 1;
+    while (i >= 0 && vHeaderChain[i] != hashFirstPrev)
+        i--;
+    if (i >= 0)
+    {
+        nHeight = pindexHeaderBase->nHeight + i + 2;
+        nKeep = i + 1;
+    }
+    else
+    {
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashFirstPrev);
+        if (mi == mapBlockIndex.end())
+        {
+            printf("ProcessHeaders() : headers from %s do not connect\n", pfrom->addr.ToString().c_str());
+            return;
+        }
+        pindexBase = (*mi).second;
+        nHeight = pindexBase->nHeight + 1;
+        nKeep = 0;
+    }
+
+    CBigNum bnTargetLimit = max(bnProofOfWorkLimit, bnProofOfStakeLimit);
+    vector<uint256> vHashes;
+    vHashes.reserve(vHeaders.size());
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        if (!header.vtx.empty() || header.hashPrevBlock != (vHashes.empty() ? hashFirstPrev : vHashes.back()))
+        {
+            pfrom->Misbehaving(20);
+            printf("ProcessHeaders() : bad headers from %s\n", pfrom->addr.ToString().c_str());
+            return;
+        }
+
+        // Whether the block is proof-of-work, and its hash has to meet the
+        // target, only shows in its transactions. The target has to be in
+        // range either way, as CheckProofOfWork() checks.
+        CBigNum bnTarget;
+        bnTarget.SetCompact(header.nBits);
+        if (bnTarget <= 0 || bnTarget > bnTargetLimit)
+        {
+            pfrom->Misbehaving(50);
+            printf("ProcessHeaders() : headers from %s have a target out of range\n", pfrom->addr.ToString().c_str());
+            return;
+        }
+        if (!Checkpoints::CheckHardened(nHeight + vHashes.size(), hash))
+        {
+            pfrom->Misbehaving(100);
+            printf("ProcessHeaders() : headers from %s are against a checkpoint\n", pfrom->addr.ToString().c_str());
+            return;
+        }
+        if (header.GetBlockTime() > GetAdjustedTime() + nMaxClockDrift)
+            break;
+        vHashes.push_back(hash);
+    }
+    if (vHashes.empty())
+        return;
+
+    // A header chain that branches off only replaces one that it outgrows
+    int nTip = nHeight + vHashes.size() - 1;
+    if (nKeep < vHeaderChain.size() && nTip <= GetHeaderChainHeight())
+        return;
+    TruncateHeaderChain(nKeep);
+    pindexHeaderBase = pindexBase;
+    vHeaderChain.insert(vHeaderChain.end(), vHashes.begin(), vHashes.end());
+    mapHeaderSources[nHeight] = pfrom->addr;
+
+    printf("ProcessHeaders() : %"PRIszu" headers from %s, header chain to height %d\n", vHeaders.size(), pfrom->addr.ToString().c_str(), nTip);
+
+    // A full message means they have more
+    if (vHeaders.size() >= MAX_HEADERS_RESULTS && vHashes.size() == vHeaders.size())
+        PushGetHeaders(pfrom);
+}
+
+void ProcessDownloadedBlocks()
+{
+    while (!vHeaderChain.empty())
+    {
+        uint256 hash = vHeaderChain.front();
+        CBlockIndexMap::iterator miIndex = mapBlockIndex.find(hash);
+        if (miIndex != mapBlockIndex.end())
+        {
+            // Those that were asked for it earlier and did not send it
+            // were stalling
+            map<uint256, CBlockRetry>::iterator miRetry = mapBlockRetries.find(hash);
+            if (miRetry != mapBlockRetries.end())
+            {
+                int64 nNow = GetTime();
+                for (map<CNode*, int64>::iterator it = (*miRetry).second.mapTried.begin(); it != (*miRetry).second.mapTried.end(); ++it)
+                {
+                    if (nNow - (*it).second < 10 * 60 && !(*it).first->fDisconnect)
+                    {
+                        printf("block download stalled by %s\n", (*it).first->addr.ToString().c_str());
+                        (*it).first->fDisconnect = true;
+                    }
+                }
+                mapBlockRetries.erase(miRetry);
+            }
+            EraseDownloadedBlock(hash);
+            vHeaderChain.pop_front();
+            pindexHeaderBase = (*miIndex).second;
+            while (mapHeaderSources.size() >= 2 && (++mapHeaderSources.begin())->first <= pindexHeaderBase->nHeight + 1)
+                mapHeaderSources.erase(mapHeaderSources.begin());
+            continue;
+        }
+        map<uint256, CBlock*>::iterator mi = mapBlocksDownloaded.find(hash);
+        if (mi == mapBlocksDownloaded.end() || !mapBlockIndex.count((*mi).second->hashPrevBlock))
+            break;
+        CBlock* pblock = (*mi).second;
+        mapBlocksDownloaded.erase(mi);
+        nBlocksDownloadedSize -= ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+        bool fAccepted = ProcessBlock(NULL, pblock);
+        int nDoS = pblock->nDoS;
+        delete pblock;
+        if (!fAccepted)
+        {
+            // The header chain is no good past here. Whoever sent the block
+            // is not known any more, but it is the block the headers named.
+            PenalizeHeaderSource(pindexHeaderBase->nHeight + 1, nDoS);
+            TruncateHeaderChain(0);
+            break;
+        }
+    }
+
+    if (vHeaderChain.empty())
+        TruncateHeaderChain(0);
+}
+
+// Returns true if the block was asked for by headers-first download and is
+// kept until its parent has been processed
+static bool BlockDownloadReceived(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    map<uint256, CBlockRequest>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return false;
+    CancelBlockRequest(mi);
+
+    // ProcessBlock() deals with blocks that are not needed or not valid
+    if (mapBlockIndex.count(block.hashPrevBlock) || mapBlockIndex.count(hash) || mapBlocksDownloaded.count(hash) || !block.CheckBlock())
+        return false;
+    mapBlocksDownloaded[hash] = new CBlock(block);
+    nBlocksDownloadedSize += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    return true;
+}
+
+// Another peer is asked for a block next time, rather than the one that
+// did not send it: the block may not exist at all
+static void RetryBlockRequest(map<uint256, CBlockRequest>::iterator mi, int64 nNow)
+{
+    CBlockRetry& retry = mapBlockRetries[(*mi).first];
+    retry.mapTried[(*mi).second.pnode] = nNow;
+    retry.nTime = nNow;
+    CancelBlockRequest(mi);
+}
+
+// A block of the window that enough peers were asked for in turn, or that
+// no one else took up, is taken not to exist. The header chain is dropped
+// from there, and the blame is with the peer that sent the headers.
+static void CheckBlockRetries(int64 nNow)
+{
+    unsigned int nWindow = min((unsigned int)vHeaderChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = 0; i < nWindow && !mapBlockRetries.empty(); i++)
+    {
+        const uint256& hash = vHeaderChain[i];
+        map<uint256, CBlockRetry>::iterator mi = mapBlockRetries.find(hash);
+        if (mi == mapBlockRetries.end() || mapBlocksDownloaded.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        const CBlockRetry& retry = (*mi).second;
+        if (retry.mapTried.size() < MAX_BLOCK_DOWNLOAD_TRIES &&
+            (mapBlocksInFlight.count(hash) || nNow - retry.nTime < BLOCK_DOWNLOAD_TIMEOUT))
+            continue;
+        printf("block %s of the header chain not sent by %"PRIszu" peers\n", hash.ToString().substr(0,20).c_str(), retry.mapTried.size());
+        PenalizeHeaderSource(pindexHeaderBase->nHeight + 1 + i, 50);
+        TruncateHeaderChain(i);
+        break;
+    }
+}
+
+void RequestBlocks(CNode* pto)
+{
+    int64 nNow = GetTime();
+
+    // Give the requests of stalling and disconnected peers to others, once
+    // a second
+    static int64 nLastCheck;
+    if (nNow != nLastCheck)
+    {
+        nLastCheck = nNow;
+        map<uint256, CBlockRequest>::iterator mi = mapBlocksInFlight.begin();
+        while (mi != mapBlocksInFlight.end())
+        {
+            map<uint256, CBlockRequest>::iterator miRequest = mi++;
+            const CBlockRequest& request = (*miRequest).second;
+            if (nNow - request.nTime < 10 * 60 && !request.pnode->fDisconnect)
+            {
+                if (nNow - request.nTime < BLOCK_DOWNLOAD_TIMEOUT)
+                    continue;
+                printf("block download timed out at %s\n", request.pnode->addr.ToString().c_str());
+                RetryBlockRequest(miRequest, nNow);
+                continue;
+            }
+            CancelBlockRequest(miRequest);
+        }
+        CheckBlockRetries(nNow);
+        if (pnodeHeaderSync && nNow - nHeaderSyncTime >= BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            printf("header download stalled\n");
+            pnodeHeaderSync = NULL;
+        }
+    }
+
+    if (!IsBlockDownloadPeer(pto))
+        return;
+
+    // Headers first, from one peer at a time
+    if (!pnodeHeaderSync && !pto->fHeadersAsked &&
+        pto->nStartingHeight > max(nBestHeight, GetHeaderChainHeight()) &&
+        (WantHeadersFirst() || !vHeaderChain.empty()))
+        PushGetHeaders(pto);
+
+    int nFree = MAX_BLOCKS_IN_FLIGHT_PER_PEER;
+    map<CNode*, int>::iterator miNode = mapBlocksInFlightByNode.find(pto);
+    if (miNode != mapBlocksInFlightByNode.end())
+        nFree -= (*miNode).second;
+    if (nFree <= 0 || vHeaderChain.empty() || nBlocksDownloadedSize >= MAX_BLOCKS_DOWNLOADED_SIZE)
+        return;
+
+    vector<CInv> vGetData;
+    unsigned int nWindow = min((unsigned int)vHeaderChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    unsigned int i = 0;
+    for (; i < nWindow && (int)vGetData.size() < nFree; i++)
+    {
+        const uint256& hash = vHeaderChain[i];
+        if (pindexHeaderBase->nHeight + 1 + (int)i > pto->nStartingHeight)
+            break;
+        if (mapBlocksInFlight.count(hash) || mapBlocksDownloaded.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        map<uint256, CBlockRetry>::iterator miRetry = mapBlockRetries.find(hash);
+        if (miRetry != mapBlockRetries.end() && (*miRetry).second.mapTried.count(pto))
+            continue;
+        CBlockRequest& request = mapBlocksInFlight[hash];
+        request.pnode = pto;
+        request.nTime = nNow;
+        mapBlocksInFlightByNode[pto]++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+    if (!vGetData.empty())
+    {
+        if (fDebugNet)
+            printf("requesting %"PRIszu" blocks from %s\n", vGetData.size(), pto->addr.ToString().c_str());
+        pto->PushMessage("getdata", vGetData);
+        return;
+    }
+
+    // Nothing left to ask for in the window. If its first block is held up
+    // by another peer, that peer is stalling everyone, and it is asked of
+    // this one instead.
+    if (i == nWindow)
+    {
+        const uint256& hashFirst = vHeaderChain.front();
+        map<uint256, CBlockRequest>::iterator miFirst = mapBlocksInFlight.find(hashFirst);
+        map<uint256, CBlockRetry>::iterator miRetry = mapBlockRetries.find(hashFirst);
+        if (miFirst != mapBlocksInFlight.end() && (*miFirst).second.pnode != pto && nNow - (*miFirst).second.nTime >= BLOCK_STALLING_TIMEOUT &&
+            (miRetry == mapBlockRetries.end() || !(*miRetry).second.mapTried.count(pto)))
+        {
+            printf("block download window stalled by %s\n", (*miFirst).second.pnode->addr.ToString().c_str());
+            RetryBlockRequest(miFirst, nNow);
+        }
+    }
+}
+
+
+bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+{
+    switch (inv.type)
+    {
+      case MSG_TX:
+      {
+           bool txInMap = false;
+           {
+              LOCK(mempool.cs);
+              txInMap = (mempool.exists(inv.hash));
+           }
+           return (txInMap || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash));
+      }
+      case MSG_BLOCK:
+        return (mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash) || mapBlocksDownloaded.count(inv.hash));
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+
+
+
+// The message start string is designed to be unlikely to occur in normal data.
+// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
+// a large 4-byte int at any alignment.
+unsigned char pchMessageStart[4] = { 0xc0, 0xdb, 0xfa, 0xfc };
+
+void static ProcessBlockMessage(CNode* pfrom, CBlock& block)
+{
+    if (fDebug) 
+    {
+        printf("received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
+        if (fDebugHigh) 
+        {
+           block.print();
+        }
+    }
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    if (BlockDownloadReceived(block))
+    {
+        mapAlreadyAskedFor.erase(inv);
+        return;
+    }
+    if (ProcessBlock(pfrom, &block))
+    {
+        mapAlreadyAskedFor.erase(inv);
+    }
+    if (block.nDoS)
+    { 
+        pfrom->Misbehaving(block.nDoS);
+    }
+    ProcessDownloadedBlocks();
+}
+
+// A block is stored on disk exactly as it is serialized for the network, so
+// it can be sent as it lies in the block file, without being parsed and
+// serialized again. Returns false, having sent nothing, if the block cannot
+// be had from a block file mapping.
+static bool PushBlockFromDisk(CNode* pfrom, const CBlockIndex* pindex)
+{
+    // The block is preceded by the message start and its size
+    unsigned int nBlockPos = pindex->nBlockPos;
+    unsigned int nSize = 0;
+    if (nBlockPos < sizeof(nSize))
+        return false;
+    boost::shared_ptr<CBlockFileMapping> pmap = GetBlockFileMapping(pindex->nFile, nBlockPos);
+    if (!pmap || pmap->size() < nBlockPos)
+        return false;
+    memcpy(&nSize, pmap->begin() + nBlockPos - sizeof(nSize), sizeof(nSize));
+    if (nSize > MAX_BLOCK_SIZE)
+        return false;
+    if (pmap->size() - nBlockPos < nSize)
+    {
+        pmap = GetBlockFileMapping(pindex->nFile, (size_t)nBlockPos + nSize);
+        if (!pmap || pmap->size() < nBlockPos || pmap->size() - nBlockPos < nSize)
+            return false;
+    }
+
+    // Make sure these are the bytes of the block that was asked for
+    CBlock header;
+    try {
+        CBlockFileReader reader(SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+        if (!reader.Open(pmap, nBlockPos))
+            return false;
+        reader >> header;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    if (header.GetHash() != pindex->GetBlockHash() || ::GetSerializeSize(header, SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION) >= nSize)
+        return error("PushBlockFromDisk() : block %s does not match its index", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+
+    // Queued straight from the mapping, which stays mapped until it is sent
+    const char* pbegin = pmap->begin() + nBlockPos;
+    pfrom->PushMessageRaw("block", CSendBuffer(pmap, pbegin, pbegin + nSize));
+    return true;
+}
+
+//
+// Compact blocks
+//
+
+// Blocks rebuilt from a compact block are held this long, at most this
+// many at a time, while the transactions that were not in the memory pool
+// are asked for. Then the block is asked of another peer in full.
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+static const int64 PARTIAL_BLOCK_TIMEOUT = 60;
+
+// Transactions of a block are only served this far below the best chain
+// tip, where a compact block of it may still be on its way
+static const int MAX_BLOCKTXN_DEPTH = 10;
+
+class CPartialBlock
+{
+public:
+    CBlock block;
+    std::vector<unsigned int> vMissing;
+    CNode* pnode;  // compared only, as CBlockRequest::pnode
+    int64 nTime;
+};
+
+static map<uint256, CPartialBlock> mapPartialBlocks;
+
+// Whether compact blocks are asked of this peer. While catching up, blocks
+// have few transactions in the memory pool, so they are sent in full.
+static bool WantCompactBlocks(CNode* pnode)
+{
+    return pnode->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload() && !IsBlockDownloadActive();
+}
+
+static void AskForFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// A short ID matching some other transaction is only noticed by the merkle
+// root, and then the block is asked for in full: the peer did nothing wrong
+static void ProcessRebuiltBlock(CNode* pfrom, CBlock& block)
+{
+    block.Precheck();
+    if (!block.fPrecheckedMerkleRoot)
+    {
+        printf("compact block %s rebuilt with wrong transactions\n", block.GetHash().ToString().substr(0,20).c_str());
+        AskForFullBlock(pfrom, block.GetHash());
+        return;
+    }
+    ProcessBlockMessage(pfrom, block);
+}
+
+// Whether the transactions of a partial block are not coming: they are
+// overdue, or the peer they were asked of is gone
+static bool IsPartialBlockStale(const CPartialBlock& partial, int64 nNow)
+{
+    if (nNow - partial.nTime > PARTIAL_BLOCK_TIMEOUT)
+        return true;
+    LOCK(cs_vNodes);
+    return find(vNodes.begin(), vNodes.end(), partial.pnode) == vNodes.end() || partial.pnode->fDisconnect;
+}
+
+// Ask pto in full for the blocks whose transactions are not coming
+void RequestStalePartialBlocks(CNode* pto)
+{
+    if (mapPartialBlocks.empty() || !IsBlockDownloadPeer(pto))
+        return;
+    int64 nNow = GetTime();
+    map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin();
+    while (mi != mapPartialBlocks.end())
+    {
+        if ((*mi).second.pnode == pto || !IsPartialBlockStale((*mi).second, nNow))
+        {
+            ++mi;
+            continue;
+        }
+        printf("compact block %s not completed, asking %s for it\n", (*mi).first.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+        AskForFullBlock(pto, (*mi).first);
+        mapPartialBlocks.erase(mi++);
+    }
+}
+
+bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+{
+    static map<CService, CPubKey> mapReuseKey;
+    RandAddSeedPerfmon();
+    if (fDebug)
+    {
+        printf("received: %s (%"PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
+    }
+    
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+    {
+        printf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
     }
 
     if (strCommand == "version")
@@ -3234,7 +4235,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // Change version
         pfrom->PushMessage("verack");
-        pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->nSendVersion = min(pfrom->nVersion, PROTOCOL_VERSION);
 
         if (!pfrom->fInbound)
         {
@@ -3263,9 +4264,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
 
-        // Ask the first connected node for block updates
+        // Ask the first connected node for block updates. A chain far
+        // behind is caught up headers first instead, see RequestBlocks().
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && 
+        if (!WantHeadersFirst() &&
+            !pfrom->fClient && 
             !pfrom->fOneShot &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
             (pfrom->nVersion < NOBLKS_VERSION_START || pfrom->nVersion >= NOBLKS_VERSION_END) &&
@@ -3315,7 +4318,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->nRecvVersion = min(pfrom->nVersion, PROTOCOL_VERSION);
     }
 
 
@@ -3443,6 +4446,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             {
                 pfrom->AskFor(inv);
             } 
+            else if (IsBlockDownloadActive())
+            {
+                // Blocks are being fetched along the header chain
+            }
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) 
             {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
@@ -3488,15 +4495,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             {
                 printf("received getdata for: %s\n", inv.ToString().c_str());
             }
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_COMPACT_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                CBlockIndexMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    if (inv.type == MSG_COMPACT_BLOCK)
+                    {
+                        CBlock block;
+                        if (block.ReadFromDisk((*mi).second))
+                            pfrom->PushMessage("cmpctblock", CCompactBlock(block));
+                        else
+                            error("getdata : cannot read block %s", inv.hash.ToString().substr(0,20).c_str());
+                    }
+                    else if (!PushBlockFromDisk(pfrom, (*mi).second))
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3517,9 +4535,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSendBuffer>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessageShared((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3608,7 +4626,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
             {
                 return true;
@@ -3626,7 +4644,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3639,6 +4657,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->PushMessage("headers", vHeaders);
     }
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+        ProcessHeaders(pfrom, vHeaders);
+    }
+
 
     else if (strCommand == "tx")
     {
@@ -3718,24 +4748,140 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         CBlock block;
         vRecv >> block;
-        if (fDebug) 
+        ProcessBlockMessage(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hash = cmpctblock.header.GetHash();
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            return true;
+
+        // A partial block that is not getting its transactions gives way
+        // to the compact block of another peer
+        map<uint256, CPartialBlock>::iterator miPartial = mapPartialBlocks.find(hash);
+        if (miPartial != mapPartialBlocks.end())
         {
-            printf("received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
-            if (fDebugHigh) 
+            if ((*miPartial).second.pnode == pfrom || !IsPartialBlockStale((*miPartial).second, GetTime()))
+                return true;
+            mapPartialBlocks.erase(miPartial);
+        }
+
+        // Compact blocks are only sent when asked for. The memory pool is
+        // not matched against one before its header is checked, as far as
+        // it can be without its transactions.
+        if (!mapAlreadyAskedFor.count(CInv(MSG_BLOCK, hash)))
+        {
+            if (fDebugNet)
+                printf("cmpctblock : ignoring %s from %s, not asked for\n", hash.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+            return true;
+        }
+        CBigNum bnTarget;
+        bnTarget.SetCompact(cmpctblock.header.nBits);
+        if (!cmpctblock.header.vtx.empty() || bnTarget <= 0 || bnTarget > max(bnProofOfWorkLimit, bnProofOfStakeLimit))
+        {
+            pfrom->Misbehaving(50);
+            return error("cmpctblock : bad header %s", hash.ToString().substr(0,20).c_str());
+        }
+
+        CBlock block;
+        vector<unsigned int> vMissing;
+        bool fFilled;
+        {
+            LOCK(mempool.cs);
+            fFilled = cmpctblock.FillBlock(block, mempool.mapTx, vMissing);
+        }
+        if (!fFilled)
+        {
+            AskForFullBlock(pfrom, hash);
+            return true;
+        }
+        if (vMissing.empty())
+        {
+            ProcessRebuiltBlock(pfrom, block);
+            return true;
+        }
+
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+        {
+            AskForFullBlock(pfrom, hash);
+            return true;
+        }
+        if (fDebug)
+            printf("compact block %s is missing %"PRIszu" of %"PRIszu" transactions\n", hash.ToString().substr(0,20).c_str(), vMissing.size(), block.vtx.size());
+        CPartialBlock& partial = mapPartialBlocks[hash];
+        partial.block = block;
+        partial.vMissing = vMissing;
+        partial.pnode = pfrom;
+        partial.nTime = GetTime();
+        pfrom->PushMessage("getblocktxn", hash, vMissing);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        uint256 hash;
+        vector<unsigned int> vIndexes;
+        vRecv >> hash >> vIndexes;
+
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            return true;
+        if ((*mi).second->nHeight + MAX_BLOCKTXN_DEPTH < nBestHeight)
+        {
+            if (fDebugNet)
+                printf("getblocktxn : ignoring %s from %s, too far below the tip\n", hash.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+            return true;
+        }
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("getblocktxn : cannot read block %s", hash.ToString().substr(0,20).c_str());
+
+        // Each transaction at most once, in block order
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+        {
+            if (vIndexes[i] >= block.vtx.size() || (i > 0 && vIndexes[i] <= vIndexes[i-1]))
             {
-               block.print();
+                pfrom->Misbehaving(20);
+                return error("getblocktxn : bad index %u", vIndexes[i]);
             }
         }
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
-        if (ProcessBlock(pfrom, &block))
+        vector<CTransaction> vtx;
+        vtx.reserve(vIndexes.size());
+        BOOST_FOREACH(unsigned int n, vIndexes)
+            vtx.push_back(block.vtx[n]);
+        pfrom->PushMessage("blocktxn", hash, vtx);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        uint256 hash;
+        vector<CTransaction> vtx;
+        vRecv >> hash >> vtx;
+
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(hash);
+        if (mi == mapPartialBlocks.end() || (*mi).second.pnode != pfrom)
+            return true;
+        CBlock block = (*mi).second.block;
+        vector<unsigned int> vMissing;
+        vMissing.swap((*mi).second.vMissing);
+        mapPartialBlocks.erase(mi);
+
+        if (vtx.size() != vMissing.size())
         {
-            mapAlreadyAskedFor.erase(inv);
-        }
-        if (block.nDoS)
-        { 
-            pfrom->Misbehaving(block.nDoS);
+            pfrom->Misbehaving(20);
+            AskForFullBlock(pfrom, hash);
+            return error("blocktxn : %"PRIszu" transactions sent, %"PRIszu" asked for", vtx.size(), vMissing.size());
         }
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            block.vtx[vMissing[i]] = vtx[i];
+        block.ClearPrecheck();
+        ProcessRebuiltBlock(pfrom, block);
     }
 
 
@@ -3894,16 +5040,77 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
-bool ProcessMessages(CNode* pfrom)
+// Precheck a run of block messages from one peer on the check threads,
+// then process them in the order they were received
+void static ProcessBlockBatch(CNode* pfrom, vector<CBlock>& vBlocks)
+{
+    if (vBlocks.empty())
+        return;
+
+    {
+        CCheckQueueControl<CBlockPrecheck> control(nCheckThreads ? &blockcheckqueue : NULL);
+        vector<CBlockPrecheck> vChecks;
+        vChecks.reserve(vBlocks.size());
+        BOOST_FOREACH(const CBlock& block, vBlocks)
+            vChecks.push_back(CBlockPrecheck(&block));
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    BOOST_FOREACH(CBlock& block, vBlocks)
+    {
+        if (fShutdown)
+            break;
+        try
+        {
+            LOCK(cs_main);
+            ProcessBlockMessage(pfrom, block);
+        }
+        catch (std::exception& e)
+        {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+        catch (...)
+        {
+            PrintExceptionContinue(NULL, "ProcessMessages()");
+        }
+    }
+    vBlocks.clear();
+}
+
+void ThreadBlockCheck(void* parg)
+{
+    vnThreadsRunning[THREAD_BLOCKCHECK]++;
+    RenameThread("jackpotcoin-blkcheck");
+    blockcheckqueue.Thread();
+    vnThreadsRunning[THREAD_BLOCKCHECK]--;
+}
+
+void ThreadBlockCheckQuit()
 {
-    CDataStream& vRecv = pfrom->vRecv;
+    blockcheckqueue.Quit();
+}
 
-    if (vRecv.empty()) {
+// Messages that keep the chain moving, which the message handler takes from
+// every node before the rest of any node's messages
+static bool IsPriorityMessage(const CNetMessage& msg)
+{
+    string strCommand = msg.hdr.GetCommand();
+    return strCommand == "block" || strCommand == "cmpctblock" || strCommand == "blocktxn" ||
+           strCommand == "checkpoint" || strCommand == "getheaders" || strCommand == "headers";
+}
+
+// With fPriorityOnly, only the priority messages at the front of the queue
+// are processed, up to one batch of blocks. Otherwise messages are processed
+// until the node has had its quantum of time.
+bool ProcessMessages(CNode* pfrom, bool fPriorityOnly)
+{
+    if (pfrom->vRecvMsg.empty()) {
         return true;
     }
 
     if (fDebugHigh) {
-        printf("ProcessMessages(%u bytes)\n", vRecv.size());
+        printf("ProcessMessages(%"PRIszu" messages)\n", pfrom->vRecvMsg.size());
     }
 
     //
@@ -3914,78 +5121,60 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread has already framed the messages and verified their
+    // checksums, see CNode::ReceiveMsgBytes()
+    //
+
+    // Consecutive block messages are collected here and prechecked together
+    // before any of them is processed, see ProcessBlockBatch()
+    vector<CBlock> vBlocks;
+    bool fBatchBlocks = nCheckThreads > 0 && pfrom->nVersion != 0 && !mapArgs.count("-dropmessagestest");
 
-    while (true)
+    int64 nTimeStart = GetTimeMicros();
+    unsigned int nProcessed = 0;
+    while (!pfrom->vRecvMsg.empty() && !pfrom->fDisconnect)
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize()) 
+        if (pfrom->nSendSize >= SendBufferSize()) 
         {
            break;
         }
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        // The last message may still be arriving
+        CNetMessage& msg = pfrom->vRecvMsg.front();
+        if (!msg.Complete())
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-        {
-            printf("\n\nPROCESSMESSAGE SKIPPED %"PRIpdd" BYTES\n\n", pstart - vRecv.begin());
-        }
-        vRecv.erase(vRecv.begin(), pstart);
 
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
-
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
+        // Leave the rest for the next pass, so other nodes get their turn
+        if (fPriorityOnly ? (!IsPriorityMessage(msg) || nProcessed >= MAX_BLOCK_PRECHECK_BATCH)
+                          : (nProcessed > 0 && GetTimeMicros() - nTimeStart >= MESSAGE_QUANTUM_MICROS))
             break;
-        }
+        nProcessed++;
 
-        // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
-        {
-            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
-        }
-
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        string strCommand = msg.hdr.GetCommand();
+        unsigned int nMessageSize = msg.hdr.nMessageSize;
+        CDataStream& vMsg = msg.vRecv;
+        vMsg.SetVersion(pfrom->nRecvVersion);
 
         // Process message
         bool fRet = false;
+        bool fBatched = fBatchBlocks && strCommand == "block";
         try
         {
+            if (fBatched)
+            {
+                if (vBlocks.empty())
+                    vBlocks.reserve(MAX_BLOCK_PRECHECK_BATCH);
+                vBlocks.push_back(CBlock());
+                vMsg >> vBlocks.back();
+                fBatched = false;
+                fRet = true;
+                if (vBlocks.size() >= MAX_BLOCK_PRECHECK_BATCH)
+                    ProcessBlockBatch(pfrom, vBlocks);
+            }
+            else
             {
+                ProcessBlockBatch(pfrom, vBlocks);
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
             }
@@ -4020,11 +5209,21 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        // Drop a block that failed to deserialize
+        if (fBatched)
+            vBlocks.pop_back();
+
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+
+        pfrom->nRecvQueueSize -= CMessageHeader::HEADER_SIZE + nMessageSize;
+        pfrom->vRecvMsg.pop_front();
     }
 
-    vRecv.Compact();
+    ProcessBlockBatch(pfrom, vBlocks);
+
+    pfrom->nMessagesProcessed += nProcessed;
+    pfrom->nProcessTime += GetTimeMicros() - nTimeStart;
     return true;
 }
 
@@ -4041,7 +5240,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
         // right now.
-        if (pto->nLastSend && ((GetTime() - pto->nLastSend) > 30 * 60) && pto->vSend.empty()) {
+        if (pto->nLastSend && ((GetTime() - pto->nLastSend) > 30 * 60) && pto->vSendMsg.empty()) {
             uint64 nonce = 0;
             if (pto->nVersion > BIP0031_VERSION)
             {
@@ -4182,6 +5381,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata
         //
+        RequestBlocks(pto);
+        RequestStalePartialBlocks(pto);
         vector<CInv> vGetData;
         int64 nNow = GetTime() * 1000000;
         CTxDB txdb("r");
@@ -4194,7 +5395,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                    printf("sending getdata: %s\n", inv.ToString().c_str());
                 }
-                vGetData.push_back(inv);
+                if (inv.type == MSG_BLOCK && WantCompactBlocks(pto))
+                    vGetData.push_back(CInv(MSG_COMPACT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -4664,6 +5868,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->ClearPrecheck();
 }
 
 
@@ -4768,6 +5973,9 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 
 void static ThreadBitcoinMiner(void* parg);
 
+// nonces hashed between checks for new work in BitcoinMiner()
+static const unsigned int nMinerScanBatch = 1024;
+
 static bool fGenerateBitcoins = false;
 static bool fLimitProcessors = false;
 static int nLimitProcessors = -1;
@@ -4777,6 +5985,8 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
 
     printf("CPU Miner started for proof-of-%s\n", fProofOfStake? "stake" : "work");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    if (!fProofOfStake)
+        printf("CPU Miner hash engine: %s kernel, %.2fx scalar\n", CMinerHasher::GetKernelName(), CMinerHasher::GetSpeedup());
 
     // Make this thread recognisable as the mining thread
     RenameThread("bitcoin-miner");
@@ -4856,14 +6066,33 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
         int64 nStart = GetTime();
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
         uint256 hash;
+        CMinerHasher hasher;
 
         while (true)
         {
-
-            hash = pblock->GetHash();
+            // Scan a batch of nonces on the current header; only the
+            // nonce changes within a batch
+            unsigned int nNonceFound;
+            hasher.SetWork(pblock.get());
+            hash = hasher.ScanHash(pblock->nNonce, nMinerScanBatch, nNonceFound);
 
             if (hash <= hashTarget)
             {
+                pblock->nNonce = nNonceFound;
+
+                // The block's own hash is what peers check. Should the scan
+                // kernel ever disagree with it, keep mining on GetHash() and
+                // start a new block if the nonce does not meet the target.
+                uint256 hashBlock = pblock->GetHash();
+                if (hash != hashBlock)
+                {
+                    printf("ERROR: BitcoinMiner : %s kernel hash %s does not match block hash %s\n", CMinerHasher::GetKernelName(),
+                           hash.GetHex().c_str(), hashBlock.GetHex().c_str());
+                    hash = hashBlock;
+                    if (hash > hashTarget)
+                        break;
+                }
+
                 if (!pblock->SignBlock(*pwalletMain))
                 {
                     strMintWarning = strMintMessage;
@@ -4877,7 +6106,6 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 SetThreadPriority(THREAD_PRIORITY_LOWEST);
                 break;
             }
-            ++pblock->nNonce;
 
             // Meter hashes/sec
             static int64 nHashCounter;
@@ -4888,7 +6116,7 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
             }
             else
             {
-                nHashCounter += 1;;
+                nHashCounter += nMinerScanBatch;
             }
             if (GetTimeMillis() - nHPSTimerStart > 4000)
             {
@@ -4906,7 +6134,8 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                             if (GetTime() - nLogTime > 30 * 60)
                             {
                                 nLogTime = GetTime();
-                                printf("hashmeter %3d CPUs %6.0f khash/s\n", vnThreadsRunning[THREAD_MINER], dHashesPerSec/1000.0);
+                                printf("hashmeter %3d CPUs %6.0f khash/s (%s kernel, %.2fx scalar)\n", vnThreadsRunning[THREAD_MINER], dHashesPerSec/1000.0,
+                                       CMinerHasher::GetKernelName(), CMinerHasher::GetSpeedup());
                             }
                         }
                     }
@@ -4923,7 +6152,8 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 return;
             if (vNodes.empty())
                 break;
-            if (++pblock->nNonce >= 0xffff0000)
+            pblock->nNonce += nMinerScanBatch;
+            if (pblock->nNonce >= 0xffff0000)
                 break;
             if ((nTransactionsUpdated != nTransactionsUpdatedLast) && ((GetTime() - nStart) > 60))
                 break;
@@ -10,6 +10,9 @@
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "blockindexmap.h"
+#include "blockfile.h"
+#include "lrucache.h"
 
 #include "hashblock.h"
 
@@ -62,15 +65,15 @@ static const int64 nMaxClockDrift = 2 * 60 * 60;  // two hours
 extern CScript COINBASE_FLAGS;
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern CBlockIndexMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nStakeMinAge;
 extern int nCoinbaseMaturity;
 extern int nBestHeight;
-extern CBigNum bnBestChainTrust;
-extern CBigNum bnBestInvalidTrust;
+extern uint256 nBestChainTrust;
+extern uint256 nBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
@@ -94,10 +97,15 @@ extern unsigned int nDerivationMethodIndex;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
 
+// Maximum number of verification threads (-par)
+static const int MAX_CHECK_THREADS = 16;
+extern int nCheckThreads;
+
 
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
@@ -105,11 +113,36 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool f
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
+
+/** Read the object stored at nPos in block file nFile, straight from a
+ * memory mapping of the file, or with stdio if it cannot be mapped.
+ * Returns false if the file cannot be opened; throws on bad data. */
+template<typename T>
+bool ReadFromBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType=SER_DISK)
+{
+    CBlockFileReader reader(nType, CLIENT_VERSION);
+    if (reader.Open(nFile, nPos))
+    {
+        reader >> obj;
+        return true;
+    }
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nPos, "rb"), nType, CLIENT_VERSION);
+    if (!filein)
+        return false;
+    filein >> obj;
+    return true;
+}
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+size_t GetBlockIndexMemoryUsage();
+size_t GetBlockIndexStakeCacheSize();
+void InitBlockReadCache();
 CBlockIndex* FindBlockByHeight(int nHeight);
-bool ProcessMessages(CNode* pfrom);
+bool ProcessMessages(CNode* pfrom, bool fPriorityOnly=false);
+void ThreadBlockCheck(void* parg);
+void ThreadBlockCheckQuit();
+void ThreadScriptCheck(void* parg);
+void ThreadScriptCheckQuit();
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
@@ -128,7 +161,8 @@ std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
-int CountPowDelta(CBlockIndex* pindex, int superBlock);
+int CountPowDelta(const CBlockIndex* pindex, int superBlock);
+void SetPowCounters(CBlockIndex* pindex);
 int GetPowHeight(const CBlockIndex* pindex);
 int GetPosHeight(const CBlockIndex* pindex);
 int GetSpecialHeight(const CBlockIndex* pindex, bool fProofOfStake);
@@ -596,32 +630,7 @@ public:
 
 	int64 GetMinFee(unsigned int nBlockSize=1, bool fAllowFree=false, enum GetMinFee_mode mode=GMF_BLOCK, unsigned int nBytes = 0) const;
 
-    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
-    {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
-
-        // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
-        return true;
-    }
+    bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL);
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -698,11 +707,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       std::vector<CScriptCheck>* pvChecks=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -713,6 +724,44 @@ protected:
 };
 
 
+/** Verification of one input's script, queued by ConnectInputs().
+ * Keeps a copy of the spent output's scriptPubKey, but only a pointer to
+ * the spending transaction, which must outlive the check.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+    bool fStrictPayToScriptHash;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), fStrictPayToScriptHash(false), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, bool fStrictPayToScriptHashIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), fStrictPayToScriptHash(fStrictPayToScriptHashIn), nHashType(nHashTypeIn) {}
+
+    bool operator()() const;
+
+    // Whether the script only fails under the pay-to-script-hash rules,
+    // which old clients may relay without knowing better
+    bool FailsOnlyPayToScriptHash() const;
+
+    const CTransaction* GetTransaction() const { return ptxTo; }
+
+    void swap(CScriptCheck& check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(fStrictPayToScriptHash, check.fStrictPayToScriptHash);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
 
 
 
@@ -858,6 +907,15 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: header hash cache, see GetHash()
+    mutable uint256 hashCached;
+    mutable unsigned char pchHeaderCached[88];
+    mutable bool fHashCached;
+
+    // memory only: results of Precheck(), set when the check passed
+    mutable bool fPrecheckedMerkleRoot;
+    mutable bool fPrecheckedSignature;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -905,17 +963,37 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
+        ClearPrecheck();
         nDoS = 0;
     }
 
+    // Forget the results of Precheck(); call after changing vtx or vchBlockSig
+    void ClearPrecheck() const
+    {
+        fPrecheckedMerkleRoot = false;
+        fPrecheckedSignature = false;
+    }
+
     bool IsNull() const
     {
         return (nBits == 0);
     }
 
+    // The header is only re-hashed when one of its fields changed since the
+    // last call, so a block is hashed once however often GetHash() is called
+    // while it is being validated, and the miner can still mutate
+    // nNonce/nTime in place.
     uint256 GetHash() const
     {
-    	return HashSHA3(BEGIN(nVersion), END(nRoundMask));
+        const char* pbegin = BEGIN(nVersion);
+        if (!fHashCached || memcmp(pchHeaderCached, pbegin, sizeof(pchHeaderCached)) != 0)
+        {
+            hashCached = HashSHA3(BEGIN(nVersion), END(nRoundMask));
+            memcpy(pchHeaderCached, pbegin, sizeof(pchHeaderCached));
+            fHashCached = true;
+        }
+        return hashCached;
     }
 
     int64 GetBlockTime() const
@@ -1013,55 +1091,21 @@ public:
 
     bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
+        // Index header, then the block
+        unsigned int nSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss.reserve(sizeof(pchMessageStart) + sizeof(nSize) + nSize);
+        ss << FLATDATA(pchMessageStart) << nSize << *this;
 
+        // Synced to disk later, in a group with other blocks
+        unsigned int nPos;
+        if (!AppendBlockFile(&ss[0], ss.size(), nFileRet, nPos))
+            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
+        nBlockPosRet = nPos + sizeof(pchMessageStart) + sizeof(nSize);
         return true;
     }
 
-    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
-    {
-        SetNull();
-
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
-
-        // Check the header
-        if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
-            return error("CBlock::ReadFromDisk() : errors in block header");
-
-        return true;
-    }
+    bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true);
 
 
 
@@ -1093,6 +1137,7 @@ public:
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
     bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true) const;
+    void Precheck() const;
     bool AcceptBlock();
     bool GetCoinAge(uint64& nCoinAge) const; // ppcoin: calculate total coin age spent in block
     bool SignBlock(const CKeyStore& keystore);
@@ -1102,6 +1147,109 @@ private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
 };
 
+/** Precheck of a received block, run by a CCheckQueue before the block
+ * is processed under cs_main.
+ */
+class CBlockPrecheck
+{
+private:
+    const CBlock* pblock;
+
+public:
+    CBlockPrecheck() : pblock(NULL) {}
+    CBlockPrecheck(const CBlock* pblockIn) : pblock(pblockIn) {}
+
+    bool operator()() const
+    {
+        pblock->Precheck();
+        return true;
+    }
+
+    void swap(CBlockPrecheck& check)
+    {
+        std::swap(pblock, check.pblock);
+    }
+};
+
+/** A block relayed to a peer that most likely has its transactions in its
+ * memory pool already: the header and signature, the coinbase (and the
+ * coinstake of a proof-of-stake block) in full, and a short ID for each
+ * of the other transactions. Short IDs are SipHash-2-4 of the transaction
+ * hash, keyed by the header hash and a nonce chosen for each compact
+ * block, so they cannot be made to collide on purpose.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header;  // without transactions
+    uint64 nNonce;
+    std::vector<CTransaction> vPrefilled;  // the first transactions of the block
+    std::vector<uint64> vShortIds;         // the others, in block order
+
+    CCompactBlock()
+    {
+        nNonce = 0;
+    }
+
+    explicit CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vPrefilled);
+        READWRITE(vShortIds);
+    )
+
+    void GetShortIdKeys(uint64& k0, uint64& k1) const;
+
+    static uint64 GetShortId(uint64 k0, uint64 k1, const uint256& hashTx)
+    {
+        return SipHashUint256(k0, k1, hashTx);
+    }
+
+    // Rebuilds the block from the prefilled transactions and those of mapTx
+    // with matching short IDs. The positions of transactions not found, or
+    // found more than once, are returned in vMissingRet and left null.
+    bool FillBlock(CBlock& blockRet, const std::map<uint256, CTransaction>& mapTx, std::vector<unsigned int>& vMissingRet) const;
+};
+
+
+
+/** Proof-of-stake fields of a block index entry. Only those of recent
+ * blocks are used often, by the stake modifier, so they are not kept in
+ * CBlockIndex but in a cache, and read from the block index database when
+ * not found there.
+ */
+class CBlockIndexStake
+{
+public:
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+    uint256 hashProofOfStake;
+
+    CBlockIndexStake()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        prevoutStake.SetNull();
+        nStakeTime = 0;
+        hashProofOfStake = 0;
+    }
+};
+
+// Blocks this far below the best height have their stake fields dropped
+// from the cache
+static const int STAKE_CACHE_DEPTH = 10000;
+
+// Null fields for a proof-of-work block
+bool GetBlockIndexStake(const CBlockIndex* pindex, CBlockIndexStake& stake);
+void SetBlockIndexStake(const CBlockIndex* pindex, const CBlockIndexStake& stake);
+void PruneBlockIndexStake();
+
 
 
 /** The block chain is a tree shaped structure starting with the
@@ -1114,42 +1262,44 @@ private:
 class CBlockIndex
 {
 public:
+    // Every block ever seen has one of these in memory for the life of the
+    // process, so the fields are ordered to leave no padding. The
+    // proof-of-stake fields are kept apart, see CBlockIndexStake.
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
-    unsigned int nFile;
-    unsigned int nBlockPos;
-    CBigNum bnChainTrust; // ppcoin: trust score of block chain
-    int nHeight;
+    uint256 nChainTrust; // ppcoin: trust score of block chain
 
     int64 nMint;
     int64 nMoneySupply;
-
-    unsigned int nFlags;  // ppcoin: block index flags
-    enum
-    {
-        BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
-        BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
-        BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
-    };
-
     uint64 nStakeModifier; // hash modifier for proof-of-stake
+
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
 
-    // proof-of-stake specific fields
-    COutPoint prevoutStake;
-    unsigned int nStakeTime;
-    uint256 hashProofOfStake;
+    // proof-of-work counters, see SetPowCounters(); in-memory only
+    int nPowHeight;          // PoW height used by the reward schedule
+    int nPowSinceSuperBlock; // PoW blocks from nSuperBlock up to and including this block
 
     // block header
-    int nVersion;
     uint256 hashMerkleRoot;
+    int nVersion;
     unsigned int nTime;
     unsigned int nBits;
     unsigned int nNonce;
 	unsigned int nSuperBlock;
     unsigned int nRoundMask;
 
+    unsigned char nFlags;  // ppcoin: block index flags; an unsigned int on disk
+    enum
+    {
+        BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
+        BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
+        BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
+    };
+
     CBlockIndex()
     {
         phashBlock = NULL;
@@ -1158,15 +1308,14 @@ public:
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        hashProofOfStake = 0;
-        prevoutStake.SetNull();
-        nStakeTime = 0;
+        nPowHeight = 0;
+        nPowSinceSuperBlock = 0;
 
         nVersion		= 0;
         hashMerkleRoot	= 0;
@@ -1185,24 +1334,16 @@ public:
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        hashProofOfStake = 0;
+        nPowHeight = 0;
+        nPowSinceSuperBlock = 0;
         if (block.IsProofOfStake())
-        {
             SetProofOfStake();
-            prevoutStake = block.vtx[1].vin[0].prevout;
-            nStakeTime = block.vtx[1].nTime;
-        }
-        else
-        {
-            prevoutStake.SetNull();
-            nStakeTime = 0;
-        }
 
         nVersion		= block.nVersion;
         hashMerkleRoot	= block.hashMerkleRoot;
@@ -1213,6 +1354,11 @@ public:
         nRoundMask      = block.nRoundMask;
     }
 
+    // There is one entry per block and they are never freed, so they come
+    // from an arena instead of one heap allocation each
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+
     CBlock GetBlockHeader() const
     {
         CBlock block;
@@ -1239,12 +1385,9 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockTrust() const;
+    uint256 GetBlockTrust() const;
 
-    bool IsInMainChain() const
-    {
-        return (pnext || this == pindexBest);
-    }
+    bool IsInMainChain() const;
 
     bool CheckIndex() const
     {
@@ -1329,13 +1472,11 @@ public:
 
     std::string ToString() const
     {
-        return strprintf("CBlockIndex(nprev=%p, pnext=%p, nFile=%u, nBlockPos=%-6d nHeight=%d, nMint=%s, nMoneySupply=%s, nFlags=(%s)(%d)(%s), nStakeModifier=%016"PRI64x", nStakeModifierChecksum=%08x, hashProofOfStake=%s, prevoutStake=(%s), nStakeTime=%d merkle=%s, hashBlock=%s)",
+        return strprintf("CBlockIndex(nprev=%p, pnext=%p, nFile=%u, nBlockPos=%-6d nHeight=%d, nMint=%s, nMoneySupply=%s, nFlags=(%s)(%d)(%s), nStakeModifier=%016"PRI64x", nStakeModifierChecksum=%08x, merkle=%s, hashBlock=%s)",
             pprev, pnext, nFile, nBlockPos, nHeight,
             FormatMoney(nMint).c_str(), FormatMoney(nMoneySupply).c_str(),
             GeneratedStakeModifier() ? "MOD" : "-", GetStakeEntropyBit(), IsProofOfStake()? "PoS" : "PoW",
             nStakeModifier, nStakeModifierChecksum,
-            hashProofOfStake.ToString().c_str(),
-            prevoutStake.ToString().c_str(), nStakeTime,
             hashMerkleRoot.ToString().c_str(),
             GetBlockHash().ToString().c_str());
     }
@@ -1348,27 +1489,104 @@ public:
 
 
 
+/** The blocks of the best chain, indexed by height. Follows the pnext links
+ * of the block index, and is changed with them under cs_main.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    // NULL if there is no block at that height
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    CBlockIndex* Tip() const
+    {
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    int Height() const
+    {
+        return (int)vChain.size() - 1;
+    }
+
+    // Make pindex the last block; only the entries from the fork point up
+    // are rewritten
+    void SetTip(CBlockIndex* pindex)
+    {
+        if (!pindex)
+        {
+            vChain.clear();
+            return;
+        }
+        vChain.resize(pindex->nHeight + 1);
+        while (pindex && vChain[pindex->nHeight] != pindex)
+        {
+            vChain[pindex->nHeight] = pindex;
+            pindex = pindex->pprev;
+        }
+    }
+};
+
+extern CChain chainActive;
+
+inline bool CBlockIndex::IsInMainChain() const
+{
+    return chainActive.Contains(this);
+}
+
+
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
 public:
     uint256 hashPrev;
     uint256 hashNext;
+    CBlockIndexStake stake;
+
+    // memory only: the stake fields could not be read for writing
+    bool fStakeMissing;
+
+private:
+    // memory only: block hash, computed on first use
+    mutable uint256 hashBlockCached;
+    mutable bool fHashBlockCached;
 
+public:
     CDiskBlockIndex()
     {
         hashPrev = 0;
         hashNext = 0;
+        fStakeMissing = false;
+        fHashBlockCached = false;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        hashBlockCached = pindex->GetBlockHash();
+        fHashBlockCached = true;
+        fStakeMissing = !GetBlockIndexStake(pindex, stake);
     }
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            const_cast<CDiskBlockIndex*>(this)->fHashBlockCached = false;
+
         if (!(nType & SER_GETHASH))
             READWRITE(nVersion);
 
@@ -1378,19 +1596,20 @@ public:
         READWRITE(nHeight);
         READWRITE(nMint);
         READWRITE(nMoneySupply);
-        READWRITE(nFlags);
+        unsigned int nFlagsDisk = nFlags;
+        READWRITE(nFlagsDisk);
+        if (fRead)
+            const_cast<CDiskBlockIndex*>(this)->nFlags = nFlagsDisk;
         READWRITE(nStakeModifier);
         if (IsProofOfStake())
         {
-            READWRITE(prevoutStake);
-            READWRITE(nStakeTime);
-            READWRITE(hashProofOfStake);
+            READWRITE(stake.prevoutStake);
+            READWRITE(stake.nStakeTime);
+            READWRITE(stake.hashProofOfStake);
         }
         else if (fRead)
         {
-            const_cast<CDiskBlockIndex*>(this)->prevoutStake.SetNull();
-            const_cast<CDiskBlockIndex*>(this)->nStakeTime = 0;
-            const_cast<CDiskBlockIndex*>(this)->hashProofOfStake = 0;
+            const_cast<CDiskBlockIndex*>(this)->stake.SetNull();
         }
 
         // block header
@@ -1406,6 +1625,9 @@ public:
 
     uint256 GetBlockHash() const
     {
+        if (fHashBlockCached)
+            return hashBlockCached;
+
         CBlock block;
         block.nVersion			= nVersion;
         block.hashPrevBlock		= hashPrev;
@@ -1415,7 +1637,9 @@ public:
         block.nNonce			= nNonce;
         block.nSuperBlock		= nSuperBlock;
         block.nRoundMask        = nRoundMask;
-		return block.GetHash();
+        hashBlockCached = block.GetHash();
+        fHashBlockCached = true;
+        return hashBlockCached;
     }
 
 
@@ -1423,10 +1647,12 @@ public:
     {
         std::string str = "CDiskBlockIndex(";
         str += CBlockIndex::ToString();
-        str += strprintf("\n                hashBlock=%s, hashPrev=%s, hashNext=%s)",
+        str += strprintf("\n                hashBlock=%s, hashPrev=%s, hashNext=%s, hashProofOfStake=%s, prevoutStake=(%s), nStakeTime=%d)",
             GetBlockHash().ToString().c_str(),
             hashPrev.ToString().c_str(),
-            hashNext.ToString().c_str());
+            hashNext.ToString().c_str(),
+            stake.hashProofOfStake.ToString().c_str(),
+            stake.prevoutStake.ToString().c_str(), stake.nStakeTime);
         return str;
     }
 
@@ -1459,7 +1685,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1510,7 +1736,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1529,7 +1755,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1545,7 +1771,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1599,4 +1825,10 @@ public:
 
 extern CTxMemPool mempool;
 
+/** Recently read blocks and transactions, keyed by file number and offset.
+ * Block files are only appended to, so entries never go stale.
+ */
+extern CLRUCache<std::pair<unsigned int, unsigned int>, CBlock> cacheBlockRead;
+extern CLRUCache<std::pair<unsigned int, unsigned int>, CTransaction> cacheTxRead;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,335 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "minerhash.h"
+#include "main.h"
+
+using namespace std;
+
+//
+// Keccak-f[1600] on the plain (non lane-complemented) state representation.
+// Written once as a template so the same code serves a single scalar state
+// and LANES states packed in vector registers.
+//
+
+#if defined(__GNUC__)
+#define MINERHASH_INLINE inline __attribute__((always_inline))
+#else
+#define MINERHASH_INLINE inline
+#endif
+
+static const sph_u64 pnKeccakRoundConstants[24] =
+{
+    SPH_C64(0x0000000000000001), SPH_C64(0x0000000000008082),
+    SPH_C64(0x800000000000808A), SPH_C64(0x8000000080008000),
+    SPH_C64(0x000000000000808B), SPH_C64(0x0000000080000001),
+    SPH_C64(0x8000000080008081), SPH_C64(0x8000000000008009),
+    SPH_C64(0x000000000000008A), SPH_C64(0x0000000000000088),
+    SPH_C64(0x0000000080008009), SPH_C64(0x000000008000000A),
+    SPH_C64(0x000000008000808B), SPH_C64(0x800000000000008B),
+    SPH_C64(0x8000000000008089), SPH_C64(0x8000000000008003),
+    SPH_C64(0x8000000000008002), SPH_C64(0x8000000000000080),
+    SPH_C64(0x000000000000800A), SPH_C64(0x800000008000000A),
+    SPH_C64(0x8000000080008081), SPH_C64(0x8000000000008080),
+    SPH_C64(0x0000000080000001), SPH_C64(0x8000000080008008)
+};
+
+#define KECCAK_ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+template<typename T>
+static MINERHASH_INLINE void KeccakF1600(T* a)
+{
+    T b0, b1, b2, b3, b4, b5, b6, b7, b8, b9, b10, b11, b12;
+    T b13, b14, b15, b16, b17, b18, b19, b20, b21, b22, b23, b24;
+    T c0, c1, c2, c3, c4, d0, d1, d2, d3, d4;
+    for (int nRound = 0; nRound < 24; nRound++)
+    {
+        // theta
+        c0 = a[0] ^ a[5] ^ a[10] ^ a[15] ^ a[20];
+        c1 = a[1] ^ a[6] ^ a[11] ^ a[16] ^ a[21];
+        c2 = a[2] ^ a[7] ^ a[12] ^ a[17] ^ a[22];
+        c3 = a[3] ^ a[8] ^ a[13] ^ a[18] ^ a[23];
+        c4 = a[4] ^ a[9] ^ a[14] ^ a[19] ^ a[24];
+        d0 = c4 ^ KECCAK_ROTL(c1, 1);
+        d1 = c0 ^ KECCAK_ROTL(c2, 1);
+        d2 = c1 ^ KECCAK_ROTL(c3, 1);
+        d3 = c2 ^ KECCAK_ROTL(c4, 1);
+        d4 = c3 ^ KECCAK_ROTL(c0, 1);
+
+        // rho and pi
+        b0  = a[0] ^ d0;
+        b1  = KECCAK_ROTL(a[6] ^ d1, 44);
+        b2  = KECCAK_ROTL(a[12] ^ d2, 43);
+        b3  = KECCAK_ROTL(a[18] ^ d3, 21);
+        b4  = KECCAK_ROTL(a[24] ^ d4, 14);
+        b5  = KECCAK_ROTL(a[3] ^ d3, 28);
+        b6  = KECCAK_ROTL(a[9] ^ d4, 20);
+        b7  = KECCAK_ROTL(a[10] ^ d0, 3);
+        b8  = KECCAK_ROTL(a[16] ^ d1, 45);
+        b9  = KECCAK_ROTL(a[22] ^ d2, 61);
+        b10 = KECCAK_ROTL(a[1] ^ d1, 1);
+        b11 = KECCAK_ROTL(a[7] ^ d2, 6);
+        b12 = KECCAK_ROTL(a[13] ^ d3, 25);
+        b13 = KECCAK_ROTL(a[19] ^ d4, 8);
+        b14 = KECCAK_ROTL(a[20] ^ d0, 18);
+        b15 = KECCAK_ROTL(a[4] ^ d4, 27);
+        b16 = KECCAK_ROTL(a[5] ^ d0, 36);
+        b17 = KECCAK_ROTL(a[11] ^ d1, 10);
+        b18 = KECCAK_ROTL(a[17] ^ d2, 15);
+        b19 = KECCAK_ROTL(a[23] ^ d3, 56);
+        b20 = KECCAK_ROTL(a[2] ^ d2, 62);
+        b21 = KECCAK_ROTL(a[8] ^ d3, 55);
+        b22 = KECCAK_ROTL(a[14] ^ d4, 39);
+        b23 = KECCAK_ROTL(a[15] ^ d0, 41);
+        b24 = KECCAK_ROTL(a[21] ^ d1, 2);
+
+        // chi
+        a[0] = b0 ^ (~b1 & b2);
+        a[1] = b1 ^ (~b2 & b3);
+        a[2] = b2 ^ (~b3 & b4);
+        a[3] = b3 ^ (~b4 & b0);
+        a[4] = b4 ^ (~b0 & b1);
+        a[5] = b5 ^ (~b6 & b7);
+        a[6] = b6 ^ (~b7 & b8);
+        a[7] = b7 ^ (~b8 & b9);
+        a[8] = b8 ^ (~b9 & b5);
+        a[9] = b9 ^ (~b5 & b6);
+        a[10] = b10 ^ (~b11 & b12);
+        a[11] = b11 ^ (~b12 & b13);
+        a[12] = b12 ^ (~b13 & b14);
+        a[13] = b13 ^ (~b14 & b10);
+        a[14] = b14 ^ (~b10 & b11);
+        a[15] = b15 ^ (~b16 & b17);
+        a[16] = b16 ^ (~b17 & b18);
+        a[17] = b17 ^ (~b18 & b19);
+        a[18] = b18 ^ (~b19 & b15);
+        a[19] = b19 ^ (~b15 & b16);
+        a[20] = b20 ^ (~b21 & b22);
+        a[21] = b21 ^ (~b22 & b23);
+        a[22] = b22 ^ (~b23 & b24);
+        a[23] = b23 ^ (~b24 & b20);
+        a[24] = b24 ^ (~b20 & b21);
+
+        // iota
+        a[0] ^= pnKeccakRoundConstants[nRound];
+    }
+}
+
+
+//
+// Final Keccak block for LANES nonces at once
+//
+
+typedef void (*KeccakLanesFunc)(const sph_u64* pstate, const sph_u64* plast, const unsigned int* pnNonce, sph_u64 (*pout)[8]);
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)) && (defined(__x86_64__) || defined(__i386__))
+#define MINERHASH_USE_LANES 1
+
+typedef sph_u64 v4u64 __attribute__ ((vector_size (32)));
+
+static MINERHASH_INLINE void KeccakLanesVector(const sph_u64* pstate, const sph_u64* plast, const unsigned int* pnNonce, sph_u64 (*pout)[8])
+{
+    v4u64 s[25];
+    for (int i = 0; i < 25; i++)
+    {
+        sph_u64 v = pstate[i] ^ (i < 9 ? plast[i] : 0);
+        v4u64 vec = { v, v, v, v };
+        s[i] = vec;
+    }
+    sph_u64 lane0[4];
+    for (int k = 0; k < 4; k++)
+        lane0[k] = (pstate[0] ^ plast[0]) ^ ((sph_u64)pnNonce[k] << 32);
+    memcpy(&s[0], lane0, sizeof(lane0));
+
+    KeccakF1600(s);
+
+    for (int i = 0; i < 8; i++)
+    {
+        sph_u64 lane[4];
+        memcpy(lane, &s[i], sizeof(lane));
+        for (int k = 0; k < 4; k++)
+            pout[k][i] = lane[k];
+    }
+}
+
+// Generic vector code: two SSE2 registers per state lane on x86
+static void KeccakLanesSSE2(const sph_u64* pstate, const sph_u64* plast, const unsigned int* pnNonce, sph_u64 (*pout)[8])
+{
+    KeccakLanesVector(pstate, plast, pnNonce, pout);
+}
+
+__attribute__((target("avx2")))
+static void KeccakLanesAVX2(const sph_u64* pstate, const sph_u64* plast, const unsigned int* pnNonce, sph_u64 (*pout)[8])
+{
+    KeccakLanesVector(pstate, plast, pnNonce, pout);
+}
+#else
+static void KeccakLanesScalar(const sph_u64* pstate, const sph_u64* plast, const unsigned int* pnNonce, sph_u64 (*pout)[8])
+{
+    for (int k = 0; k < CMinerHasher::LANES; k++)
+    {
+        sph_u64 s[25];
+        for (int i = 0; i < 25; i++)
+            s[i] = pstate[i] ^ (i < 9 ? plast[i] : 0);
+        s[0] ^= (sph_u64)pnNonce[k] << 32;
+        KeccakF1600(s);
+        memcpy(pout[k], s, sizeof(pout[k]));
+    }
+}
+#endif
+
+static KeccakLanesFunc pfnKeccakLanes = NULL;
+static const char* pszKeccakKernel = "scalar";
+
+static void SelectKeccakKernel()
+{
+    if (pfnKeccakLanes)
+        return;
+#ifdef MINERHASH_USE_LANES
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        pszKeccakKernel = "avx2";
+        pfnKeccakLanes = KeccakLanesAVX2;
+        return;
+    }
+    pszKeccakKernel = "sse2";
+    pfnKeccakLanes = KeccakLanesSSE2;
+#else
+    pfnKeccakLanes = KeccakLanesScalar;
+#endif
+}
+
+
+//
+// CMinerHasher
+//
+
+CMinerHasher::CMinerHasher()
+{
+    SelectKeccakKernel();
+    memset(pchHeader, 0, sizeof(pchHeader));
+    nRoundMask = 0;
+    memset(midstate, 0, sizeof(midstate));
+    memset(lastblock, 0, sizeof(lastblock));
+}
+
+void CMinerHasher::SetWork(const CBlock* pblock)
+{
+    memcpy(pchHeader, BEGIN(pblock->nVersion), sizeof(pchHeader));
+    nRoundMask = pblock->nRoundMask;
+
+    // version 1 hashes the whole 88 byte header, version 2 the first 80
+    unsigned int nLen = (nRoundMask == 7 ? 88 : 80);
+
+    // absorb the first block
+    for (int i = 0; i < 25; i++)
+        midstate[i] = (i < 9 ? sph_dec64le(pchHeader + 8 * i) : 0);
+    KeccakF1600(midstate);
+
+    // pad the rest; Keccak-512 as implemented by sph_keccak512 (0x01 ... 0x80)
+    unsigned char pchLast[72];
+    memset(pchLast, 0, sizeof(pchLast));
+    memcpy(pchLast, pchHeader + 72, nLen - 72);
+    pchLast[nLen - 72] ^= 0x01;
+    pchLast[71] ^= 0x80;
+    for (int i = 0; i < 9; i++)
+        lastblock[i] = sph_dec64le(pchLast + 8 * i);
+
+    // nNonce is bytes 4..7 of the final block, supplied per hash
+    lastblock[0] &= SPH_C64(0x00000000FFFFFFFF);
+}
+
+uint256 CMinerHasher::FinishHash(const sph_u64* pKeccak) const
+{
+    uint512 hash;
+    for (int i = 0; i < 8; i++)
+        sph_enc64le(hash.begin() + 8 * i, pKeccak[i]);
+
+    if (nRoundMask == 7)
+        return HashSHA3V1Rounds(hash, nRoundMask);
+    else
+        return HashSHA3V2Rounds(hash);
+}
+
+uint256 CMinerHasher::Hash(unsigned int nNonce) const
+{
+    sph_u64 s[25];
+    for (int i = 0; i < 25; i++)
+        s[i] = midstate[i] ^ (i < 9 ? lastblock[i] : 0);
+    s[0] ^= (sph_u64)nNonce << 32;
+    KeccakF1600(s);
+    return FinishHash(s);
+}
+
+uint256 CMinerHasher::ScanHash(unsigned int nNonceStart, unsigned int nCount, unsigned int& nNonceRet) const
+{
+    uint256 hashBest = ~uint256(0);
+    nNonceRet = nNonceStart;
+
+    unsigned int pnNonce[LANES];
+    sph_u64 pKeccak[LANES][8];
+    for (unsigned int n = 0; n < nCount; n += LANES)
+    {
+        unsigned int nLanes = std::min((unsigned int)LANES, nCount - n);
+        for (int k = 0; k < LANES; k++)
+            pnNonce[k] = nNonceStart + n + k;
+        pfnKeccakLanes(midstate, lastblock, pnNonce, pKeccak);
+
+        for (unsigned int k = 0; k < nLanes; k++)
+        {
+            uint256 hash = FinishHash(pKeccak[k]);
+            if (hash < hashBest)
+            {
+                hashBest = hash;
+                nNonceRet = pnNonce[k];
+            }
+        }
+    }
+    return hashBest;
+}
+
+const char* CMinerHasher::GetKernelName()
+{
+    SelectKeccakKernel();
+    return pszKeccakKernel;
+}
+
+double CMinerHasher::GetSpeedup()
+{
+    static CCriticalSection cs;
+    static double dSpeedup = 0.0;
+
+    LOCK(cs);
+    if (dSpeedup > 0.0)
+        return dSpeedup;
+
+    static const unsigned int nBenchHashes = 4096;
+
+    CBlock block;
+    block.nTime = GetAdjustedTime();
+    block.nBits = 0x1e0fffff;
+    block.nRoundMask = 7;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+
+    // scalar path: the miner loop before this engine existed
+    int64 nStart = GetTimeMicros();
+    for (unsigned int n = 0; n < nBenchHashes; n++)
+    {
+        block.nNonce = n;
+        block.GetHash();
+    }
+    int64 nScalar = GetTimeMicros() - nStart;
+
+    CMinerHasher hasher;
+    unsigned int nNonce;
+    nStart = GetTimeMicros();
+    hasher.SetWork(&block);
+    hasher.ScanHash(0, nBenchHashes, nNonce);
+    int64 nEngine = GetTimeMicros() - nStart;
+
+    dSpeedup = (double)nScalar / (double)std::max(nEngine, (int64)1);
+    return dSpeedup;
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2014 The JackpotCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MINERHASH_H
+#define BITCOIN_MINERHASH_H
+
+#include "uint256.h"
+#include "sph_types.h"
+
+class CBlock;
+
+/** Proof-of-work hash engine for the built-in miner.
+ *
+ * The nonce lives in bytes 76..79 of the header, past the first 72-byte
+ * Keccak-512 input block, so the state after absorbing that block is the
+ * same for every nonce of a work unit. SetWork() computes it once; each
+ * nonce then only pays for the final Keccak permutation and the round chain.
+ * The final permutation is evaluated for LANES nonces at a time, with an
+ * AVX2 kernel selected at runtime where the CPU supports it.
+ */
+class CMinerHasher
+{
+public:
+    enum { LANES = 4 };
+
+    CMinerHasher();
+
+    // Take the header of pblock as the new work unit (nNonce is ignored)
+    void SetWork(const CBlock* pblock);
+
+    // Header hash with the given nonce, identical to CBlock::GetHash()
+    uint256 Hash(unsigned int nNonce) const;
+
+    // Hash nCount nonces starting at nNonceStart; returns the lowest hash
+    // found and sets nNonceRet to the nonce that produced it
+    uint256 ScanHash(unsigned int nNonceStart, unsigned int nCount, unsigned int& nNonceRet) const;
+
+    // Name of the Keccak kernel in use
+    static const char* GetKernelName();
+
+    // Throughput of ScanHash relative to hashing whole headers with
+    // CBlock::GetHash(), measured once on first call
+    static double GetSpeedup();
+
+private:
+    unsigned char pchHeader[88];
+    unsigned int nRoundMask;
+    sph_u64 midstate[25];  // Keccak state after the first 72 header bytes
+    sph_u64 lastblock[9];  // padded final input block, nonce bits zero
+
+    uint256 FinishHash(const sph_u64* pKeccak) const;
+};
+
+#endif
@@ -14,6 +14,14 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define USE_EPOLL
 #endif
 
 #ifdef USE_UPNP
@@ -64,7 +72,7 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSendBuffer> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
@@ -542,7 +550,6 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addrName.c_str());
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
     }
 }
 
@@ -550,6 +557,126 @@ void CNode::Cleanup()
 {
 }
 
+bool CNetMessage::ReadHeader(const char* pch, unsigned int nBytes, unsigned int& nUsedRet)
+{
+    nUsedRet = 0;
+    while (nUsedRet < nBytes && nHeaderPos < CMessageHeader::HEADER_SIZE)
+    {
+        pchHeader[nHeaderPos++] = pch[nUsedRet++];
+
+        // Skip whatever comes before a message start
+        unsigned int nSkipped = 0;
+        while (nHeaderPos > 0 && memcmp(pchHeader, pchMessageStart, min(nHeaderPos, (unsigned int)sizeof(pchMessageStart))) != 0)
+        {
+            memmove(pchHeader, pchHeader + 1, --nHeaderPos);
+            nSkipped++;
+        }
+        if (nSkipped > 0 && fDebugNet)
+            printf("CNetMessage::ReadHeader() : skipped %u bytes\n", nSkipped);
+    }
+    if (nHeaderPos < CMessageHeader::HEADER_SIZE)
+        return true;
+
+    CDataStream ssHeader(pchHeader, pchHeader + CMessageHeader::HEADER_SIZE, vRecv.nType, vRecv.nVersion);
+    ssHeader >> hdr;
+    return hdr.IsValid();
+}
+
+unsigned int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = min(hdr.nMessageSize - nDataPos, nBytes);
+    if (nCopy == 0)
+        return 0;
+    // Grow the buffer as the payload arrives, rather than trusting the
+    // size in the header
+    if (vRecv.size() < nDataPos + nCopy)
+        vRecv.resize(min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+    return nCopy;
+}
+
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    bool fComplete = false;
+    while (nBytes > 0)
+    {
+        if (vRecvMsg.empty() || vRecvMsg.back().Complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+        CNetMessage& msg = vRecvMsg.back();
+
+        unsigned int nUsed;
+        if (!msg.InData())
+        {
+            if (!msg.ReadHeader(pch, nBytes, nUsed))
+            {
+                // Drop the header and look for the next message start
+                printf("\n\nRECEIVE: ERRORS IN HEADER %s\n\n\n", msg.hdr.GetCommand().c_str());
+                vRecvMsg.pop_back();
+            }
+            else if (msg.InData())
+                nRecvQueueSize += CMessageHeader::HEADER_SIZE;
+        }
+        else
+        {
+            nUsed = msg.ReadData(pch, nBytes);
+            nRecvQueueSize += nUsed;
+        }
+        pch += nUsed;
+        nBytes -= nUsed;
+
+        if (!vRecvMsg.empty() && vRecvMsg.back().Complete())
+        {
+            CNetMessage& msgDone = vRecvMsg.back();
+            uint256 hash = Hash(msgDone.vRecv.begin(), msgDone.vRecv.end());
+            unsigned int nChecksum = 0;
+            memcpy(&nChecksum, &hash, sizeof(nChecksum));
+            if (nChecksum != msgDone.hdr.nChecksum)
+            {
+                printf("ReceiveMsgBytes(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+                   msgDone.hdr.GetCommand().c_str(), msgDone.hdr.nMessageSize, nChecksum, msgDone.hdr.nChecksum);
+                nRecvQueueSize -= CMessageHeader::HEADER_SIZE + msgDone.nDataPos;
+                vRecvMsg.pop_back();
+            }
+            else
+                fComplete = true;
+        }
+    }
+    return fComplete;
+}
+
+
+CSendBuffer CreateMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    boost::shared_ptr<CDataStream> pss(new CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    pss->reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    *pss << hdr;
+    pss->insert(pss->end(), ssPayload.begin(), ssPayload.end());
+    return CSendBuffer(boost::shared_ptr<const CDataStream>(pss));
+}
+
+void CNode::PushMessageRaw(const char* pszCommand, const CSendBuffer& payload)
+{
+    boost::shared_ptr<CDataStream> pssHeader(new CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    CMessageHeader hdr(pszCommand, payload.size());
+    uint256 hash = Hash(payload.pbegin, payload.pend);
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    *pssHeader << hdr;
+
+    bool fWasEmpty;
+    {
+        LOCK(cs_vSend);
+        fWasEmpty = QueueSend(CSendBuffer(boost::shared_ptr<const CDataStream>(pssHeader)));
+        QueueSend(payload);
+    }
+    if (fDebug)
+        printf("sending: %s (%"PRIszu" bytes)\n", pszCommand, payload.size());
+    if (fWasEmpty)
+        WakeSocketHandler(this);
+}
 
 void CNode::PushVersion()
 {
@@ -631,6 +758,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nReleaseTime);
     X(nStartingHeight);
     X(nMisbehavior);
+    X(nRecvQueueSize);
+    X(nSendSize);
+    X(nMessagesProcessed);
+    X(nProcessTime);
 }
 #undef X
 
@@ -657,90 +788,56 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exited\n");
 }
 
+static void DisconnectNodes(list<CNode*>& vNodesDisconnected);
+static void AcceptConnection(SOCKET hListenSocket);
+static bool SocketRecvData(CNode* pnode, bool* pfLockMissed=NULL);
+static bool SocketSendData(CNode* pnode, bool* pfLockMissed=NULL);
+static void CheckInactivity(CNode* pnode);
+#ifdef USE_EPOLL
+static bool InitSocketPoll();
+static bool ServiceSocketsPoll();
+static void ForgetPolledNode(CNode* pnode);
+#endif
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
 
+#ifdef USE_EPOLL
+    bool fPoll = InitSocketPoll();
+    if (!fPoll)
+        printf("ThreadSocketHandler : epoll not available, using select\n");
+#endif
+
     while (true)
     {
         //
         // Disconnect nodes
         //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-            {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
-
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
-            }
-
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
-            {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
-                {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_mapRequests, lockReq);
-                                if (lockReq)
-                                {
-                                    TRY_LOCK(pnode->cs_inventory, lockInv);
-                                    if (lockInv)
-                                        fDelete = true;
-                                }
-                            }
-                        }
-                    }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
-                }
-            }
-        }
+        DisconnectNodes(vNodesDisconnected);
         if (vNodes.size() != nPrevNodeCount)
         {
             nPrevNodeCount = vNodes.size();
             uiInterface.NotifyNumConnectionsChanged(vNodes.size());
         }
 
+#ifdef USE_EPOLL
+        if (fPoll)
+        {
+            if (!ServiceSocketsPoll())
+                return;
+            continue;
+        }
+#endif
 
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = 50000; // frequency to poll pnode->vSendMsg
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -768,7 +865,7 @@ void ThreadSocketHandler2(void* parg)
                 have_fds = true;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (lockSend && !pnode->vSendMsg.empty())
                         FD_SET(pnode->hSocket, &fdsetSend);
                 }
             }
@@ -799,59 +896,8 @@ void ThreadSocketHandler2(void* parg)
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -875,49 +921,7 @@ void ThreadSocketHandler2(void* parg)
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                            pnode->nLastRecv = GetTime();
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketRecvData(pnode);
 
             //
             // Send
@@ -925,67 +929,534 @@ void ThreadSocketHandler2(void* parg)
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetSend))
+                SocketSendData(pnode);
+
+            //
+            // Inactivity checking
+            //
+            CheckInactivity(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+
+        MilliSleep(10);
+    }
+}
+
+static void DisconnectNodes(list<CNode*>& vNodesDisconnected)
+{
+    LOCK(cs_vNodes);
+    // Disconnect unused nodes
+    vector<CNode*> vNodesCopy = vNodes;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->fDisconnect ||
+            (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty()))
+        {
+            // remove from vNodes
+            vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+            // release outbound grant (if any)
+            pnode->grantOutbound.Release();
+
+            // close socket and cleanup
+            pnode->CloseSocketDisconnect();
+            pnode->Cleanup();
+
+            // hold in disconnected pool until all refs are released
+            pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+            if (pnode->fNetworkNode || pnode->fInbound)
+                pnode->Release();
+            vNodesDisconnected.push_back(pnode);
+        }
+    }
+
+    // Delete disconnected nodes
+    list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+    BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+    {
+        // wait until threads are done using it
+        if (pnode->GetRefCount() <= 0)
+        {
+            bool fDelete = false;
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                    if (lockRecv)
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
+                        TRY_LOCK(pnode->cs_mapRequests, lockReq);
+                        if (lockReq)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
                 }
             }
+            if (fDelete)
+            {
+                vNodesDisconnected.remove(pnode);
+#ifdef USE_EPOLL
+                ForgetPolledNode(pnode);
+#endif
+                delete pnode;
+            }
+        }
+    }
+}
 
-            //
-            // Inactivity checking
-            //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
+static void AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// Returns true if there may be more to read: the receive buffer could not be
+// locked or data was read; false once the socket would block or is closed.
+// pfLockMissed is set when the buffer was held by another thread.
+static bool SocketRecvData(CNode* pnode, bool* pfLockMissed)
+{
+    TRY_LOCK(pnode->cs_vRecv, lockRecv);
+    if (!lockRecv)
+    {
+        if (pfLockMissed)
+            *pfLockMissed = true;
+        return true;
+    }
+
+    if (pnode->nRecvQueueSize > ReceiveBufferSize()) {
+        if (!pnode->fDisconnect)
+            printf("socket recv flood control disconnect (%u bytes)\n", pnode->nRecvQueueSize);
+        pnode->CloseSocketDisconnect();
+        return false;
+    }
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            WakeMessageHandler();
+        pnode->nLastRecv = GetTime();
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// Buffers handed to the kernel in one call
+static const int MAX_SEND_BUFFERS = 64;
+
+// Returns true if data is left to send. pfLockMissed is set when the send
+// queue was held by another thread.
+static bool SocketSendData(CNode* pnode, bool* pfLockMissed)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+    {
+        if (pfLockMissed)
+            *pfLockMissed = true;
+        return true;
+    }
+
+    while (!pnode->vSendMsg.empty())
+    {
+        // Send from as many queued buffers as one call takes, starting where
+        // the last send left off. Nothing is copied or moved up afterwards.
+        int nBytes;
+#ifdef WIN32
+        const CSendBuffer& buf = pnode->vSendMsg.front();
+        nBytes = send(pnode->hSocket, buf.pbegin + pnode->nSendOffset, buf.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec vec[MAX_SEND_BUFFERS];
+        int nBuffers = 0;
+        for (deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++it, nBuffers++)
+        {
+            size_t nSkip = (nBuffers == 0 ? pnode->nSendOffset : 0);
+            vec[nBuffers].iov_base = (void*)(it->pbegin + nSkip);
+            vec[nBuffers].iov_len = it->size() - nSkip;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = nBuffers;
+        nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes > 0)
+        {
+            // The message handler stops serving a node whose send buffer is
+            // full; let it carry on once there is room again
+            bool fWasFull = (pnode->nSendSize >= SendBufferSize());
+            pnode->nSendSize -= nBytes;
+            size_t nSent = nBytes;
+            while (nSent > 0)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+                size_t nLeft = pnode->vSendMsg.front().size() - pnode->nSendOffset;
+                if (nSent < nLeft)
                 {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
+                    pnode->nSendOffset += nSent;
+                    break;
                 }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
+                nSent -= nLeft;
+                pnode->nSendOffset = 0;
+                pnode->vSendMsg.pop_front();
+            }
+            pnode->nLastSend = GetTime();
+            if (fWasFull && pnode->nSendSize < SendBufferSize())
+                WakeMessageHandler();
+
+            // A short send means the socket buffer is full
+            if (pnode->nSendOffset != 0)
+                break;
+        }
+        else
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                 {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                    return false;
                 }
             }
+            break;
         }
+    }
+    return !pnode->vSendMsg.empty();
+}
+
+static void CheckInactivity(CNode* pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
         }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
-        MilliSleep(10);
+#ifdef USE_EPOLL
+//
+// epoll reactor. Node sockets are edge triggered: a node stays in
+// setNodesRecvReady until a read would block, and in setNodesSendReady until
+// its send buffer is empty or the socket is full, when writes are watched
+// until it drains. Nodes with nothing to send cost nothing while idle.
+// Threads that queue a message for an idle node wake the reactor through
+// an eventfd. A node whose buffer another thread holds is not ready work:
+// it waits in setNodesRecvLocked or setNodesSendLocked and is retried
+// after a short wait.
+//
+static int hEpoll = -1;
+static int hWakeEvent = -1;
+
+// Socket thread only
+static set<CNode*> setNodesRecvReady;
+static set<CNode*> setNodesSendReady;
+static set<CNode*> setNodesRecvLocked;
+static set<CNode*> setNodesSendLocked;
+static int64 nLastInactivityCheck = 0;
+
+static CCriticalSection cs_vNodesWake;
+static vector<CNode*> vNodesWake;
+
+static const int MAX_POLL_EVENTS = 256;
+
+static bool InitSocketPoll()
+{
+    if (!GetBoolArg("-epoll", true))
+        return false;
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+        return false;
+    int hEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hEvent == -1)
+    {
+        close(hEpoll);
+        hEpoll = -1;
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    bool fOk = (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hEvent, &event) == 0);
+    for (unsigned int i = 0; i < vhListenSocket.size() && fOk; i++)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &vhListenSocket[i];
+        fOk = (epoll_ctl(hEpoll, EPOLL_CTL_ADD, vhListenSocket[i], &event) == 0);
     }
+    if (!fOk)
+    {
+        close(hEvent);
+        close(hEpoll);
+        hEpoll = -1;
+        return false;
+    }
+    hWakeEvent = hEvent;
+    return true;
 }
 
+static void SetPollSend(CNode* pnode, bool fSend)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET | (fSend ? (uint32_t)EPOLLOUT : 0u);
+    event.data.ptr = pnode;
+    // Also re-arms the edge: if the socket is writable already, an event
+    // comes straight away
+    if (epoll_ctl(hEpoll, EPOLL_CTL_MOD, pnode->hSocket, &event) == 0)
+        pnode->fPollSend = fSend;
+}
+
+static void ForgetPolledNode(CNode* pnode)
+{
+    setNodesRecvReady.erase(pnode);
+    setNodesSendReady.erase(pnode);
+    setNodesRecvLocked.erase(pnode);
+    setNodesSendLocked.erase(pnode);
+    LOCK(cs_vNodesWake);
+    vNodesWake.erase(remove(vNodesWake.begin(), vNodesWake.end(), pnode), vNodesWake.end());
+}
+
+// Returns false on shutdown
+static bool ServiceSocketsPoll()
+{
+    // Register nodes connected since the last pass. Whatever is already
+    // waiting on the socket is reported when it is added.
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->fPollAdded || pnode->hSocket == INVALID_SOCKET)
+                continue;
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLET;
+            event.data.ptr = pnode;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0)
+            {
+                printf("socket epoll_ctl add failed %d\n", errno);
+                pnode->CloseSocketDisconnect();
+                continue;
+            }
+            pnode->fPollAdded = true;
+            setNodesSendReady.insert(pnode);
+        }
+    }
+
+    // Don't wait while there is still work to do, and only briefly while
+    // buffers are held by the message handler
+    int nTimeout = 100;
+    if (!setNodesRecvReady.empty() || !setNodesSendReady.empty())
+        nTimeout = 0;
+    else if (!setNodesRecvLocked.empty() || !setNodesSendLocked.empty())
+        nTimeout = 10;
+    struct epoll_event vEvents[MAX_POLL_EVENTS];
+    vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+    int nEvents = epoll_wait(hEpoll, vEvents, MAX_POLL_EVENTS, nTimeout);
+    vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+    if (fShutdown)
+        return false;
+    if (nEvents < 0)
+    {
+        if (errno != EINTR)
+        {
+            printf("socket epoll_wait error %d\n", errno);
+            MilliSleep(50);
+        }
+        nEvents = 0;
+    }
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        void* ptr = vEvents[i].data.ptr;
+        if (ptr == NULL)
+        {
+            // Nodes that were given something to send
+            uint64 nCount;
+            if (read(hWakeEvent, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+                printf("socket eventfd read error %d\n", errno);
+            vector<CNode*> vNodesWakeCopy;
+            {
+                LOCK(cs_vNodesWake);
+                vNodesWakeCopy.swap(vNodesWake);
+            }
+            setNodesSendReady.insert(vNodesWakeCopy.begin(), vNodesWakeCopy.end());
+        }
+        else if (!vhListenSocket.empty() && ptr >= (void*)&vhListenSocket[0] && ptr <= (void*)&vhListenSocket.back())
+        {
+            AcceptConnection(*(SOCKET*)ptr);
+        }
+        else
+        {
+            CNode* pnode = (CNode*)ptr;
+            if (vEvents[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                setNodesRecvReady.insert(pnode);
+            if (vEvents[i].events & EPOLLOUT)
+                setNodesSendReady.insert(pnode);
+        }
+    }
+
+    // Retry the nodes whose buffers were held last time
+    setNodesRecvReady.insert(setNodesRecvLocked.begin(), setNodesRecvLocked.end());
+    setNodesRecvLocked.clear();
+    setNodesSendReady.insert(setNodesSendLocked.begin(), setNodesSendLocked.end());
+    setNodesSendLocked.clear();
+
+    vector<CNode*> vNodesReady(setNodesRecvReady.begin(), setNodesRecvReady.end());
+    BOOST_FOREACH(CNode* pnode, vNodesReady)
+    {
+        if (fShutdown)
+            return false;
+        bool fLockMissed = false;
+        if (pnode->hSocket == INVALID_SOCKET || !SocketRecvData(pnode, &fLockMissed))
+            setNodesRecvReady.erase(pnode);
+        else if (fLockMissed)
+        {
+            setNodesRecvReady.erase(pnode);
+            setNodesRecvLocked.insert(pnode);
+        }
+    }
+
+    vNodesReady.assign(setNodesSendReady.begin(), setNodesSendReady.end());
+    setNodesSendReady.clear();
+    BOOST_FOREACH(CNode* pnode, vNodesReady)
+    {
+        if (fShutdown)
+            return false;
+        if (pnode->hSocket == INVALID_SOCKET || !pnode->fPollAdded)
+            continue;
+        bool fLockMissed = false;
+        bool fPending = SocketSendData(pnode, &fLockMissed);
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (fLockMissed)
+        {
+            // Watching for writes would report the socket writable at once
+            setNodesSendLocked.insert(pnode);
+            continue;
+        }
+        if (fPending)
+            SetPollSend(pnode, true);
+        else if (pnode->fPollSend)
+            SetPollSend(pnode, false);
+    }
+
+    if (GetTime() != nLastInactivityCheck)
+    {
+        nLastInactivityCheck = GetTime();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            CheckInactivity(pnode);
+    }
+    return true;
+}
+#endif
+
+void WakeSocketHandler(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hWakeEvent == -1)
+        return;
+    {
+        LOCK(cs_vNodesWake);
+        vNodesWake.push_back(pnode);
+    }
+    uint64 nCount = 1;
+    if (write(hWakeEvent, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+        printf("WakeSocketHandler() : eventfd write error %d\n", errno);
+#endif
+}
+
+
 
 
 
@@ -1585,6 +2056,19 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static bool fMessageHandlerWake = false;
+
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        fMessageHandlerWake = true;
+    }
+    condMessageHandler.notify_one();
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
@@ -1599,17 +2083,33 @@ void ThreadMessageHandler2(void* parg)
                 pnode->AddRef();
         }
 
-        // Poll the connected nodes for messages
+        // Blocks and checkpoints from every node come first, so a node
+        // relaying a flood of transactions holds up nobody's blocks
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            TRY_LOCK(pnode->cs_vRecv, lockRecv);
+            if (lockRecv)
+                ProcessMessages(pnode, true);
+            if (fShutdown)
+                return;
+        }
+
+        // Then each node gets a quantum of time for the rest
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        bool fMoreMessages = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
+                {
                     ProcessMessages(pnode);
+                    if (pnode->HasCompleteMessage() && !pnode->fDisconnect && pnode->nSendSize < SendBufferSize())
+                        fMoreMessages = true;
+                }
             }
             if (fShutdown)
                 return;
@@ -1630,11 +2130,20 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Unless messages were left for the next pass, wait until a node
+        // has a whole message for us or room to send again, or for 100ms,
+        // for the periodic work of SendMessages.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(100);
+            while (!fMessageHandlerWake && !fMoreMessages && !fShutdown)
+                if (!condMessageHandler.timed_wait(lock, timeout))
+                    break;
+            fMessageHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1893,6 +2402,8 @@ bool StopNode()
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
+    ThreadBlockCheckQuit();
+    ThreadScriptCheckQuit();
     do
     {
         int nThreadsRunning = 0;
@@ -1917,6 +2428,8 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) printf("ThreadStakeMinter still running\n");
+    if (vnThreadsRunning[THREAD_BLOCKCHECK] > 0) printf("ThreadBlockCheck still running\n");
+    if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         MilliSleep(20);
     MilliSleep(50);
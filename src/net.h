@@ -9,6 +9,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -37,6 +38,8 @@ void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
 CNode* FindNode(const CService& ip);
 CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL, int64 nTimeout=0);
+void WakeSocketHandler(CNode* pnode);
+void WakeMessageHandler();
 void MapPort();
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
@@ -73,6 +76,7 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    MSG_COMPACT_BLOCK,
 };
 
 class CRequestTracker
@@ -94,6 +98,37 @@ public:
 };
 
 
+/** Bytes queued to be sent. They are never changed once queued, so the same
+ * bytes can be queued for any number of peers. pOwner keeps them alive,
+ * whether they are a stream of their own or part of a block file mapping.
+ */
+class CSendBuffer
+{
+public:
+    boost::shared_ptr<const void> pOwner;
+    const char* pbegin;
+    const char* pend;
+
+    CSendBuffer() : pbegin(NULL), pend(NULL)
+    {
+    }
+
+    CSendBuffer(const boost::shared_ptr<const void>& pOwnerIn, const char* pbeginIn, const char* pendIn) : pOwner(pOwnerIn), pbegin(pbeginIn), pend(pendIn)
+    {
+    }
+
+    // The whole of a stream that is not written to again
+    explicit CSendBuffer(const boost::shared_ptr<const CDataStream>& pss) : pOwner(pss), pbegin(pss->empty() ? NULL : &pss->begin()[0]), pend(pbegin + pss->size())
+    {
+    }
+
+    size_t size() const { return pend - pbegin; }
+};
+
+// A whole message, header and payload, ready to queue for any number of peers
+CSendBuffer CreateMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+
 /** Thread types */
 enum threadId
 {
@@ -108,6 +143,8 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_MINTER,
+    THREAD_BLOCKCHECK,
+    THREAD_SCRIPTCHECK,
 
     THREAD_MAX
 };
@@ -123,7 +160,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSendBuffer> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64> mapAlreadyAskedFor;
@@ -145,12 +182,42 @@ public:
     int64 nReleaseTime;
     int nStartingHeight;
     int nMisbehavior;
+    unsigned int nRecvQueueSize;
+    uint64 nSendSize;
+    uint64 nMessagesProcessed;
+    int64 nProcessTime;
 };
 
 
 
 
 
+/** A message as it is received: the header, then the payload in a buffer of
+ * its own. The socket thread fills in the message at the back of a node's
+ * receive queue; the message handler takes whole ones off the front.
+ */
+class CNetMessage
+{
+public:
+    char pchHeader[CMessageHeader::HEADER_SIZE];
+    unsigned int nHeaderPos;
+    CMessageHeader hdr;  // set once the header is complete
+    CDataStream vRecv;   // payload
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : nHeaderPos(0), vRecv(nTypeIn, nVersionIn), nDataPos(0)
+    {
+    }
+
+    bool InData() const { return nHeaderPos == CMessageHeader::HEADER_SIZE; }
+    bool Complete() const { return InData() && nDataPos == hdr.nMessageSize; }
+
+    // Each returns the number of bytes it used; ReadHeader returns false if
+    // the header is bad
+    bool ReadHeader(const char* pch, unsigned int nBytes, unsigned int& nUsedRet);
+    unsigned int ReadData(const char* pch, unsigned int nBytes);
+};
+
 /** Information about a peer */
 class CNode
 {
@@ -158,16 +225,22 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    boost::shared_ptr<CDataStream> pssSend;  // message between BeginMessage and EndMessage
+    int nSendVersion;
+    std::deque<CSendBuffer> vSendMsg;
+    size_t nSendOffset;  // bytes of the front of vSendMsg already sent
+    size_t nSendSize;    // bytes in vSendMsg left to send
+    std::deque<CNetMessage> vRecvMsg;
+    unsigned int nRecvQueueSize;  // header and payload bytes in vRecvMsg
+    int nRecvVersion;
+    uint64 nMessagesProcessed;
+    int64 nProcessTime;  // microseconds spent in ProcessMessages
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
     int64 nTimeConnected;
-    int nHeaderStart;
-    unsigned int nMessageStart;
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -179,6 +252,9 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fHeadersAsked;  // asked for headers by headers-first download
+    bool fPollAdded;  // socket thread only: socket registered for events
+    bool fPollSend;   // socket thread only: waiting for the socket to be writable
     CSemaphoreGrant grantOutbound;
 
 protected:
@@ -212,16 +288,21 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, INIT_PROTO_VERSION), vRecv(SER_NETWORK, INIT_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nSendVersion = INIT_PROTO_VERSION;
+        nSendOffset = 0;
+        nSendSize = 0;
+        nRecvQueueSize = 0;
+        nRecvVersion = INIT_PROTO_VERSION;
+        nMessagesProcessed = 0;
+        nProcessTime = 0;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
-        nHeaderStart = -1;
-        nMessageStart = -1;
         addr = addrIn;
         addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
         nVersion = 0;
@@ -232,6 +313,9 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fHeadersAsked = false;
+        fPollAdded = false;
+        fPollSend = false;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
@@ -282,6 +366,15 @@ public:
         nRefCount--;
     }
 
+    // Requires cs_vRecv. Returns true if a message was completed.
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+
+    // Requires cs_vRecv
+    bool HasCompleteMessage() const
+    {
+        return !vRecvMsg.empty() && vRecvMsg.front().Complete();
+    }
+
 
 
     void AddAddressKnown(const CAddress& addr)
@@ -338,25 +431,34 @@ public:
 
 
 
+    // Requires cs_vSend. Returns true if nothing was queued before.
+    bool QueueSend(const CSendBuffer& buf)
+    {
+        bool fWasEmpty = vSendMsg.empty();
+        if (buf.size() > 0)
+        {
+            vSendMsg.push_back(buf);
+            nSendSize += buf.size();
+        }
+        return fWasEmpty;
+    }
+
     void BeginMessage(const char* pszCommand)
     {
         ENTER_CRITICAL_SECTION(cs_vSend);
-        if (nHeaderStart != -1)
+        if (pssSend)
             AbortMessage();
-        nHeaderStart = vSend.size();
-        vSend << CMessageHeader(pszCommand, 0);
-        nMessageStart = vSend.size();
+        pssSend.reset(new CDataStream(SER_NETWORK, nSendVersion));
+        *pssSend << CMessageHeader(pszCommand, 0);
         if (fDebug)
             printf("sending: %s ", pszCommand);
     }
 
     void AbortMessage()
     {
-        if (nHeaderStart < 0)
+        if (!pssSend)
             return;
-        vSend.resize(nHeaderStart);
-        nHeaderStart = -1;
-        nMessageStart = -1;
+        pssSend.reset();
         LEAVE_CRITICAL_SECTION(cs_vSend);
 
         if (fDebug)
@@ -372,34 +474,40 @@ public:
             return;
         }
 
-        if (nHeaderStart < 0)
+        if (!pssSend)
             return;
+        CDataStream& ssSend = *pssSend;
+        assert(ssSend.size() >= CMessageHeader::HEADER_SIZE);
 
         // Set the size
-        unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
+        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
+        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
 
         // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
+        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
         if (fDebug) {
             printf("(%d bytes)\n", nSize);
         }
 
-        nHeaderStart = -1;
-        nMessageStart = -1;
+        // The stream is queued as it is; the next message gets a new one.
+        // The socket thread only watches nodes that have something to send.
+        bool fWasEmpty = QueueSend(CSendBuffer(boost::shared_ptr<const CDataStream>(pssSend)));
+        pssSend.reset();
         LEAVE_CRITICAL_SECTION(cs_vSend);
+
+        if (fWasEmpty)
+            WakeSocketHandler(this);
     }
 
     void EndMessageAbortIfEmpty()
     {
-        if (nHeaderStart < 0)
+        if (!pssSend)
             return;
-        int nSize = vSend.size() - nMessageStart;
+        int nSize = pssSend->size() - CMessageHeader::HEADER_SIZE;
         if (nSize > 0)
             EndMessage();
         else
@@ -425,13 +533,28 @@ public:
         }
     }
 
+    // Payload that is already serialized, queued without being copied
+    void PushMessageRaw(const char* pszCommand, const CSendBuffer& payload);
+
+    // A whole message from CreateMessage
+    void PushMessageShared(const CSendBuffer& msg)
+    {
+        bool fWasEmpty;
+        {
+            LOCK(cs_vSend);
+            fWasEmpty = QueueSend(msg);
+        }
+        if (fWasEmpty)
+            WakeSocketHandler(this);
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1;
+            *pssSend << a1;
             EndMessage();
         }
         catch (...)
@@ -447,7 +570,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2;
+            *pssSend << a1 << a2;
             EndMessage();
         }
         catch (...)
@@ -463,7 +586,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3;
+            *pssSend << a1 << a2 << a3;
             EndMessage();
         }
         catch (...)
@@ -479,7 +602,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4;
+            *pssSend << a1 << a2 << a3 << a4;
             EndMessage();
         }
         catch (...)
@@ -495,7 +618,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5;
+            *pssSend << a1 << a2 << a3 << a4 << a5;
             EndMessage();
         }
         catch (...)
@@ -511,7 +634,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6;
+            *pssSend << a1 << a2 << a3 << a4 << a5 << a6;
             EndMessage();
         }
         catch (...)
@@ -527,7 +650,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
+            *pssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
             EndMessage();
         }
         catch (...)
@@ -543,7 +666,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
+            *pssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
             EndMessage();
         }
         catch (...)
@@ -559,7 +682,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
+            *pssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
             EndMessage();
         }
         catch (...)
@@ -676,8 +799,9 @@ inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved.
+        // Every peer that asks for it is sent the same bytes.
+        mapRelay.insert(std::make_pair(inv, CreateMessage(inv.GetCommand(), ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -146,7 +146,7 @@ void TransactionRecord::updateStatus(const CWalletTx &wtx)
     // Determine transaction status
     // Find the block the tx is in
     CBlockIndex* pindex = NULL;
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
     if (mi != mapBlockIndex.end())
     {
         pindex = (*mi).second;
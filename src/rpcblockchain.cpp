@@ -120,7 +120,10 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
         result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
 
     result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
+    CBlockIndexStake stake;
+    if (!GetBlockIndexStake(blockindex, stake))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot read stake fields of block");
+    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? stake.hashProofOfStake.GetHex() : blockindex->GetBlockHash().GetHex()));
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", strprintf("%016"PRI64x, blockindex->nStakeModifier)));
     result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
@@ -173,6 +176,64 @@ Value getblockcount(const Array& params, bool fHelp)
 }
 
 
+Value getmemoryinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "Returns an object containing the memory used by the block index.");
+
+    Object obj;
+    {
+        LOCK(cs_main);
+        size_t nUsage = GetBlockIndexMemoryUsage();
+        obj.push_back(Pair("blockindexentries", (boost::uint64_t)mapBlockIndex.size()));
+        obj.push_back(Pair("blockindexbytes", (boost::uint64_t)nUsage));
+        obj.push_back(Pair("bytesperentry", (boost::uint64_t)(mapBlockIndex.empty() ? 0 : nUsage / mapBlockIndex.size())));
+        obj.push_back(Pair("sizeofblockindex", (boost::uint64_t)sizeof(CBlockIndex)));
+        obj.push_back(Pair("stakecacheentries", (boost::uint64_t)GetBlockIndexStakeCacheSize()));
+    }
+#ifndef WIN32
+    // Resident set size, where /proc is available
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file)
+    {
+        unsigned long nSize = 0, nResident = 0;
+        if (fscanf(file, "%lu %lu", &nSize, &nResident) == 2)
+            obj.push_back(Pair("residentbytes", (boost::uint64_t)nResident * sysconf(_SC_PAGESIZE)));
+        fclose(file);
+    }
+#endif
+    return obj;
+}
+
+
+template<typename V>
+static Object CacheInfoToJSON(const CLRUCache<pair<unsigned int, unsigned int>, V>& cache)
+{
+    Object obj;
+    obj.push_back(Pair("entries", (boost::uint64_t)cache.GetCount()));
+    obj.push_back(Pair("bytes", (boost::uint64_t)cache.GetBytes()));
+    obj.push_back(Pair("maxbytes", (boost::uint64_t)cache.GetMaxBytes()));
+    obj.push_back(Pair("hits", (boost::uint64_t)cache.GetHits()));
+    obj.push_back(Pair("misses", (boost::uint64_t)cache.GetMisses()));
+    return obj;
+}
+
+Value getblockcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "Returns the size and hit counts of the caches of blocks and transactions read from disk.");
+
+    Object obj;
+    obj.push_back(Pair("blocks", CacheInfoToJSON(cacheBlockRead)));
+    obj.push_back(Pair("transactions", CacheInfoToJSON(cacheTxRead)));
+    return obj;
+}
+
+
 Value getdifficulty(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -268,13 +329,7 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -62,6 +62,10 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("releasetime", (boost::int64_t)stats.nReleaseTime));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("recvqueue", (boost::uint64_t)stats.nRecvQueueSize));
+        obj.push_back(Pair("sendqueue", (boost::uint64_t)stats.nSendSize));
+        obj.push_back(Pair("processed", (boost::uint64_t)stats.nMessagesProcessed));
+        obj.push_back(Pair("processtime", (double)stats.nProcessTime / 1000000.0));
 
         ret.push_back(obj);
     }
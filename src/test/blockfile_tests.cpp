@@ -0,0 +1,123 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+// Objects read through a mapping are the ones written with stdio, and a
+// mapping sees the file grow but reads stop at its end
+BOOST_AUTO_TEST_CASE(blockfile_mapping)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / strprintf("test_jackpotcoin_blockfile_%08x", GetRandInt(0x7fffffff));
+
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(3);
+    tx.vout[1].nValue = 12345;
+    {
+        CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE((FILE*)fileout != NULL);
+        fileout << 1234567 << tx;
+    }
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+
+    boost::shared_ptr<CBlockFileMapping> pmap(new CBlockFileMapping());
+    BOOST_REQUIRE(pmap->Open(path));
+    BOOST_CHECK_EQUAL(pmap->size(), 4 + nTxSize);
+
+    CBlockFileReader reader(SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(reader.Open(pmap, 4));
+    CTransaction txRead;
+    reader >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    BOOST_CHECK(txRead.vout[1].nValue == 12345);
+
+    // Nothing left to read
+    BOOST_CHECK_THROW(reader >> txRead, std::ios_base::failure);
+    BOOST_CHECK(!reader.Open(pmap, pmap->size() + 1));
+
+    // Appended data is past the mapping, but the file size shows it
+    {
+        CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+        fileout << tx;
+    }
+    size_t nFileSize = 0;
+    BOOST_CHECK(pmap->GetFileSize(nFileSize));
+    BOOST_CHECK_EQUAL(nFileSize, 4 + 2 * nTxSize);
+    BOOST_CHECK(reader.Open(pmap, 4 + nTxSize));
+    BOOST_CHECK_THROW(reader >> txRead, std::ios_base::failure);
+
+    pmap.reset();
+    boost::filesystem::remove(path);
+}
+
+// Records are appended one after another, can be read back at once, and
+// appending carries on at the end after the file is closed
+BOOST_AUTO_TEST_CASE(blockfile_append)
+{
+    vector<char> vchRecord(1000);
+    for (unsigned int i = 0; i < vchRecord.size(); i++)
+        vchRecord[i] = (char)GetRandInt(256);
+
+    unsigned int nFile = 0, nPos = 0, nFile2 = 0, nPos2 = 0;
+    BOOST_REQUIRE(AppendBlockFile(&vchRecord[0], vchRecord.size(), nFile, nPos));
+    BOOST_REQUIRE(AppendBlockFile(&vchRecord[0], 10, nFile2, nPos2));
+    BOOST_CHECK_EQUAL(nFile2, nFile);
+    BOOST_CHECK_EQUAL(nPos2, nPos + vchRecord.size());
+
+    // The file ends where the data does, whatever space was reserved
+    boost::shared_ptr<CBlockFileMapping> pmap = GetBlockFileMapping(nFile, nPos2 + 10);
+    BOOST_REQUIRE(pmap);
+    BOOST_CHECK_EQUAL(pmap->size(), nPos2 + 10);
+    BOOST_CHECK(memcmp(pmap->begin() + nPos, &vchRecord[0], vchRecord.size()) == 0);
+    BOOST_CHECK(memcmp(pmap->begin() + nPos2, &vchRecord[0], 10) == 0);
+
+    SyncBlockFile();
+    CloseBlockFile();
+    BOOST_REQUIRE(AppendBlockFile(&vchRecord[0], vchRecord.size(), nFile2, nPos2));
+    BOOST_CHECK_EQUAL(nFile2, nFile);
+    BOOST_CHECK_EQUAL(nPos2, nPos + vchRecord.size() + 10);
+    CloseBlockFile();
+}
+
+// A reader opened on a block file keeps the mapping it was given until a
+// read runs past its end, and then sees what was appended since
+BOOST_AUTO_TEST_CASE(blockfile_reader_remap)
+{
+    CTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 12345;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << tx;
+
+    unsigned int nFile = 0, nPos = 0, nFile2 = 0, nPos2 = 0;
+    BOOST_REQUIRE(AppendBlockFile(&ss[0], ss.size(), nFile, nPos));
+    boost::shared_ptr<CBlockFileMapping> pmap = GetBlockFileMapping(nFile, nPos + ss.size());
+    BOOST_REQUIRE(pmap);
+    BOOST_CHECK_EQUAL(pmap->size(), nPos + ss.size());
+
+    BOOST_REQUIRE(AppendBlockFile(&ss[0], ss.size(), nFile2, nPos2));
+    BOOST_CHECK_EQUAL(nFile2, nFile);
+    BOOST_CHECK(GetBlockFileMapping(nFile, nPos2) == pmap);
+
+    CBlockFileReader reader(SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(reader.Open(nFile, nPos2));
+    CTransaction txRead;
+    reader >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    BOOST_CHECK(GetBlockFileMapping(nFile, 0)->size() == nPos2 + ss.size());
+    BOOST_CHECK_THROW(reader >> txRead, std::ios_base::failure);
+
+    // A reader on a given mapping never maps the file again
+    BOOST_REQUIRE(reader.Open(pmap, nPos));
+    reader >> txRead;
+    BOOST_CHECK_THROW(reader >> txRead, std::ios_base::failure);
+    CloseBlockFile();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,84 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "blockindexmap.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockindexmap_tests)
+
+// Same contents as a std::map through inserts, erases and table growth
+BOOST_AUTO_TEST_CASE(blockindexmap_random)
+{
+    CBlockIndexMap mapTest;
+    map<uint256, CBlockIndex*> mapExpected;
+    vector<uint256> vKeys;
+    for (int i = 0; i < 500; i++)
+        vKeys.push_back(GetRandHash());
+
+    for (int i = 0; i < 20000; i++)
+    {
+        const uint256& key = vKeys[GetRandInt(vKeys.size())];
+        CBlockIndex* pindex = (CBlockIndex*)(size_t)(i + 1);
+        int nAction = GetRandInt(3);
+        if (nAction == 0)
+        {
+            BOOST_CHECK_EQUAL(mapTest.erase(key), mapExpected.erase(key));
+        }
+        else if (nAction == 1)
+        {
+            pair<CBlockIndexMap::iterator, bool> ret = mapTest.insert(make_pair(key, pindex));
+            BOOST_CHECK_EQUAL(ret.second, mapExpected.insert(make_pair(key, pindex)).second);
+            BOOST_CHECK(ret.first->first == key);
+            BOOST_CHECK(ret.first->second == mapExpected[key]);
+        }
+        else
+        {
+            mapTest[key] = pindex;
+            mapExpected[key] = pindex;
+        }
+        BOOST_CHECK_EQUAL(mapTest.size(), mapExpected.size());
+    }
+
+    BOOST_FOREACH(const uint256& key, vKeys)
+    {
+        CBlockIndexMap::iterator mi = mapTest.find(key);
+        BOOST_CHECK_EQUAL(mi != mapTest.end(), mapExpected.count(key) > 0);
+        BOOST_CHECK_EQUAL(mapTest.count(key), mapExpected.count(key));
+        if (mi != mapTest.end())
+            BOOST_CHECK(mi->second == mapExpected[key]);
+    }
+
+    map<uint256, CBlockIndex*> mapIterated;
+    const CBlockIndexMap& mapConst = mapTest;
+    for (CBlockIndexMap::const_iterator mi = mapConst.begin(); mi != mapConst.end(); ++mi)
+        BOOST_CHECK(mapIterated.insert(*mi).second);
+    BOOST_CHECK(mapIterated == mapExpected);
+
+    mapTest.clear();
+    BOOST_CHECK(mapTest.empty());
+    BOOST_CHECK(mapTest.begin() == mapTest.end());
+    BOOST_CHECK(mapTest.find(vKeys[0]) == mapTest.end());
+}
+
+// Keys do not move when the table grows; CBlockIndex::phashBlock points
+// at them
+BOOST_AUTO_TEST_CASE(blockindexmap_stable_keys)
+{
+    CBlockIndexMap mapTest;
+    vector<const uint256*> vKeyPtrs;
+    for (int i = 0; i < 10000; i++)
+    {
+        CBlockIndexMap::iterator mi = mapTest.insert(make_pair(GetRandHash(), (CBlockIndex*)NULL)).first;
+        vKeyPtrs.push_back(&mi->first);
+    }
+    BOOST_FOREACH(const uint256* phash, vKeyPtrs)
+    {
+        CBlockIndexMap::iterator mi = mapTest.find(*phash);
+        BOOST_CHECK(mi != mapTest.end() && &mi->first == phash);
+    }
+    BOOST_CHECK(mapTest.GetMemoryUsage() > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,89 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+// Counts the checks that ran; fails when fOk is false
+class CCountCheck
+{
+public:
+    static boost::mutex mutex;
+    static int nRun;
+    bool fOk;
+    int nId;
+
+    CCountCheck(bool fOkIn = true, int nIdIn = -1) : fOk(fOkIn), nId(nIdIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nRun++;
+        return fOk;
+    }
+
+    void swap(CCountCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+        std::swap(nId, check.nId);
+    }
+};
+boost::mutex CCountCheck::mutex;
+int CCountCheck::nRun = 0;
+
+static bool RunChecks(CCheckQueue<CCountCheck>* pqueue, int nChecks, int nFail, int* pnFailedId = NULL)
+{
+    CCheckQueueControl<CCountCheck> control(pqueue);
+    vector<CCountCheck> vChecks;
+    for (int i = 0; i < nChecks; i++)
+        vChecks.push_back(CCountCheck(i != nFail, i));
+    control.Add(vChecks);
+    CCountCheck checkFailed;
+    bool fRet = control.Wait(&checkFailed);
+    if (pnFailedId)
+        *pnFailedId = checkFailed.nId;
+    return fRet;
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    CCheckQueue<CCountCheck> queue(8);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCountCheck>::Thread, &queue));
+
+    int pnChecks[] = { 0, 1, 7, 100, 1000 };
+    BOOST_FOREACH(int nChecks, pnChecks)
+    {
+        CCountCheck::nRun = 0;
+        int nFailedId;
+        BOOST_CHECK(RunChecks(&queue, nChecks, -1, &nFailedId));
+        BOOST_CHECK_EQUAL(CCountCheck::nRun, nChecks);
+        BOOST_CHECK_EQUAL(nFailedId, -1);
+
+        // A failure is reported with the check that failed, and does not
+        // stick to the next batch
+        if (nChecks > 0)
+        {
+            BOOST_CHECK(!RunChecks(&queue, nChecks, nChecks / 2, &nFailedId));
+            BOOST_CHECK_EQUAL(nFailedId, nChecks / 2);
+        }
+    }
+    BOOST_CHECK(RunChecks(&queue, 10, -1));
+
+    queue.Quit();
+    threads.join_all();
+}
+
+// Without a queue the control does nothing and reports success
+BOOST_AUTO_TEST_CASE(checkqueue_none)
+{
+    CCountCheck::nRun = 0;
+    BOOST_CHECK(RunChecks(NULL, 10, 0));
+    BOOST_CHECK_EQUAL(CCountCheck::nRun, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,66 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "cuckoocache.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+BOOST_AUTO_TEST_CASE(cuckoocache_empty)
+{
+    CCuckooCache cache;
+    uint256 key = GetRandHash();
+    cache.Insert(key);
+    BOOST_CHECK(!cache.Contains(key));
+    BOOST_CHECK_EQUAL(cache.Setup(sizeof(uint256) - 1), 0U);
+    cache.Insert(key);
+    BOOST_CHECK(!cache.Contains(key));
+}
+
+// Up to about half full nothing is lost
+BOOST_AUTO_TEST_CASE(cuckoocache_insert)
+{
+    CCuckooCache cache;
+    size_t nSize = cache.Setup(1 << 16);
+    BOOST_CHECK_EQUAL(nSize, (size_t)(1 << 16) / sizeof(uint256));
+
+    vector<uint256> vKeys;
+    for (size_t i = 0; i < nSize / 2; i++)
+        vKeys.push_back(GetRandHash());
+    BOOST_FOREACH(const uint256& key, vKeys)
+        cache.Insert(key);
+    BOOST_FOREACH(const uint256& key, vKeys)
+        BOOST_CHECK(cache.Contains(key));
+    BOOST_CHECK(!cache.Contains(GetRandHash()));
+
+    // Setup() discards the contents
+    cache.Setup(1 << 16);
+    BOOST_CHECK(!cache.Contains(vKeys[0]));
+}
+
+// When overfilled the table keeps working and holds mostly recent keys
+BOOST_AUTO_TEST_CASE(cuckoocache_overfill)
+{
+    CCuckooCache cache;
+    size_t nSize = cache.Setup(1 << 14);
+
+    vector<uint256> vKeys;
+    for (size_t i = 0; i < nSize * 4; i++)
+    {
+        vKeys.push_back(GetRandHash());
+        cache.Insert(vKeys.back());
+    }
+
+    size_t nOld = 0, nNew = 0;
+    for (size_t i = 0; i < nSize; i++)
+    {
+        nOld += cache.Contains(vKeys[i]);
+        nNew += cache.Contains(vKeys[vKeys.size() - 1 - i]);
+    }
+    BOOST_CHECK(nNew > nOld);
+    BOOST_CHECK(nNew > nSize / 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
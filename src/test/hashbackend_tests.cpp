@@ -0,0 +1,71 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "hashbackend.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hashbackend_tests)
+
+// sph digests of the bytes 0, 1, ..., 63, in HASH_* order
+static const char* pszKnownAnswers[HASH_ALGO_COUNT] =
+{
+    "4d47291b807750d2ce6ced17ae71dc24f5a3205f4fe309537488242c4420cd32d997beda4d560200cbcf3e9d68143e69f08c54b82ce77db7c22d0e17b5a1363e",
+    "6e8c9b90e36cea68c029a7d8b95b718c84205d81be227ba61510f567d46b83edd11f301bf1e7041be991b22fdbee82dbdce7ab0e0ee42a795ca965a439532a39",
+    "483560d10cadec86db6f390f6267e12f99594587d44c202902e8e4bb6c70c6c7fdff6b19965650e15e240bcfcefe4e5051567ef96c758b800efdcaf50a5d5bbd",
+    "78cfdbdb2bd125f49d26146e208ebc7ceae57619bd68a2e4e9cdb1db198c995e3795fadbccaabb000463525eee2e1e7f6e8309c765a61e19fccdb18f5284c070",
+};
+
+BOOST_AUTO_TEST_CASE(hashbackend_known_answers)
+{
+    unsigned char pchIn[64];
+    for (int i = 0; i < 64; i++)
+        pchIn[i] = i;
+
+    int nCount;
+    const CHashKernel* pKernels = GetHashKernels(nCount);
+    for (int i = 0; i < nCount; i++)
+    {
+        if (!pKernels[i].pfnSupported())
+            continue;
+        vector<unsigned char> vchOut(64);
+        pKernels[i].pfn(pchIn, &vchOut[0]);
+        BOOST_CHECK_MESSAGE(HexStr(vchOut) == pszKnownAnswers[pKernels[i].nAlgo],
+                            GetHashAlgoName(pKernels[i].nAlgo) << " " << pKernels[i].pszName);
+    }
+
+    string strError;
+    BOOST_CHECK_MESSAGE(HashBackendSelfTest(strError), strError);
+}
+
+// The round chains give the same result whichever kernels are selected
+BOOST_AUTO_TEST_CASE(hashbackend_round_chain)
+{
+    vector<uint512> vHash;
+    for (int i = 0; i < 32; i++)
+    {
+        uint512 hash;
+        for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+            *p = GetRandInt(256);
+        vHash.push_back(hash);
+    }
+
+    SelectHashBackends(false);
+    for (int nAlgo = 0; nAlgo < HASH_ALGO_COUNT; nAlgo++)
+        BOOST_CHECK_EQUAL(string(GetHashBackendName(nAlgo)), "sph");
+    vector<uint256> vV1, vV2;
+    BOOST_FOREACH(const uint512& hash, vHash)
+    {
+        vV1.push_back(HashSHA3V1Rounds(hash, 63));
+        vV2.push_back(HashSHA3V2Rounds(hash));
+    }
+
+    SelectHashBackends(true);
+    for (unsigned int i = 0; i < vHash.size(); i++)
+    {
+        BOOST_CHECK(HashSHA3V1Rounds(vHash[i], 63) == vV1[i]);
+        BOOST_CHECK(HashSHA3V2Rounds(vHash[i]) == vV2[i]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,159 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+#include "kvstore.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kvstore_tests)
+
+static boost::filesystem::path GetTestDir()
+{
+    return boost::filesystem::temp_directory_path() / strprintf("test_jackpotcoin_kvstore_%08x", GetRandInt(0x7fffffff));
+}
+
+// Contents of the store, by iterating over it
+static map<string, string> ReadAll(CKVReader& reader)
+{
+    map<string, string> mapRet;
+    CKVIterator* pit = reader.NewIterator();
+    for (pit->SeekToFirst(); pit->Valid(); pit->Next())
+        mapRet[pit->GetKey()] = pit->GetValue();
+    delete pit;
+    return mapRet;
+}
+
+BOOST_AUTO_TEST_CASE(kvstore_batch)
+{
+    boost::filesystem::path pathDir = GetTestDir();
+    {
+        CLogKVStore store;
+        BOOST_CHECK(store.Open(pathDir));
+
+        CKVBatch batch;
+        batch.Write(string("a"), 1);
+        batch.Write(string("b"), 2);
+        batch.Write(string("c"), 3);
+        batch.Erase(string("c"));
+        BOOST_CHECK(store.WriteBatch(batch, true));
+
+        int n = 0;
+        BOOST_CHECK(store.Read(string("a"), n) && n == 1);
+        BOOST_CHECK(store.Read(string("b"), n) && n == 2);
+        BOOST_CHECK(!store.Exists(string("c")));
+
+        batch.Clear();
+        batch.Erase(string("a"));
+        batch.Write(string("b"), 20);
+        BOOST_CHECK(store.WriteBatch(batch, false));
+        BOOST_CHECK(!store.Exists(string("a")));
+        BOOST_CHECK(store.Read(string("b"), n) && n == 20);
+
+        // Iteration is in key order and starts at the given key
+        batch.Clear();
+        batch.Write(make_pair(string("x"), 2), 0);
+        batch.Write(make_pair(string("x"), 1), 0);
+        batch.Write(make_pair(string("y"), 0), 0);
+        BOOST_CHECK(store.WriteBatch(batch, false));
+        CKVIterator* pit = store.NewIterator();
+        pit->Seek(KVSerialize(make_pair(string("x"), 0)));
+        vector<int> vFound;
+        for (; pit->Valid(); pit->Next())
+        {
+            pair<string, int> key;
+            BOOST_CHECK(KVUnserialize(pit->GetKey(), key));
+            vFound.push_back(key.second);
+        }
+        delete pit;
+        BOOST_CHECK(vFound.size() == 3 && vFound[0] == 1 && vFound[1] == 2 && vFound[2] == 0);
+    }
+    boost::filesystem::remove_all(pathDir);
+}
+
+// Segments written and merged, and the log, are found again on reopening
+BOOST_AUTO_TEST_CASE(kvstore_reopen)
+{
+    boost::filesystem::path pathDir = GetTestDir();
+    map<string, string> mapExpected;
+    {
+        CLogKVStore store(4096);
+        BOOST_CHECK(store.Open(pathDir));
+        for (int i = 0; i < 2000; i++)
+        {
+            CKVBatch batch;
+            string strKey = KVSerialize(GetRandInt(500));
+            if (i % 3 == 0)
+            {
+                batch.EraseRaw(strKey);
+                mapExpected.erase(strKey);
+            }
+            else
+            {
+                string strValue = KVSerialize(i);
+                batch.WriteRaw(strKey, strValue);
+                mapExpected[strKey] = strValue;
+            }
+            BOOST_CHECK(store.WriteBatch(batch, false));
+        }
+        store.WaitForMerges();
+        BOOST_CHECK(store.GetSegmentCount() > 0);
+        BOOST_CHECK(store.GetSegmentCount() < 20);
+        BOOST_CHECK(ReadAll(store) == mapExpected);
+    }
+    {
+        CLogKVStore store(4096);
+        BOOST_CHECK(store.Open(pathDir));
+        BOOST_CHECK(ReadAll(store) == mapExpected);
+        for (int i = 0; i < 500; i++)
+        {
+            string strKey = KVSerialize(i);
+            string strValue;
+            BOOST_CHECK_EQUAL(store.ReadRaw(strKey, strValue), mapExpected.count(strKey) > 0);
+            if (mapExpected.count(strKey))
+                BOOST_CHECK(strValue == mapExpected[strKey]);
+        }
+    }
+    boost::filesystem::remove_all(pathDir);
+}
+
+// A snapshot does not see later writes, even once they reach a segment
+BOOST_AUTO_TEST_CASE(kvstore_snapshot)
+{
+    boost::filesystem::path pathDir = GetTestDir();
+    {
+        CLogKVStore store;
+        BOOST_CHECK(store.Open(pathDir));
+        CKVBatch batch;
+        batch.Write(string("a"), 1);
+        batch.Write(string("b"), 1);
+        BOOST_CHECK(store.WriteBatch(batch, false));
+
+        CKVReader* psnapshot = store.NewSnapshot();
+        map<string, string> mapBefore = ReadAll(store);
+
+        batch.Clear();
+        batch.Write(string("a"), 2);
+        batch.Erase(string("b"));
+        batch.Write(string("c"), 2);
+        BOOST_CHECK(store.WriteBatch(batch, false));
+
+        int n = 0;
+        BOOST_CHECK(psnapshot->Read(string("a"), n) && n == 1);
+        BOOST_CHECK(psnapshot->Exists(string("b")));
+        BOOST_CHECK(!psnapshot->Exists(string("c")));
+        BOOST_CHECK(store.Read(string("a"), n) && n == 2);
+
+        BOOST_CHECK(store.Flush());
+        BOOST_CHECK(psnapshot->Read(string("a"), n) && n == 1);
+        BOOST_CHECK(ReadAll(*psnapshot) == mapBefore);
+        delete psnapshot;
+
+        BOOST_CHECK(!store.Exists(string("b")));
+        BOOST_CHECK_EQUAL(ReadAll(store).size(), 2U);
+    }
+    boost::filesystem::remove_all(pathDir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
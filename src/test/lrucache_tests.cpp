@@ -0,0 +1,84 @@
+#include <boost/test/unit_test.hpp>
+
+#include "lrucache.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(lrucache_tests)
+
+typedef CLRUCache<pair<unsigned int, unsigned int>, string> CStringCache;
+
+static CStringCache::ValuePtr MakeValue(const string& str)
+{
+    return CStringCache::ValuePtr(new string(str));
+}
+
+BOOST_AUTO_TEST_CASE(lrucache_get)
+{
+    CStringCache cache(1 << 20);
+    CStringCache::ValuePtr pvalue;
+    BOOST_CHECK(!cache.Get(make_pair(1U, 0U), pvalue));
+    cache.Insert(make_pair(1U, 0U), MakeValue("a"), 1);
+    cache.Insert(make_pair(1U, 8U), MakeValue("b"), 1);
+    BOOST_CHECK(cache.Get(make_pair(1U, 0U), pvalue));
+    BOOST_CHECK_EQUAL(*pvalue, "a");
+    BOOST_CHECK(cache.Get(make_pair(1U, 8U), pvalue));
+    BOOST_CHECK_EQUAL(*pvalue, "b");
+    BOOST_CHECK(!cache.Get(make_pair(2U, 0U), pvalue));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 2U);
+    BOOST_CHECK_EQUAL(cache.GetHits(), 2U);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 2U);
+
+    // Inserting again replaces the value without counting it twice
+    size_t nBytes = cache.GetBytes();
+    cache.Insert(make_pair(1U, 0U), MakeValue("c"), 1);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), nBytes);
+    BOOST_CHECK(cache.Get(make_pair(1U, 0U), pvalue));
+    BOOST_CHECK_EQUAL(*pvalue, "c");
+
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.GetCount(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 0U);
+    BOOST_CHECK(!cache.Get(make_pair(1U, 0U), pvalue));
+}
+
+BOOST_AUTO_TEST_CASE(lrucache_evict)
+{
+    CStringCache cache(1 << 20);
+    cache.Insert(make_pair(0U, 0U), MakeValue("x"), 1000);
+    size_t nEntryBytes = cache.GetBytes();
+    cache.Clear();
+
+    // Room for ten entries
+    cache.SetMaxBytes(nEntryBytes * 10);
+    for (unsigned int i = 0; i < 10; i++)
+        cache.Insert(make_pair(1U, i), MakeValue(strprintf("%u", i)), 1000);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 10U);
+
+    // Use the three oldest entries, so the fourth is dropped first
+    CStringCache::ValuePtr pvalue, pvalueHeld;
+    BOOST_CHECK(cache.Get(make_pair(1U, 0U), pvalue));
+    BOOST_CHECK(cache.Get(make_pair(1U, 1U), pvalueHeld));
+    BOOST_CHECK(cache.Get(make_pair(1U, 0U), pvalue));
+    BOOST_CHECK(cache.Get(make_pair(1U, 2U), pvalue));
+    cache.Insert(make_pair(1U, 10U), MakeValue("10"), 1000);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 10U);
+    BOOST_CHECK(cache.GetBytes() <= cache.GetMaxBytes());
+    BOOST_CHECK(!cache.Get(make_pair(1U, 3U), pvalue));
+    BOOST_CHECK(cache.Get(make_pair(1U, 0U), pvalue));
+    BOOST_CHECK(cache.Get(make_pair(1U, 10U), pvalue));
+
+    // A value handed out outlives its entry
+    cache.SetMaxBytes(nEntryBytes);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1U);
+    BOOST_CHECK(!cache.Get(make_pair(1U, 1U), pvalue));
+    BOOST_CHECK_EQUAL(*pvalueHeld, "1");
+
+    // A value bigger than the whole budget is not kept
+    cache.Insert(make_pair(2U, 0U), MakeValue("big"), nEntryBytes * 2);
+    BOOST_CHECK(!cache.Get(make_pair(2U, 0U), pvalue));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
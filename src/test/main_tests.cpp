@@ -0,0 +1,712 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "net.h"
+
+using namespace std;
+
+// Tests these internal-to-main.cpp methods:
+extern bool ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
+extern void RequestStalePartialBlocks(CNode* pto);
+extern void ProcessHeaders(CNode* pfrom, const std::vector<CBlock>& vHeaders);
+extern void ProcessDownloadedBlocks();
+extern void RequestBlocks(CNode* pto);
+extern void TruncateHeaderChain(unsigned int nKeep);
+extern std::deque<uint256> vHeaderChain;
+extern std::map<uint256, CBlock*> mapBlocksDownloaded;
+extern unsigned int nBlocksDownloadedSize;
+extern CNode* pnodeHeaderSync;
+
+BOOST_AUTO_TEST_SUITE(main_tests)
+
+// Build a synthetic chain with a random PoW/PoS pattern and a super block
+// every nSuperInterval blocks, filling the counters the way AddToBlockIndex does.
+static void BuildChain(vector<CBlockIndex>& vChain, int nLength, int nSuperInterval)
+{
+    vChain.resize(nLength);
+    unsigned int nSuperBlock = 0;
+    for (int i = 0; i < nLength; i++)
+    {
+        CBlockIndex& index = vChain[i];
+        index.nHeight = i;
+        index.pprev = (i > 0 ? &vChain[i-1] : NULL);
+        if (i > 0 && GetRandInt(3) != 0)
+            index.SetProofOfStake();
+        if (i > 0 && i % nSuperInterval == 0)
+            nSuperBlock = i;
+        index.nSuperBlock = nSuperBlock;
+        SetPowCounters(&index);
+    }
+}
+
+static int CountPow(const vector<CBlockIndex>& vChain, int nFrom, int nTo)
+{
+    int nCount = 0;
+    for (int i = max(nFrom, 0); i <= nTo; i++)
+        if (vChain[i].IsProofOfWork())
+            nCount++;
+    return nCount;
+}
+
+BOOST_AUTO_TEST_CASE(pow_height)
+{
+    vector<CBlockIndex> vChain;
+    BuildChain(vChain, 1000, 97);
+
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK_EQUAL(GetPowHeight(&vChain[i]), CountPow(vChain, 0, i));
+}
+
+BOOST_AUTO_TEST_CASE(pow_height_checkpoint)
+{
+    // Past the first PoW checkpoint the count is anchored to the checkpoint value
+    vector<CBlockIndex> vChain;
+    BuildChain(vChain, 25100, 1000);
+
+    BOOST_CHECK_EQUAL(GetPowHeight(&vChain[25000]), CountPow(vChain, 0, 25000));
+    for (int i = 25001; i < 25100; i++)
+        BOOST_CHECK_EQUAL(GetPowHeight(&vChain[i]), 5587 + CountPow(vChain, 25001, i));
+}
+
+BOOST_AUTO_TEST_CASE(pow_delta)
+{
+    vector<CBlockIndex> vChain;
+    BuildChain(vChain, 1000, 97);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        const CBlockIndex* pindex = &vChain[i];
+
+        // counters of the block's own super block
+        BOOST_CHECK_EQUAL(CountPowDelta(pindex, pindex->nSuperBlock), CountPow(vChain, pindex->nSuperBlock, i));
+
+        // arbitrary super block heights fall back to walking the chain
+        int nSuperBlock = GetRandInt(1100);
+        int nExpected = (nSuperBlock > i ? 0 : CountPow(vChain, nSuperBlock, i));
+        BOOST_CHECK_EQUAL(CountPowDelta(pindex, nSuperBlock), nExpected);
+    }
+}
+
+// Moving the tip to another branch rewrites the chain from the fork up
+BOOST_AUTO_TEST_CASE(chain_settip)
+{
+    vector<CBlockIndex> vMain(100), vFork(30);
+    for (int i = 0; i < 100; i++)
+    {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = (i > 0 ? &vMain[i-1] : NULL);
+    }
+    for (int i = 0; i < 30; i++)
+    {
+        vFork[i].nHeight = 60 + i;
+        vFork[i].pprev = (i > 0 ? &vFork[i-1] : &vMain[59]);
+    }
+
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    chain.SetTip(&vMain[99]);
+    BOOST_CHECK_EQUAL(chain.Height(), 99);
+    BOOST_CHECK(chain[42] == &vMain[42]);
+    BOOST_CHECK(chain[100] == NULL && chain[-1] == NULL);
+    BOOST_CHECK(chain.Contains(&vMain[70]));
+
+    chain.SetTip(&vFork[29]);
+    BOOST_CHECK_EQUAL(chain.Height(), 89);
+    BOOST_CHECK(chain.Tip() == &vFork[29]);
+    BOOST_CHECK(chain[59] == &vMain[59]);
+    BOOST_CHECK(chain[60] == &vFork[0]);
+    BOOST_CHECK(!chain.Contains(&vMain[70]));
+    BOOST_CHECK(!chain.Contains(&vMain[95]));
+
+    chain.SetTip(&vMain[80]);
+    BOOST_CHECK(chain.Tip() == &vMain[80]);
+    BOOST_CHECK(chain.Contains(&vMain[70]));
+    BOOST_CHECK(!chain.Contains(&vFork[0]));
+}
+
+// Blocks are served to peers straight from the block files, which only works
+// while the disk and network serializations are the same
+BOOST_AUTO_TEST_CASE(block_disk_network_serialization)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 12345;
+    block.hashPrevBlock = GetRandHash();
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 50 * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(tx);
+    block.vchBlockSig.assign(72, 0x30);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CDataStream ssDisk(SER_DISK, CLIENT_VERSION);
+    CDataStream ssNetwork(SER_NETWORK, PROTOCOL_VERSION);
+    ssDisk << block;
+    ssNetwork << block;
+    BOOST_CHECK(ssDisk.str() == ssNetwork.str());
+    BOOST_CHECK_EQUAL(ssDisk.size(), ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+
+    CBlock blockRead;
+    ssNetwork >> blockRead;
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockRead.vtx.size(), 1U);
+}
+
+// Hash of a copy of the header, which has nothing cached
+static uint256 FreshBlockHash(const CBlock& block)
+{
+    CBlock blockFresh;
+    blockFresh.nVersion = block.nVersion;
+    blockFresh.hashPrevBlock = block.hashPrevBlock;
+    blockFresh.hashMerkleRoot = block.hashMerkleRoot;
+    blockFresh.nTime = block.nTime;
+    blockFresh.nBits = block.nBits;
+    blockFresh.nNonce = block.nNonce;
+    blockFresh.nSuperBlock = block.nSuperBlock;
+    blockFresh.nRoundMask = block.nRoundMask;
+    return blockFresh.GetHash();
+}
+
+static void SetDiskBlockIndexHeader(CDiskBlockIndex& diskindex, const CBlock& block)
+{
+    diskindex.nVersion = block.nVersion;
+    diskindex.hashPrev = block.hashPrevBlock;
+    diskindex.hashMerkleRoot = block.hashMerkleRoot;
+    diskindex.nTime = block.nTime;
+    diskindex.nBits = block.nBits;
+    diskindex.nNonce = block.nNonce;
+    diskindex.nSuperBlock = block.nSuperBlock;
+    diskindex.nRoundMask = block.nRoundMask;
+}
+
+// The cached block hash follows every change to the header, and a block
+// index entry read from disk does not keep the hash of the one before
+BOOST_AUTO_TEST_CASE(block_hash_cache)
+{
+    CBlock block;
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0fffff;
+    block.nRoundMask = 7;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+
+    uint256 hash = block.GetHash();
+    BOOST_CHECK(hash == FreshBlockHash(block));
+    BOOST_CHECK(block.GetHash() == hash);
+
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != hash);
+    BOOST_CHECK(block.GetHash() == FreshBlockHash(block));
+    block.hashMerkleRoot = GetRandHash();
+    BOOST_CHECK(block.GetHash() == FreshBlockHash(block));
+    block.nRoundMask = 8;
+    BOOST_CHECK(block.GetHash() == FreshBlockHash(block));
+    block.nTime++;
+    BOOST_CHECK(block.GetHash() == FreshBlockHash(block));
+
+    CDiskBlockIndex diskindex;
+    SetDiskBlockIndexHeader(diskindex, block);
+    BOOST_CHECK(diskindex.GetBlockHash() == block.GetHash());
+
+    block.nNonce++;
+    CDiskBlockIndex diskindexNext;
+    SetDiskBlockIndexHeader(diskindexNext, block);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << diskindexNext;
+    ss >> diskindex;
+    BOOST_CHECK(diskindex.GetBlockHash() == block.GetHash());
+}
+
+// A block of a coinbase and four other transactions
+static CBlock BuildCompactTestBlock()
+{
+    CBlock block;
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0fffff;
+    block.hashPrevBlock = GetRandHash();
+    block.vtx.resize(5);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    block.vtx[0].vout.resize(1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout = COutPoint(GetRandHash(), i);
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].nValue = i * COIN;
+    }
+    block.vchBlockSig.assign(72, 0x30);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// A compact block is rebuilt from the transactions at hand, and the ones
+// missing are the ones asked for
+BOOST_AUTO_TEST_CASE(compact_block_fill)
+{
+    CBlock block = BuildCompactTestBlock();
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CCompactBlock(block);
+    CCompactBlock cmpctblock;
+    ss >> cmpctblock;
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortIds.size(), 4U);
+
+    // All but the third transaction, and one that is not in the block
+    map<uint256, CTransaction> mapTx;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (i != 3)
+            mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+    CTransaction txOther = block.vtx[3];
+    txOther.nLockTime = 1;
+    mapTx[txOther.GetHash()] = txOther;
+
+    // Precheck results of the header do not carry over to the new transactions
+    cmpctblock.header.fPrecheckedMerkleRoot = true;
+    cmpctblock.header.fPrecheckedSignature = true;
+
+    CBlock blockRebuilt;
+    vector<unsigned int> vMissing;
+    BOOST_CHECK(cmpctblock.FillBlock(blockRebuilt, mapTx, vMissing));
+    BOOST_CHECK(!blockRebuilt.fPrecheckedMerkleRoot);
+    BOOST_CHECK(!blockRebuilt.fPrecheckedSignature);
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 3U);
+    BOOST_CHECK(blockRebuilt.vtx[3].IsNull());
+
+    blockRebuilt.vtx[3] = block.vtx[3];
+    BOOST_CHECK(blockRebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(blockRebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+    BOOST_CHECK(blockRebuilt.vchBlockSig == block.vchBlockSig);
+
+    // Transactions that share a short ID are not told apart
+    cmpctblock.vShortIds[1] = cmpctblock.vShortIds[0];
+    BOOST_CHECK(!cmpctblock.FillBlock(blockRebuilt, mapTx, vMissing));
+}
+
+// A connected peer that has the whole chain, and that has been asked for
+// headers already
+static CNode* NewDownloadPeer(unsigned int n)
+{
+    struct in_addr s;
+    s.s_addr = htonl(0x01020300 + n);
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService(CNetAddr(s), GetDefaultPort())), "", true);
+    pnode->fSuccessfullyConnected = true;
+    pnode->nVersion = PROTOCOL_VERSION;
+    pnode->nStartingHeight = 100000;
+    pnode->fHeadersAsked = true;
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+    return pnode;
+}
+
+static void DeleteDownloadPeers(vector<CNode*>& vPeers)
+{
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vPeers)
+    {
+        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+        delete pnode;
+    }
+    vPeers.clear();
+}
+
+// Headers of blocks that follow hashPrev, a second apart
+static vector<CBlock> BuildHeaders(const uint256& hashPrev, unsigned int nTime, int nCount)
+{
+    vector<CBlock> vHeaders(nCount);
+    for (int i = 0; i < nCount; i++)
+    {
+        CBlock& header = vHeaders[i];
+        header.hashPrevBlock = (i > 0 ? vHeaders[i-1].GetHash() : hashPrev);
+        header.hashMerkleRoot = GetRandHash();
+        header.nTime = nTime + i;
+        header.nBits = 0x1e0fffff;
+    }
+    return vHeaders;
+}
+
+// The blocks asked of a peer since the last call
+static vector<uint256> TakeRequestedBlocks(CNode* pnode)
+{
+    vector<uint256> vHashes;
+    LOCK(pnode->cs_vSend);
+    BOOST_FOREACH(const CSendBuffer& buf, pnode->vSendMsg)
+    {
+        CDataStream ss(buf.pbegin, buf.pend, SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr;
+        ss >> hdr;
+        if (hdr.GetCommand() != "getdata")
+            continue;
+        vector<CInv> vInv;
+        ss >> vInv;
+        BOOST_FOREACH(const CInv& inv, vInv)
+            vHashes.push_back(inv.hash);
+    }
+    pnode->vSendMsg.clear();
+    pnode->nSendSize = 0;
+    return vHashes;
+}
+
+// Whether a message was sent to a peer since the last call
+static bool TakeSentCommand(CNode* pnode, const string& strCommand)
+{
+    bool fSent = false;
+    LOCK(pnode->cs_vSend);
+    BOOST_FOREACH(const CSendBuffer& buf, pnode->vSendMsg)
+    {
+        CDataStream ss(buf.pbegin, buf.pend, SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr;
+        ss >> hdr;
+        if (hdr.GetCommand() == strCommand)
+            fSent = true;
+    }
+    pnode->vSendMsg.clear();
+    pnode->nSendSize = 0;
+    return fSent;
+}
+
+// Stands for a block that got into the index by some other way
+static CBlockIndex* AddFakeBlockIndex(const uint256& hash, int nHeight)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->nHeight = nHeight;
+    CBlockIndexMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindex)).first;
+    pindex->phashBlock = &((*mi).first);
+    return pindex;
+}
+
+static void RemoveFakeBlockIndex(CBlockIndex* pindex)
+{
+    mapBlockIndex.erase(pindex->GetBlockHash());
+    delete pindex;
+}
+
+static void AddDownloadedBlock(const CBlock& block)
+{
+    mapBlocksDownloaded[block.GetHash()] = new CBlock(block);
+    nBlocksDownloadedSize += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+}
+
+static void ResetBlockDownload()
+{
+    TruncateHeaderChain(0);
+    pnodeHeaderSync = NULL;
+    SetMockTime(0);
+    mapArgs.erase("-banscore");
+    CNode::ClearBanned();
+}
+
+BOOST_AUTO_TEST_CASE(headers_first_connect)
+{
+    CNode::ClearBanned();
+    vector<CNode*> vPeers;
+    CNode* pnodeSync = NewDownloadPeer(1);
+    CNode* pnodeOther = NewDownloadPeer(2);
+    vPeers.push_back(pnodeSync);
+    vPeers.push_back(pnodeOther);
+    unsigned int nTime = pindexGenesisBlock->nTime + 60;
+    vector<CBlock> vHeaders = BuildHeaders(pindexGenesisBlock->GetBlockHash(), nTime, 10);
+
+    // Headers are only taken from the peer they were asked of
+    pnodeHeaderSync = pnodeSync;
+    ProcessHeaders(pnodeOther, vHeaders);
+    BOOST_CHECK(vHeaderChain.empty());
+    BOOST_CHECK(pnodeHeaderSync == pnodeSync);
+
+    // The second message joins the end of the first
+    ProcessHeaders(pnodeSync, vector<CBlock>(vHeaders.begin(), vHeaders.begin() + 6));
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 6U);
+    BOOST_CHECK(pnodeHeaderSync == NULL);
+    pnodeHeaderSync = pnodeSync;
+    ProcessHeaders(pnodeSync, vector<CBlock>(vHeaders.begin() + 6, vHeaders.end()));
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 10U);
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        BOOST_CHECK(vHeaderChain[i] == vHeaders[i].GetHash());
+
+    // A branch off the header chain replaces it only once it is longer
+    vector<CBlock> vBranch = BuildHeaders(vHeaders[4].GetHash(), nTime + 30, 8);
+    pnodeHeaderSync = pnodeSync;
+    ProcessHeaders(pnodeSync, vector<CBlock>(vBranch.begin(), vBranch.begin() + 5));
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 10U);
+    BOOST_CHECK(vHeaderChain.back() == vHeaders[9].GetHash());
+    pnodeHeaderSync = pnodeSync;
+    ProcessHeaders(pnodeSync, vBranch);
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 13U);
+    BOOST_CHECK(vHeaderChain[4] == vHeaders[4].GetHash());
+    BOOST_CHECK(vHeaderChain[5] == vBranch[0].GetHash());
+    BOOST_CHECK(vHeaderChain.back() == vBranch.back().GetHash());
+
+    // Headers that do not connect are only dropped
+    mapArgs["-banscore"] = "20";
+    pnodeHeaderSync = pnodeSync;
+    ProcessHeaders(pnodeSync, BuildHeaders(GetRandHash(), nTime, 3));
+    BOOST_CHECK(!CNode::IsBanned(pnodeSync->addr));
+
+    // Headers that do not link up are misbehaving
+    vector<CBlock> vBad = BuildHeaders(vBranch.back().GetHash(), nTime + 60, 3);
+    vBad[2].hashPrevBlock = vBad[0].GetHash();
+    pnodeHeaderSync = pnodeSync;
+    ProcessHeaders(pnodeSync, vBad);
+    BOOST_CHECK(CNode::IsBanned(pnodeSync->addr));
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 13U);
+
+    // And more so with a target out of range
+    mapArgs["-banscore"] = "50";
+    vBad = BuildHeaders(vBranch.back().GetHash(), nTime + 60, 3);
+    vBad[1].nBits = 0x1f0fffff;
+    pnodeHeaderSync = pnodeOther;
+    ProcessHeaders(pnodeOther, vBad);
+    BOOST_CHECK(CNode::IsBanned(pnodeOther->addr));
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 13U);
+
+    ResetBlockDownload();
+    DeleteDownloadPeers(vPeers);
+}
+
+BOOST_AUTO_TEST_CASE(headers_first_checkpoint)
+{
+    CNode::ClearBanned();
+    vector<CNode*> vPeers;
+    vPeers.push_back(NewDownloadPeer(1));
+    vPeers.push_back(NewDownloadPeer(2));
+    vector<CBlock> vHeaders = BuildHeaders(pindexGenesisBlock->GetBlockHash(), pindexGenesisBlock->nTime + 60, 1001);
+
+    // The last one is at the height of the first checkpoint
+    pnodeHeaderSync = vPeers[0];
+    ProcessHeaders(vPeers[0], vHeaders);
+    BOOST_CHECK(CNode::IsBanned(vPeers[0]->addr));
+    BOOST_CHECK(vHeaderChain.empty());
+
+    pnodeHeaderSync = vPeers[1];
+    ProcessHeaders(vPeers[1], vector<CBlock>(vHeaders.begin(), vHeaders.end() - 1));
+    BOOST_CHECK(!CNode::IsBanned(vPeers[1]->addr));
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 1000U);
+
+    ResetBlockDownload();
+    DeleteDownloadPeers(vPeers);
+}
+
+BOOST_AUTO_TEST_CASE(block_download_window)
+{
+    int64 nNow = GetTime();
+    SetMockTime(nNow);
+    vector<CNode*> vPeers;
+    for (unsigned int n = 1; n <= 65; n++)
+        vPeers.push_back(NewDownloadPeer(n));
+
+    // Past the checkpoints, where any header will do
+    CBlockIndex* pindexBase = AddFakeBlockIndex(GetRandHash(), 2000);
+    vector<CBlock> vHeaders = BuildHeaders(pindexBase->GetBlockHash(), pindexGenesisBlock->nTime + 60, 1500);
+    pnodeHeaderSync = vPeers[0];
+    ProcessHeaders(vPeers[0], vHeaders);
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 1500U);
+
+    // Each peer is asked for 16 blocks in chain order, until the window of
+    // 1024 is taken up
+    for (unsigned int n = 0; n < vPeers.size(); n++)
+    {
+        RequestBlocks(vPeers[n]);
+        vector<uint256> vRequested = TakeRequestedBlocks(vPeers[n]);
+        if (n < 64)
+        {
+            BOOST_CHECK_EQUAL(vRequested.size(), 16U);
+            for (unsigned int i = 0; i < vRequested.size(); i++)
+                BOOST_CHECK(vRequested[i] == vHeaderChain[16 * n + i]);
+        }
+        else
+            BOOST_CHECK(vRequested.empty());
+    }
+
+    // and no more while those are in flight
+    RequestBlocks(vPeers[0]);
+    BOOST_CHECK(TakeRequestedBlocks(vPeers[0]).empty());
+
+    // The first block of a full window is taken off a peer that holds it up
+    SetMockTime(nNow + 5);
+    RequestBlocks(vPeers[64]);
+    BOOST_CHECK(TakeRequestedBlocks(vPeers[64]).empty());
+    RequestBlocks(vPeers[64]);
+    vector<uint256> vRequested = TakeRequestedBlocks(vPeers[64]);
+    BOOST_CHECK_EQUAL(vRequested.size(), 1U);
+    BOOST_CHECK(vRequested[0] == vHeaderChain[0]);
+    BOOST_CHECK(!vPeers[0]->fDisconnect);
+    RequestBlocks(vPeers[0]);
+    BOOST_CHECK(TakeRequestedBlocks(vPeers[0]).empty());
+
+    ResetBlockDownload();
+    RemoveFakeBlockIndex(pindexBase);
+    DeleteDownloadPeers(vPeers);
+}
+
+BOOST_AUTO_TEST_CASE(block_download_stall)
+{
+    CNode::ClearBanned();
+    mapArgs["-banscore"] = "50";
+    int64 nNow = GetTime();
+    SetMockTime(nNow);
+    vector<CNode*> vPeers;
+    for (unsigned int n = 1; n <= 6; n++)
+        vPeers.push_back(NewDownloadPeer(n));
+    vector<CBlock> vHeaders = BuildHeaders(pindexGenesisBlock->GetBlockHash(), pindexGenesisBlock->nTime + 60, 10);
+    pnodeHeaderSync = vPeers[0];
+    ProcessHeaders(vPeers[0], vHeaders);
+
+    RequestBlocks(vPeers[1]);
+    BOOST_CHECK_EQUAL(TakeRequestedBlocks(vPeers[1]).size(), 10U);
+
+    // A peer that times out is not asked again, nor disconnected; the next
+    // one is asked instead
+    SetMockTime(nNow + 61);
+    RequestBlocks(vPeers[1]);
+    BOOST_CHECK(TakeRequestedBlocks(vPeers[1]).empty());
+    RequestBlocks(vPeers[2]);
+    BOOST_CHECK_EQUAL(TakeRequestedBlocks(vPeers[2]).size(), 10U);
+    BOOST_CHECK(!vPeers[1]->fDisconnect);
+
+    // Until the block turns up after all
+    CBlockIndex* pindexFirst = AddFakeBlockIndex(vHeaderChain[0], 1);
+    ProcessDownloadedBlocks();
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 9U);
+    BOOST_CHECK(vPeers[1]->fDisconnect);
+    BOOST_CHECK(!vPeers[2]->fDisconnect);
+
+    // Blocks four peers in turn did not send do not exist. The header chain
+    // is dropped, and the peer that sent it is to blame.
+    for (unsigned int n = 3; n <= 5; n++)
+    {
+        SetMockTime(nNow + 61 * (n - 1));
+        RequestBlocks(vPeers[n]);
+        BOOST_CHECK_EQUAL(TakeRequestedBlocks(vPeers[n]).size(), n < 5 ? 9U : 0U);
+    }
+    BOOST_CHECK(vHeaderChain.empty());
+    BOOST_CHECK(CNode::IsBanned(vPeers[0]->addr));
+    for (unsigned int n = 2; n <= 5; n++)
+        BOOST_CHECK(!vPeers[n]->fDisconnect && !CNode::IsBanned(vPeers[n]->addr));
+
+    // As are ones no one else would send
+    CNode::ClearBanned();
+    vHeaders = BuildHeaders(pindexFirst->GetBlockHash(), pindexGenesisBlock->nTime + 60, 10);
+    pnodeHeaderSync = vPeers[5];
+    ProcessHeaders(vPeers[5], vHeaders);
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 10U);
+    SetMockTime(nNow + 1000);
+    RequestBlocks(vPeers[2]);
+    BOOST_CHECK_EQUAL(TakeRequestedBlocks(vPeers[2]).size(), 10U);
+    SetMockTime(nNow + 1061);
+    RequestBlocks(vPeers[2]);
+    BOOST_CHECK(!vHeaderChain.empty());
+    SetMockTime(nNow + 1121);
+    RequestBlocks(vPeers[2]);
+    BOOST_CHECK(vHeaderChain.empty());
+    BOOST_CHECK(CNode::IsBanned(vPeers[5]->addr));
+    BOOST_CHECK(!vPeers[2]->fDisconnect);
+
+    ResetBlockDownload();
+    RemoveFakeBlockIndex(pindexFirst);
+    DeleteDownloadPeers(vPeers);
+}
+
+BOOST_AUTO_TEST_CASE(block_download_drain)
+{
+    CNode::ClearBanned();
+    vector<CNode*> vPeers;
+    vPeers.push_back(NewDownloadPeer(1));
+    vector<CBlock> vHeaders = BuildHeaders(pindexGenesisBlock->GetBlockHash(), pindexGenesisBlock->nTime + 60, 5);
+    pnodeHeaderSync = vPeers[0];
+    ProcessHeaders(vPeers[0], vHeaders);
+
+    // Downloaded blocks wait for the ones before them
+    AddDownloadedBlock(vHeaders[2]);
+    ProcessDownloadedBlocks();
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 5U);
+    CBlockIndex* pindexFirst = AddFakeBlockIndex(vHeaders[0].GetHash(), 1);
+    ProcessDownloadedBlocks();
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 4U);
+    BOOST_CHECK(vHeaderChain.front() == vHeaders[1].GetHash());
+    BOOST_CHECK_EQUAL(mapBlocksDownloaded.size(), 1U);
+
+    // and are processed in chain order once those are in. A block that is
+    // not valid drops the header chain, and its sender is to blame.
+    CBlockIndex* pindexSecond = AddFakeBlockIndex(vHeaders[1].GetHash(), 2);
+    ProcessDownloadedBlocks();
+    BOOST_CHECK(vHeaderChain.empty());
+    BOOST_CHECK(mapBlocksDownloaded.empty());
+    BOOST_CHECK_EQUAL(nBlocksDownloadedSize, 0U);
+    BOOST_CHECK(CNode::IsBanned(vPeers[0]->addr));
+
+    ResetBlockDownload();
+    RemoveFakeBlockIndex(pindexSecond);
+    RemoveFakeBlockIndex(pindexFirst);
+    DeleteDownloadPeers(vPeers);
+}
+
+// A block whose missing transactions do not come is asked of another peer
+// in full, and a compact block from another peer takes its place
+BOOST_AUTO_TEST_CASE(compact_block_stale)
+{
+    int64 nNow = GetTime();
+    SetMockTime(nNow);
+    vector<CNode*> vPeers;
+    for (unsigned int n = 1; n <= 3; n++)
+        vPeers.push_back(NewDownloadPeer(n));
+    CBlock block = BuildCompactTestBlock();
+    uint256 hash = block.GetHash();
+    CInv inv(MSG_BLOCK, hash);
+    mapAlreadyAskedFor[inv] = nNow * 1000000;
+
+    // None of the transactions are in the memory pool
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CCompactBlock(block);
+    CDataStream ssCopy(ss);
+    BOOST_CHECK(ProcessMessage(vPeers[0], "cmpctblock", ssCopy));
+    BOOST_CHECK(TakeSentCommand(vPeers[0], "getblocktxn"));
+
+    // While the peer may still answer, the block is left to it
+    ssCopy = ss;
+    BOOST_CHECK(ProcessMessage(vPeers[1], "cmpctblock", ssCopy));
+    BOOST_CHECK(!TakeSentCommand(vPeers[1], "getblocktxn"));
+    RequestStalePartialBlocks(vPeers[1]);
+    BOOST_CHECK(TakeRequestedBlocks(vPeers[1]).empty());
+
+    // It never does
+    SetMockTime(nNow + 61);
+    RequestStalePartialBlocks(vPeers[0]);
+    BOOST_CHECK(TakeRequestedBlocks(vPeers[0]).empty());
+    RequestStalePartialBlocks(vPeers[2]);
+    vector<uint256> vRequested = TakeRequestedBlocks(vPeers[2]);
+    BOOST_CHECK_EQUAL(vRequested.size(), 1U);
+    BOOST_CHECK(vRequested[0] == hash);
+    RequestStalePartialBlocks(vPeers[1]);
+    BOOST_CHECK(TakeRequestedBlocks(vPeers[1]).empty());
+
+    // A peer that goes away gives way at once
+    ssCopy = ss;
+    BOOST_CHECK(ProcessMessage(vPeers[0], "cmpctblock", ssCopy));
+    BOOST_CHECK(TakeSentCommand(vPeers[0], "getblocktxn"));
+    vPeers[0]->fDisconnect = true;
+    ssCopy = ss;
+    BOOST_CHECK(ProcessMessage(vPeers[1], "cmpctblock", ssCopy));
+    BOOST_CHECK(TakeSentCommand(vPeers[1], "getblocktxn"));
+
+    // Left to time out, so no partial block outlives the test
+    SetMockTime(nNow + 200);
+    RequestStalePartialBlocks(vPeers[2]);
+    BOOST_CHECK_EQUAL(TakeRequestedBlocks(vPeers[2]).size(), 1U);
+
+    mapAlreadyAskedFor.erase(inv);
+    SetMockTime(0);
+    DeleteDownloadPeers(vPeers);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
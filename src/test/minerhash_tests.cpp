@@ -0,0 +1,68 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "minerhash.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(minerhash_tests)
+
+static CBlock MakeHeader(unsigned int nRoundMask)
+{
+    CBlock block;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+    block.nTime = 1398357357;
+    block.nBits = 0x1e0fffff;
+    block.nSuperBlock = 4242;
+    block.nRoundMask = nRoundMask;
+    return block;
+}
+
+// The engine must produce exactly CBlock::GetHash() for every header version
+BOOST_AUTO_TEST_CASE(minerhash_matches_gethash)
+{
+    unsigned int pnRoundMask[] = { 0, 1, 3, 7, 0xffffffff };
+    BOOST_FOREACH(unsigned int nRoundMask, pnRoundMask)
+    {
+        CBlock block = MakeHeader(nRoundMask);
+        CMinerHasher hasher;
+        hasher.SetWork(&block);
+        for (unsigned int nNonce = 0xfffffff0; nNonce != 0x10; nNonce++)
+        {
+            block.nNonce = nNonce;
+            BOOST_CHECK(hasher.Hash(nNonce) == block.GetHash());
+        }
+    }
+}
+
+// ScanHash returns the lowest hash of the range and the nonce producing it,
+// including ranges that are not a multiple of the lane count
+BOOST_AUTO_TEST_CASE(minerhash_scan)
+{
+    unsigned int pnCount[] = { 1, 3, CMinerHasher::LANES, 37 };
+    BOOST_FOREACH(unsigned int nCount, pnCount)
+    {
+        CBlock block = MakeHeader(7);
+        CMinerHasher hasher;
+        hasher.SetWork(&block);
+
+        uint256 hashBest = ~uint256(0);
+        unsigned int nNonceBest = 0;
+        for (unsigned int nNonce = 1000; nNonce < 1000 + nCount; nNonce++)
+        {
+            block.nNonce = nNonce;
+            if (block.GetHash() < hashBest)
+            {
+                hashBest = block.GetHash();
+                nNonceBest = nNonce;
+            }
+        }
+
+        unsigned int nNonceFound;
+        BOOST_CHECK(hasher.ScanHash(1000, nCount, nNonceFound) == hashBest);
+        BOOST_CHECK_EQUAL(nNonceFound, nNonceBest);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
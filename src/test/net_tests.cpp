@@ -0,0 +1,91 @@
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+// Wire bytes of a ping and a verack, as a peer would send them
+static vector<char> MakeMessages()
+{
+    CNode node(INVALID_SOCKET, CAddress());
+    node.PushMessage("ping", (uint64)42);
+    node.PushMessage("verack");
+    vector<char> vData;
+    BOOST_FOREACH(const CSendBuffer& buf, node.vSendMsg)
+        vData.insert(vData.end(), buf.pbegin, buf.pend);
+    return vData;
+}
+
+// Messages are framed however the bytes are split up, and junk before a
+// message start is skipped
+BOOST_AUTO_TEST_CASE(net_receive_framing)
+{
+    vector<char> vMessages = MakeMessages();
+    vector<char> vData(7, 'x');
+    vData.insert(vData.end(), vMessages.begin(), vMessages.end());
+
+    for (int nTry = 0; nTry < 20; nTry++)
+    {
+        CNode node(INVALID_SOCKET, CAddress());
+        unsigned int nPos = 0;
+        while (nPos < vData.size())
+        {
+            unsigned int nBytes = min((unsigned int)vData.size() - nPos, (unsigned int)(nTry == 0 ? 1 : 1 + GetRandInt(30)));
+            node.ReceiveMsgBytes(&vData[nPos], nBytes);
+            nPos += nBytes;
+        }
+
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2U);
+        BOOST_CHECK(node.vRecvMsg[0].Complete() && node.vRecvMsg[1].Complete());
+        BOOST_CHECK_EQUAL(node.vRecvMsg[0].hdr.GetCommand(), "ping");
+        BOOST_CHECK_EQUAL(node.vRecvMsg[1].hdr.GetCommand(), "verack");
+        BOOST_CHECK_EQUAL(node.nRecvQueueSize, vMessages.size());
+        uint64 nNonce = 0;
+        node.vRecvMsg[0].vRecv >> nNonce;
+        BOOST_CHECK_EQUAL(nNonce, 42U);
+        BOOST_CHECK(node.vRecvMsg[1].vRecv.empty());
+    }
+}
+
+// A message with a bad checksum is dropped, and the next one still arrives
+BOOST_AUTO_TEST_CASE(net_receive_checksum)
+{
+    vector<char> vData = MakeMessages();
+    vData[CMessageHeader::HEADER_SIZE] ^= 1;
+
+    CNode node(INVALID_SOCKET, CAddress());
+    BOOST_CHECK(node.ReceiveMsgBytes(&vData[0], CMessageHeader::HEADER_SIZE + 4) == false);
+    BOOST_CHECK(node.ReceiveMsgBytes(&vData[CMessageHeader::HEADER_SIZE + 4], vData.size() - CMessageHeader::HEADER_SIZE - 4));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK_EQUAL(node.vRecvMsg[0].hdr.GetCommand(), "verack");
+    BOOST_CHECK_EQUAL(node.nRecvQueueSize, (unsigned int)CMessageHeader::HEADER_SIZE);
+}
+
+// Raw and shared messages frame the same as ones built a field at a time
+BOOST_AUTO_TEST_CASE(net_send_shared)
+{
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << (uint64)42;
+    CSendBuffer msg = CreateMessage("ping", ssPayload);
+
+    CNode node(INVALID_SOCKET, CAddress());
+    node.PushMessageShared(msg);
+    node.PushMessageShared(msg);
+    node.PushMessageRaw("ping", CSendBuffer(msg.pOwner, msg.pbegin + CMessageHeader::HEADER_SIZE, msg.pend));
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 4U);
+    BOOST_CHECK(node.vSendMsg[0].pbegin == msg.pbegin && node.vSendMsg[1].pbegin == msg.pbegin);
+    BOOST_CHECK(node.vSendMsg[3].pbegin == msg.pbegin + CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(node.nSendSize, 3 * msg.size());
+
+    vector<char> vMessages = MakeMessages();
+    BOOST_CHECK(vector<char>(msg.pbegin, msg.pend) == vector<char>(vMessages.begin(), vMessages.begin() + msg.size()));
+    vector<char> vRaw;
+    vRaw.insert(vRaw.end(), node.vSendMsg[2].pbegin, node.vSendMsg[2].pend);
+    vRaw.insert(vRaw.end(), node.vSendMsg[3].pbegin, node.vSendMsg[3].pend);
+    BOOST_CHECK(vector<char>(msg.pbegin, msg.pend) == vRaw);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
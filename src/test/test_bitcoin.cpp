@@ -17,6 +17,7 @@ struct TestingSetup {
         fPrintToDebugger = true; // don't want to write to debug.log file
         noui_connect();
         bitdb.MakeMock();
+        InitSignatureCache();
         LoadBlockIndex(true);
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -27,6 +28,7 @@ struct TestingSetup {
     {
         delete pwalletMain;
         pwalletMain = NULL;
+        CloseTxDB();
         bitdb.Flush(true);
     }
 };
@@ -262,4 +262,44 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+// Queued script checks give the same answer as VerifySignature()
+BOOST_AUTO_TEST_CASE(test_ScriptCheck)
+{
+    CBasicKeyStore keystore;
+    MapPrevTx dummyInputs;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, dummyInputs);
+
+    CTransaction t1;
+    t1.vin.resize(3);
+    t1.vin[0].prevout.hash = dummyTransactions[0].GetHash();
+    t1.vin[0].prevout.n = 1;
+    t1.vin[1].prevout.hash = dummyTransactions[1].GetHash();
+    t1.vin[1].prevout.n = 0;
+    t1.vin[2].prevout.hash = dummyTransactions[1].GetHash();
+    t1.vin[2].prevout.n = 1;
+    t1.vout.resize(1);
+    t1.vout[0].nValue = 90*CENT;
+    t1.vout[0].scriptPubKey << OP_1;
+    for (unsigned int i = 0; i < t1.vin.size(); i++)
+        BOOST_CHECK(SignSignature(keystore, dummyInputs[t1.vin[i].prevout.hash].second, t1, i));
+
+    vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < t1.vin.size(); i++)
+    {
+        const CTransaction& txFrom = dummyInputs[t1.vin[i].prevout.hash].second;
+        BOOST_CHECK(VerifySignature(txFrom, t1, i, true, 0));
+        CScriptCheck check(txFrom, t1, i, true, 0);
+        vChecks.push_back(CScriptCheck());
+        check.swap(vChecks.back());
+    }
+    BOOST_FOREACH(const CScriptCheck& check, vChecks)
+        BOOST_CHECK(check());
+
+    // The checks refer to the spending transaction, so changing it after
+    // they were queued invalidates the signatures
+    t1.vout[0].nValue = 89*CENT;
+    BOOST_FOREACH(const CScriptCheck& check, vChecks)
+        BOOST_CHECK(!check());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
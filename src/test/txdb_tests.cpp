@@ -0,0 +1,137 @@
+#include <boost/test/unit_test.hpp>
+
+#include "db.h"
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+// Writes inside a transaction are private to it until the commit
+BOOST_AUTO_TEST_CASE(txdb_cache_txn)
+{
+    uint256 hash = GetRandHash();
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), 2);
+    CTxIndex txindexRead;
+
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+        BOOST_CHECK(txdb.ReadTxIndex(hash, txindexRead));
+        BOOST_CHECK(txindexRead.pos == txindex.pos);
+        BOOST_CHECK(txdb.TxnAbort());
+        BOOST_CHECK(!txdb.ContainsTx(hash));
+    }
+    BOOST_CHECK(!CTxDB("r").ContainsTx(hash));
+
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+        BOOST_CHECK(txdb.TxnCommit());
+    }
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hash, txindexRead));
+    BOOST_CHECK(txindexRead.pos == txindex.pos);
+    BOOST_CHECK_EQUAL(txindexRead.vSpent.size(), 2U);
+
+    // Marking an output spent
+    txindex.vSpent[1] = CDiskTxPos(4, 5, 6);
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+        BOOST_CHECK(txdb.TxnCommit());
+    }
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hash, txindexRead));
+    BOOST_CHECK(txindexRead.vSpent[1] == txindex.vSpent[1]);
+}
+
+// Records survive being written out and dropped from the cache, and
+// erased records stay erased
+BOOST_AUTO_TEST_CASE(txdb_cache_flush)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(3);
+    uint256 hash = tx.GetHash();
+
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.AddTxIndex(tx, CDiskTxPos(7, 8, 9), 0));
+        BOOST_CHECK(txdb.TxnCommit());
+        BOOST_CHECK(txdb.FlushTxIndexCache());
+    }
+
+    // Drop everything clean from the cache and read the record from disk
+    SetTxIndexCacheSize(0);
+    CTxIndex txindexRead;
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hash, txindexRead));
+    BOOST_CHECK(txindexRead.pos == CDiskTxPos(7, 8, 9));
+    BOOST_CHECK_EQUAL(txindexRead.vSpent.size(), 3U);
+    SetTxIndexCacheSize(25 << 20);
+
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.EraseTxIndex(tx));
+        BOOST_CHECK(!txdb.ContainsTx(hash));
+        BOOST_CHECK(txdb.TxnCommit());
+    }
+    BOOST_CHECK(!CTxDB("r").ContainsTx(hash));
+    BOOST_CHECK(CTxDB().FlushTxIndexCache());
+    BOOST_CHECK(!CTxDB("r").ReadTxIndex(hash, txindexRead));
+}
+
+// Stake fields not in the cache are read back from the block index
+// record, and the flags keep their on-disk width
+BOOST_AUTO_TEST_CASE(txdb_blockindex_stake)
+{
+    uint256 hash = GetRandHash();
+    CBlockIndex index;
+    index.phashBlock = &hash;
+    index.nHeight = -STAKE_CACHE_DEPTH - 10;
+    index.SetProofOfStake();
+    index.SetStakeEntropyBit(1);
+
+    // The stake fields are neither cached nor on disk yet, so the record
+    // is refused until they are filled in
+    CDiskBlockIndex diskindex(&index);
+    BOOST_CHECK(diskindex.fStakeMissing);
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(!txdb.WriteBlockIndex(diskindex));
+        BOOST_CHECK(txdb.TxnAbort());
+    }
+    CDiskBlockIndex diskindexNone;
+    BOOST_CHECK(!CTxDB("r").ReadBlockIndex(hash, diskindexNone));
+
+    diskindex.stake.prevoutStake = COutPoint(GetRandHash(), 3);
+    diskindex.stake.nStakeTime = 12345;
+    diskindex.stake.hashProofOfStake = GetRandHash();
+    diskindex.fStakeMissing = false;
+    {
+        CTxDB txdb;
+        BOOST_CHECK(txdb.TxnBegin());
+        BOOST_CHECK(txdb.WriteBlockIndex(diskindex));
+        BOOST_CHECK(txdb.TxnCommit());
+    }
+
+    CBlockIndexStake stake;
+    BOOST_CHECK(GetBlockIndexStake(&index, stake));
+    BOOST_CHECK(stake.prevoutStake == diskindex.stake.prevoutStake);
+    BOOST_CHECK_EQUAL(stake.nStakeTime, 12345U);
+    BOOST_CHECK(stake.hashProofOfStake == diskindex.stake.hashProofOfStake);
+
+    CDiskBlockIndex diskindexRead;
+    BOOST_CHECK(CTxDB("r").ReadBlockIndex(hash, diskindexRead));
+    BOOST_CHECK_EQUAL((unsigned int)diskindexRead.nFlags, (unsigned int)index.nFlags);
+    BOOST_CHECK(diskindexRead.IsProofOfStake());
+    BOOST_CHECK_EQUAL(diskindexRead.GetStakeEntropyBit(), 1U);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(diskindexRead, SER_DISK, CLIENT_VERSION), ::GetSerializeSize(diskindex, SER_DISK, CLIENT_VERSION));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -262,4 +262,12 @@ BOOST_AUTO_TEST_CASE(util_IsHex)
     BOOST_CHECK(!IsHex("0x0000"));
 }
 
+BOOST_AUTO_TEST_CASE(util_SipHashUint256)
+{
+    // The reference key, and the bytes 00 to 1f as the message
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL,
+                                     uint256("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")),
+                      0x7127512f72f27cceULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file